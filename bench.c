@@ -0,0 +1,758 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+// load generator: many connections, each on its own thread, send a read/write/delete mix
+// and record every response time in a log-linear histogram.
+//
+// closed loop: each connection keeps --depth requests outstanding and sends the next one as
+// soon as a response arrives, so the server sets the pace.
+// open loop: requests are scheduled at a fixed total --rate whether or not earlier ones have
+// been answered, and latency counts from the scheduled time, so a stalled server shows up
+// in the tail instead of silently lowering the offered load.
+
+#define READ_CHUNK_SIZE 65536
+#define MAX_IN_FLIGHT 4096
+#define PRELOAD_BATCH_BYTES (4 * 1024 * 1024)
+
+void error(char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+// histogram: values below 2^HIST_SUB_BITS get their own bucket, above that every power of
+// two is split into 2^HIST_SUB_BITS buckets, about 1.6% relative error over the whole range
+#define HIST_SUB_BITS 6
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct Histogram
+{
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+} Histogram;
+
+int hist_index(unsigned long long value)
+{
+    if (value < HIST_SUB_COUNT)
+    {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) - HIST_SUB_COUNT);
+}
+
+// highest value that lands in a bucket
+unsigned long long hist_value(int index)
+{
+    if (index < HIST_SUB_COUNT)
+    {
+        return index;
+    }
+    int shift = index / HIST_SUB_COUNT - 1;
+    unsigned long long low = (unsigned long long)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void hist_record(Histogram *hist, unsigned long long value)
+{
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+void hist_merge(Histogram *into, const Histogram *from)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+unsigned long long hist_percentile(const Histogram *hist, double percentile)
+{
+    unsigned long long rank = (unsigned long long)ceil(hist->total * percentile / 100.0);
+    unsigned long long seen = 0;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= rank)
+        {
+            return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+enum
+{
+    BENCH_READ,
+    BENCH_WRITE,
+    BENCH_DELETE,
+    BENCH_OPS
+};
+
+const char *bench_op_names[] = {"read", "write", "delete"};
+
+typedef struct Config
+{
+    struct sockaddr_in addr;
+    int connections;
+    double duration;
+    double rate; // total requests per second, 0 for closed loop
+    int depth;
+    int mix[BENCH_OPS]; // percentages
+    int keys;
+    int zipf;
+    double theta;
+    int value_min;
+    int value_max;
+    int preload;
+} Config;
+
+Config config = {
+    .connections = 16,
+    .duration = 10,
+    .depth = 1,
+    .mix = {90, 10, 0},
+    .keys = 100000,
+    .theta = 0.99,
+    .value_min = 100,
+    .value_max = 100,
+    .preload = 1,
+};
+
+// every value sent is a prefix of this
+char *value_pool;
+
+volatile int stop;
+
+unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long next_random(unsigned long long *state)
+{
+    unsigned long long x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+double next_uniform(unsigned long long *state)
+{
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipfian ranks as generated by YCSB (Gray et al., "Quickly generating billion-record
+// synthetic databases"); the constants only depend on the key count and theta
+double zipf_alpha, zipf_zetan, zipf_eta;
+
+void zipf_init(int n, double theta)
+{
+    double zeta2 = 1.0 + pow(0.5, theta);
+
+    zipf_zetan = 0;
+    for (int i = 1; i <= n; i++)
+    {
+        zipf_zetan += 1.0 / pow(i, theta);
+    }
+    zipf_alpha = 1.0 / (1.0 - theta);
+    zipf_eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf_zetan);
+}
+
+int zipf_rank(unsigned long long *state)
+{
+    double uz = next_uniform(state) * zipf_zetan;
+
+    if (uz < 1.0)
+    {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, config.theta))
+    {
+        return 1;
+    }
+    int rank = (int)(config.keys * pow(zipf_eta * (uz / zipf_zetan) - zipf_eta + 1, zipf_alpha));
+    return rank < config.keys ? rank : config.keys - 1;
+}
+
+// popular ranks are scattered over the key space instead of being neighbours
+int next_key(unsigned long long *state)
+{
+    if (!config.zipf)
+    {
+        return next_random(state) % config.keys;
+    }
+
+    unsigned long long h = zipf_rank(state);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h % config.keys;
+}
+
+int next_value_size(unsigned long long *state)
+{
+    if (config.value_min == config.value_max)
+    {
+        return config.value_min;
+    }
+    return config.value_min + next_random(state) % (config.value_max - config.value_min + 1);
+}
+
+int connect_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+
+    if (fd < 0)
+    {
+        error("ERROR opening socket");
+    }
+    if (connect(fd, (struct sockaddr *)&config.addr, sizeof(config.addr)) < 0)
+    {
+        error("ERROR connecting");
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// keys are the decimal text of their number, as for clients that send integer keys
+#define KEY_TEXT_SIZE 12
+
+// a request on its way out: the header and key, then value_len bytes of the value pool
+typedef struct Outgoing
+{
+    unsigned char header[PROTO_REQUEST_HEADER_SIZE + 8 + KEY_TEXT_SIZE];
+    size_t header_len;
+    size_t value_len;
+    size_t sent;
+} Outgoing;
+
+// writes are sets (an mset of one key), so they succeed whether or not the key exists
+void build_request(Outgoing *out, int op, int key, int value_size)
+{
+    char text[KEY_TEXT_SIZE];
+    int key_len = snprintf(text, sizeof(text), "%d", key);
+
+    out->sent = 0;
+    if (op == BENCH_WRITE)
+    {
+        proto_pack_request(out->header, OP_MSET, 1, 8 + key_len + value_size);
+        proto_pack_u32(out->header + PROTO_REQUEST_HEADER_SIZE, key_len);
+        memcpy(out->header + PROTO_REQUEST_HEADER_SIZE + 4, text, key_len);
+        proto_pack_u32(out->header + PROTO_REQUEST_HEADER_SIZE + 4 + key_len, value_size);
+        out->header_len = PROTO_REQUEST_HEADER_SIZE + 8 + key_len;
+        out->value_len = value_size;
+        return;
+    }
+
+    proto_pack_request(out->header, op == BENCH_READ ? OP_READ : OP_DELETE, key_len, 0);
+    memcpy(out->header + PROTO_REQUEST_HEADER_SIZE, text, key_len);
+    out->header_len = PROTO_REQUEST_HEADER_SIZE + key_len;
+    out->value_len = 0;
+}
+
+// write as much of the request as the non-blocking socket takes
+// returns 1 once all of it is out, 0 if the socket is full
+int send_request(int fd, Outgoing *out)
+{
+    while (out->sent < out->header_len + out->value_len)
+    {
+        struct iovec iov[2];
+        int count = 0;
+
+        if (out->sent < out->header_len)
+        {
+            iov[count].iov_base = out->header + out->sent;
+            iov[count++].iov_len = out->header_len - out->sent;
+            iov[count].iov_base = value_pool;
+            iov[count++].iov_len = out->value_len;
+        }
+        else
+        {
+            iov[count].iov_base = value_pool + (out->sent - out->header_len);
+            iov[count++].iov_len = out->header_len + out->value_len - out->sent;
+        }
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            error("ERROR writing to socket");
+        }
+        out->sent += n;
+    }
+    return 1;
+}
+
+// load every key once so reads hit, in mset batches of a few megabytes
+void preload(void)
+{
+    int fd = connect_server();
+    unsigned long long state = 0x9e3779b97f4a7c15ULL;
+    size_t cap = PRELOAD_BATCH_BYTES + 8 + KEY_TEXT_SIZE + config.value_max;
+    unsigned char *batch = malloc(cap);
+    unsigned char header[PROTO_RESPONSE_HEADER_SIZE];
+
+    if (batch == NULL)
+    {
+        error("ERROR allocating preload batch");
+    }
+    for (int key = 0; key < config.keys;)
+    {
+        size_t len = 0;
+        int count = 0;
+
+        while (key < config.keys && len < PRELOAD_BATCH_BYTES)
+        {
+            int size = next_value_size(&state);
+            int key_len = snprintf((char *)batch + len + 4, KEY_TEXT_SIZE, "%d", key);
+            proto_pack_u32(batch + len, key_len);
+            len += 4 + key_len;
+            proto_pack_u32(batch + len, size);
+            memcpy(batch + len + 4, value_pool, size);
+            len += 4 + size;
+            key++;
+            count++;
+        }
+
+        unsigned char request[PROTO_REQUEST_HEADER_SIZE];
+        struct iovec iov[2] = {{request, PROTO_REQUEST_HEADER_SIZE}, {batch, len}};
+        proto_pack_request(request, OP_MSET, count, len);
+        if (writev_full(fd, iov, 2) < 0)
+        {
+            error("ERROR writing to socket");
+        }
+
+        ResponseHeader res;
+        if (read_full(fd, header, PROTO_RESPONSE_HEADER_SIZE) <= 0)
+        {
+            error("ERROR reading from socket");
+        }
+        proto_unpack_response(header, &res);
+        if (res.status != STATUS_OK || res.payload_len > cap || read_full(fd, batch, res.payload_len) <= 0)
+        {
+            fprintf(stderr, "ERROR preloading keys: %s\n", proto_status_message(OP_MSET, res.status));
+            exit(1);
+        }
+    }
+    free(batch);
+    close(fd);
+}
+
+typedef struct Worker
+{
+    pthread_t thread;
+    int id;
+    Histogram hist[BENCH_OPS];
+    unsigned long long misses;
+    unsigned long long errors;
+} Worker;
+
+// one connection: send whenever the loop allows, match responses to requests in order. The
+// socket is non-blocking and responses are read while a large request is still going out:
+// the server stops reading once its responses back up, so blocking on a send could wait
+// for it forever
+void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    int fd = connect_server();
+    Outgoing out;
+    int sending = 0; // out is not all written yet
+    unsigned long long state = 0x2545f4914f6cdd1dULL * (worker->id + 1);
+    unsigned long long sent_at[MAX_IN_FLIGHT];
+    int ops[MAX_IN_FLIGHT];
+    int head = 0, in_flight = 0;
+    char *in = malloc(READ_CHUNK_SIZE);
+    size_t in_cap = READ_CHUNK_SIZE, in_len = 0;
+
+    // each connection offers an equal share of the total rate
+    double interval = config.rate > 0 ? 1e9 * config.connections / config.rate : 0;
+    double next_send = now_ns() + interval * next_uniform(&state);
+
+    if (in == NULL)
+    {
+        error("ERROR allocating buffer");
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0)
+    {
+        error("ERROR setting socket non-blocking");
+    }
+
+    while (!stop || in_flight > 0)
+    {
+        unsigned long long now = now_ns();
+
+        // finish the request partly sent, then send what is due
+        if (sending)
+        {
+            sending = !send_request(fd, &out);
+        }
+        while (!sending && !stop && in_flight < MAX_IN_FLIGHT &&
+               (config.rate > 0 ? next_send <= now : in_flight < config.depth))
+        {
+            int roll = next_random(&state) % 100;
+            int op = roll < config.mix[BENCH_READ] ? BENCH_READ : roll < config.mix[BENCH_READ] + config.mix[BENCH_WRITE] ? BENCH_WRITE : BENCH_DELETE;
+            int key = next_key(&state);
+
+            build_request(&out, op, key, op == BENCH_WRITE ? next_value_size(&state) : 0);
+            sending = !send_request(fd, &out);
+            int slot = (head + in_flight) % MAX_IN_FLIGHT;
+            ops[slot] = op;
+            sent_at[slot] = config.rate > 0 ? (unsigned long long)next_send : now;
+            in_flight++;
+            next_send += interval;
+        }
+
+        // wait for a response or room to send, or in open loop until the next send is due
+        struct timespec wait = {0, 10000000};
+        if (config.rate > 0 && !stop && !sending)
+        {
+            unsigned long long due = next_send > now ? (unsigned long long)(next_send - now) : 0;
+            wait.tv_sec = due / 1000000000ULL;
+            wait.tv_nsec = due % 1000000000ULL;
+        }
+        struct pollfd pfd = {fd, POLLIN | (sending ? POLLOUT : 0), 0};
+        if (ppoll(&pfd, 1, config.rate > 0 || stop ? &wait : NULL, NULL) <= 0 || !(pfd.revents & (POLLIN | POLLERR | POLLHUP)))
+        {
+            continue;
+        }
+
+        if (in_cap - in_len < READ_CHUNK_SIZE)
+        {
+            in_cap *= 2;
+            in = realloc(in, in_cap);
+            if (in == NULL)
+            {
+                error("ERROR allocating buffer");
+            }
+        }
+        ssize_t n = read(fd, in + in_len, in_cap - in_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            error("ERROR reading from socket");
+        }
+        in_len += n;
+
+        // consume every complete response
+        size_t pos = 0;
+        unsigned long long done = now_ns();
+        while (in_len - pos >= PROTO_RESPONSE_HEADER_SIZE)
+        {
+            ResponseHeader res;
+            proto_unpack_response((unsigned char *)in + pos, &res);
+            if (in_len - pos < PROTO_RESPONSE_HEADER_SIZE + res.payload_len)
+            {
+                break;
+            }
+
+            int op = ops[head];
+            if (res.status == STATUS_NOT_FOUND)
+            {
+                worker->misses++;
+            }
+            else if (res.status != STATUS_OK ||
+                     (op == BENCH_WRITE && (res.payload_len != 1 || in[pos + PROTO_RESPONSE_HEADER_SIZE] != STATUS_OK)))
+            {
+                worker->errors++;
+            }
+            hist_record(&worker->hist[op], done - sent_at[head]);
+            head = (head + 1) % MAX_IN_FLIGHT;
+            in_flight--;
+            pos += PROTO_RESPONSE_HEADER_SIZE + res.payload_len;
+        }
+        memmove(in, in + pos, in_len - pos);
+        in_len -= pos;
+    }
+
+    free(in);
+    close(fd);
+    return NULL;
+}
+
+void print_row(const char *name, const Histogram *hist)
+{
+    if (hist->total == 0)
+    {
+        return;
+    }
+    printf("%-8s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, hist->total,
+           hist_percentile(hist, 50) / 1000.0, hist_percentile(hist, 99) / 1000.0,
+           hist_percentile(hist, 99.9) / 1000.0, hist_percentile(hist, 99.99) / 1000.0, hist->max / 1000.0);
+}
+
+// parse "N" or "MIN-MAX", with an optional k or m suffix on each number
+int parse_size(const char *text, int *min, int *max)
+{
+    char *end;
+    long long value[2];
+
+    for (int i = 0; i < 2; i++)
+    {
+        value[i] = strtoll(text, &end, 10);
+        if (end == text)
+        {
+            return -1;
+        }
+        if (*end == 'k' || *end == 'K')
+        {
+            value[i] *= 1024;
+            end++;
+        }
+        else if (*end == 'm' || *end == 'M')
+        {
+            value[i] *= 1024 * 1024;
+            end++;
+        }
+        if (i == 0 && *end == '-')
+        {
+            text = end + 1;
+            continue;
+        }
+        if (i == 0)
+        {
+            value[1] = value[0];
+        }
+        break;
+    }
+    if (*end != '\0' || value[0] < 0 || value[1] < value[0] || value[1] > PROTO_MAX_VALUE_SIZE - 8)
+    {
+        return -1;
+    }
+    *min = value[0];
+    *max = value[1];
+    return 0;
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s <IP address> <Port number> [--connections N] [--duration S]\n", prog);
+    fprintf(stderr, "       [--rate R | --depth N] [--mix READ:WRITE:DELETE] [--keys N]\n");
+    fprintf(stderr, "       [--dist uniform|zipf] [--theta T] [--value-size N|MIN-MAX] [--no-preload]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'r'},
+        {"depth", required_argument, NULL, 'D'},
+        {"mix", required_argument, NULL, 'm'},
+        {"keys", required_argument, NULL, 'k'},
+        {"dist", required_argument, NULL, 'z'},
+        {"theta", required_argument, NULL, 'T'},
+        {"value-size", required_argument, NULL, 'v'},
+        {"no-preload", no_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:d:r:m:k:v:", long_options, NULL)) != -1)
+    {
+        if (opt == 'c' && atoi(optarg) > 0)
+        {
+            config.connections = atoi(optarg);
+        }
+        else if (opt == 'd' && atof(optarg) > 0)
+        {
+            config.duration = atof(optarg);
+        }
+        else if (opt == 'r' && atof(optarg) > 0)
+        {
+            config.rate = atof(optarg);
+        }
+        else if (opt == 'D' && atoi(optarg) > 0 && atoi(optarg) <= MAX_IN_FLIGHT)
+        {
+            config.depth = atoi(optarg);
+        }
+        else if (opt == 'm' && sscanf(optarg, "%d:%d:%d", &config.mix[0], &config.mix[1], &config.mix[2]) == 3 &&
+                 config.mix[0] >= 0 && config.mix[1] >= 0 && config.mix[2] >= 0 &&
+                 config.mix[0] + config.mix[1] + config.mix[2] == 100)
+        {
+        }
+        else if (opt == 'k' && atoi(optarg) > 0)
+        {
+            config.keys = atoi(optarg);
+        }
+        else if (opt == 'z' && (strcmp(optarg, "uniform") == 0 || strcmp(optarg, "zipf") == 0))
+        {
+            config.zipf = strcmp(optarg, "zipf") == 0;
+        }
+        else if (opt == 'T' && atof(optarg) > 0 && atof(optarg) < 1)
+        {
+            config.theta = atof(optarg);
+        }
+        else if (opt == 'v' && parse_size(optarg, &config.value_min, &config.value_max) == 0)
+        {
+        }
+        else if (opt == 'P')
+        {
+            config.preload = 0;
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(argv[0]);
+    }
+
+    config.addr.sin_family = AF_INET;
+    config.addr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &config.addr.sin_addr) <= 0)
+    {
+        struct hostent *server = gethostbyname(argv[optind]);
+        if (server == NULL)
+        {
+            fprintf(stderr, "ERROR, no such host\n");
+            exit(1);
+        }
+        memcpy(&config.addr.sin_addr, server->h_addr_list[0], server->h_length);
+    }
+
+    value_pool = malloc(config.value_max + 1);
+    if (value_pool == NULL)
+    {
+        error("ERROR allocating values");
+    }
+    for (int i = 0; i <= config.value_max; i++)
+    {
+        value_pool[i] = 'a' + i % 26;
+    }
+    if (config.zipf)
+    {
+        zipf_init(config.keys, config.theta);
+    }
+
+    if (config.preload)
+    {
+        printf("> Preloading %d keys\n", config.keys);
+        preload();
+    }
+
+    if (config.rate > 0)
+    {
+        printf("> %d connections, open loop at %.0f req/s", config.connections, config.rate);
+    }
+    else
+    {
+        printf("> %d connections, closed loop with %d in flight each", config.connections, config.depth);
+    }
+    printf(", mix %d/%d/%d read/write/delete, %s keys over %d", config.mix[0], config.mix[1], config.mix[2],
+           config.zipf ? "zipf" : "uniform", config.keys);
+    if (config.value_min == config.value_max)
+    {
+        printf(", values %d bytes, %.1f s\n", config.value_min, config.duration);
+    }
+    else
+    {
+        printf(", values %d-%d bytes, %.1f s\n", config.value_min, config.value_max, config.duration);
+    }
+    fflush(stdout);
+
+    Worker *workers = calloc(config.connections, sizeof(Worker));
+    if (workers == NULL)
+    {
+        error("ERROR allocating workers");
+    }
+    unsigned long long start = now_ns();
+    for (int i = 0; i < config.connections; i++)
+    {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+        {
+            error("ERROR creating thread");
+        }
+    }
+
+    struct timespec pause = {(time_t)config.duration, (long)((config.duration - (time_t)config.duration) * 1e9)};
+    nanosleep(&pause, NULL);
+    stop = 1;
+
+    Histogram *total = calloc(BENCH_OPS + 1, sizeof(Histogram));
+    unsigned long long misses = 0, errors = 0;
+    if (total == NULL)
+    {
+        error("ERROR allocating histograms");
+    }
+    for (int i = 0; i < config.connections; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        for (int op = 0; op < BENCH_OPS; op++)
+        {
+            hist_merge(&total[op], &workers[i].hist[op]);
+            hist_merge(&total[BENCH_OPS], &workers[i].hist[op]);
+        }
+        misses += workers[i].misses;
+        errors += workers[i].errors;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("requests %llu in %.2f s: %.0f req/s, %llu not found, %llu errors\n", total[BENCH_OPS].total, elapsed,
+           total[BENCH_OPS].total / elapsed, misses, errors);
+    printf("%-8s %12s %10s %10s %10s %10s %10s\n", "latency", "count", "p50 us", "p99 us", "p99.9 us", "p99.99 us", "max us");
+    for (int op = 0; op < BENCH_OPS; op++)
+    {
+        print_row(bench_op_names[op], &total[op]);
+    }
+    print_row("all", &total[BENCH_OPS]);
+
+    free(total);
+    free(workers);
+    free(value_pool);
+    return errors > 0;
+}
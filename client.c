@@ -1,40 +1,304 @@
 #include<stdio.h>
-#include<sys/types.h>
-#include<sys/socket.h>
-#include<netinet/in.h>
 #include<stdlib.h>
 #include<unistd.h>
 #include<string.h>
-#include<netdb.h>
-#include<arpa/inet.h>
+#include<errno.h>
 
-#define MAX_BUFFER_SIZE 256
+#include "decs.h"
+
+//servers a connect command may name
+#define MAX_SERVERS 64
 
 void error(char* msg){
     perror(msg);
     exit(1);
 }
 
+//the keys of a multi-key request, to label its per-key results
+typedef struct KeyList{
+    int nkeys;
+    char **keys;
+} KeyList;
+
+//a request in flight
+typedef struct Request{
+    long seq;
+    KeyList *list;
+    const char *server;         //labels the response of a request sent to each of several servers
+} Request;
+
+//the printed text of a response
+typedef struct Output{
+    int done;
+    char *text;
+    size_t len;
+} Output;
+
+//responses are printed in command order, whichever server answers first
+typedef struct Printer{
+    pthread_mutex_t lock;
+    pthread_cond_t printed_cond;
+    Output *slots;              //the output of every request in flight, by sequence number (ring)
+    int window;
+    long sent;
+    long printed;
+} Printer;
+
+Printer printer;
+
+void printer_init(int window){
+    pthread_mutex_init(&printer.lock, NULL);
+    pthread_cond_init(&printer.printed_cond, NULL);
+    printer.window = window;
+    printer.slots = (Output *)calloc(window, sizeof(Output));
+    if(printer.slots == NULL){
+        error("ERROR allocating output");
+    }
+}
+
+//wait until fewer than limit requests are unanswered (limit 1 waits for all of them)
+void wait_for_responses(int limit){
+    pthread_mutex_lock(&printer.lock);
+    while(printer.sent - printer.printed > 0 && printer.sent - printer.printed >= limit){
+        pthread_cond_wait(&printer.printed_cond, &printer.lock);
+    }
+    pthread_mutex_unlock(&printer.lock);
+}
+
+//number the next request, once there is room for it in the window
+Request *new_request(KeyList *list, const char *server){
+    Request *request = (Request *)malloc(sizeof(Request));
+    if(request == NULL){
+        error("ERROR allocating request");
+    }
+    wait_for_responses(printer.window);
+    pthread_mutex_lock(&printer.lock);
+    request->seq = printer.sent++;
+    pthread_mutex_unlock(&printer.lock);
+    request->list = list;
+    request->server = server;
+    return request;
+}
+
+//store the output of a request and print every output that is now next in line
+void finish_request(Request *request, char *text, size_t len){
+    pthread_mutex_lock(&printer.lock);
+    Output *slot = &printer.slots[request->seq % printer.window];
+    slot->text = text;
+    slot->len = len;
+    slot->done = 1;
+    while(printer.printed < printer.sent && printer.slots[printer.printed % printer.window].done){
+        slot = &printer.slots[printer.printed % printer.window];
+        fwrite(slot->text, 1, slot->len, stdout);
+        free(slot->text);
+        slot->done = 0;
+        printer.printed++;
+    }
+    //a window of one prints every response before the next prompt
+    fflush(stdout);
+    pthread_cond_broadcast(&printer.printed_cond);
+    pthread_mutex_unlock(&printer.lock);
+    free(request);
+}
+
+void free_keys(char **keys, int nkeys){
+    if(keys == NULL){
+        return;
+    }
+    for(int i = 0; i < nkeys; i++){
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+//print one result line per key of a multi-key response; returns -1 if the payload is malformed
+int print_multi_response(FILE *out, int opcode, KeyList *list, const unsigned char *payload, size_t len){
+    const unsigned char *end = payload + len;
+
+    for(int i = 0; i < list->nkeys; i++){
+        if(payload >= end){
+            return -1;
+        }
+        int status = *payload++;
+
+        if(opcode != OP_MGET){
+            fprintf(out, ">> Key %s: %s\n", list->keys[i], proto_status_message(opcode, status));
+            continue;
+        }
+        if(end - payload < 4){
+            return -1;
+        }
+        uint32_t value_len = proto_unpack_u32(payload);
+        payload += 4;
+        if((uint32_t)(end - payload) < value_len){
+            return -1;
+        }
+        if(status == STATUS_OK){
+            fprintf(out, ">> Key %s: Value: %.*s\n", list->keys[i], (int)value_len, payload);
+        }
+        else{
+            fprintf(out, ">> Key %s: %s\n", list->keys[i], proto_status_message(OP_MGET, status));
+        }
+        payload += value_len;
+    }
+    return payload == end ? 0 : -1;
+}
+
+//print the entries of a scan response and where to carry on from; returns -1 if the payload is malformed
+int print_scan_response(FILE *out, const unsigned char *payload, size_t len){
+    const unsigned char *end = payload + len;
+
+    if(len < 5){
+        return -1;
+    }
+    int more = payload[0];
+    uint32_t next_len = proto_unpack_u32(payload + 1);
+    const unsigned char *next = payload + 5;
+    if((uint32_t)(end - next) < next_len){
+        return -1;
+    }
+    payload = next + next_len;
+
+    int n = 0;
+    while(payload < end){
+        if(end - payload < 4){
+            return -1;
+        }
+        uint32_t key_len = proto_unpack_u32(payload);
+        const unsigned char *key = payload + 4;
+        if((uint32_t)(end - key) < key_len || end - key - key_len < 4){
+            return -1;
+        }
+        uint32_t value_len = proto_unpack_u32(key + key_len);
+        const unsigned char *value = key + key_len + 4;
+        if((uint32_t)(end - value) < value_len){
+            return -1;
+        }
+        fprintf(out, ">> Key %.*s: Value: %.*s\n", (int)key_len, key, (int)value_len, value);
+        payload = value + value_len;
+        n++;
+    }
+    if(n == 0 && !more){
+        fprintf(out, ">> No keys in range\n");
+    }
+    if(more){
+        fprintf(out, ">> More from: %.*s\n", (int)next_len, next);
+    }
+    return 0;
+}
+
+//keys are the text of one token, up to PROTO_MAX_KEY_SIZE bytes
+int valid_key(const char *key){
+    if(strlen(key) > PROTO_MAX_KEY_SIZE){
+        fprintf(stderr, "Error: Key longer than %d bytes\n", PROTO_MAX_KEY_SIZE);
+        return 0;
+    }
+    return 1;
+}
+
+//print the response to a request; runs on the library's I/O threads, and finish_request puts
+//the responses back in the order the requests were sent
+void print_reply(const DecsReply *reply, void *arg){
+    Request *request = (Request *)arg;
+    int opcode = reply->opcode;
+    const char *payload = (const char *)reply->payload;
+    int malformed = 0;
+    char *text = NULL;
+    size_t len = 0;
+
+    FILE *out = open_memstream(&text, &len);
+    if(out == NULL){
+        error("ERROR allocating output");
+    }
+    if(request->server != NULL){
+        fprintf(out, ">> Server %s\n", request->server);
+    }
+
+    if(reply->error != 0){
+        //the library reconnects, later commands can go on
+        fprintf(stderr, "ERROR reading from socket: %s\n", strerror(reply->error));
+    }
+    else if(reply->status == STATUS_OK && request->list != NULL){
+        malformed = print_multi_response(out, opcode, request->list, reply->payload, reply->payload_len) < 0;
+    }
+    else if(opcode == OP_CAS && reply->payload_len == 4){
+        //the new version, or the current one if the cas lost
+        fprintf(out, ">> %s (version %u)\n", proto_status_message(opcode, reply->status), proto_unpack_u32(reply->payload));
+    }
+    else if(reply->status != STATUS_OK){
+        fprintf(out, ">> %s\n", proto_status_message(opcode, reply->status));
+    }
+    else if(opcode == OP_READ || opcode == OP_INCR || opcode == OP_DECR){
+        fprintf(out, ">> Value: %.*s\n", (int)reply->payload_len, payload);
+    }
+    else if(opcode == OP_GETS && reply->payload_len >= 4){
+        fprintf(out, ">> Version: %u Value: %.*s\n", proto_unpack_u32(reply->payload), (int)reply->payload_len - 4, payload + 4);
+    }
+    else if(opcode == OP_GETSET){
+        fprintf(out, ">> Old value: %.*s\n", (int)reply->payload_len, payload);
+    }
+    else if(opcode == OP_SCAN){
+        malformed = print_scan_response(out, reply->payload, reply->payload_len) < 0;
+    }
+    else if(opcode == OP_STATS){
+        fprintf(out, "%.*s", (int)reply->payload_len, payload);
+    }
+    else{
+        fprintf(out, ">> %s\n", proto_status_message(opcode, reply->status));
+    }
+    if(malformed){
+        fprintf(stderr, "ERROR reading from socket: %s\n", strerror(EPROTO));
+    }
+
+    if(request->list != NULL){
+        free_keys(request->list->keys, request->list->nkeys);
+        free(request->list);
+    }
+    fclose(out);
+    finish_request(request, text, len);
+}
+
+//send a request without a key to every server, labelling the responses if there are several
+void submit_to_each(DecsCluster *cluster, int opcode){
+    int n = decs_cluster_size(cluster);
+
+    for(int i = 0; i < n; i++){
+        DecsPool *pool = decs_cluster_node(cluster, i);
+        if(decs_submit(pool, opcode, "", 0, NULL, 0, print_reply, new_request(NULL, n > 1 ? decs_pool_address(pool) : NULL)) < 0){
+            error("ERROR writing to socket");
+        }
+    }
+}
+
 int main(int argc, char* argv[])
 {
-    int sockfd = -1, n;
+    DecsCluster *cluster = NULL;
     char *line = NULL;
     size_t len = 0;
-    char buffer[MAX_BUFFER_SIZE];
 
-    if(argc < 2 || argc > 3){
-        fprintf(stderr, "usage: %s interactive|batch <filename>\n", argv[0]);
+    if(argc < 2 || argc > 4){
+        fprintf(stderr, "usage: %s interactive|batch <filename> [window]\n", argv[0]);
         exit(1);
     }
 
     FILE *input_stream = NULL;
+    int window = 1;
 
     if(strcmp(argv[1], "batch") == 0){
-        if(argc != 3){
-            fprintf(stderr, "usage: %s batch <filename>\n", argv[0]);
+        if(argc < 3){
+            fprintf(stderr, "usage: %s batch <filename> [window]\n", argv[0]);
             exit(1);
         }
 
+        //number of requests kept in flight; 1 waits for every response before sending the next
+        if(argc == 4){
+            window = atoi(argv[3]);
+            if(window < 1){
+                fprintf(stderr, "Error: window must be at least 1\n");
+                exit(1);
+            }
+        }
+
         input_stream = fopen(argv[2], "r");
         if(input_stream == NULL){
             error("Error opening file");
@@ -46,12 +310,14 @@ int main(int argc, char* argv[])
             exit(1);
         }
 
+        //interactive commands always wait for their response
         input_stream = stdin;
         printf("Entering interactive mode. Type your commands below:\n");
     }
     else{
         error("Invalid mode. Use 'interactive' or 'batch'.\n");
     }
+    printer_init(window);
 
     while(1){
         if(input_stream == stdin){
@@ -60,12 +326,7 @@ int main(int argc, char* argv[])
         int read_bytes = getline(&line, &len, input_stream);
 
         if(read_bytes < 0){
-            if(line){
-                free(line);
-            }
-            if(input_stream != stdin){
-                fclose(input_stream);
-            }
+            wait_for_responses(1);
             printf("End of input. Exiting client program.\n");
             break;
         }
@@ -88,155 +349,218 @@ int main(int argc, char* argv[])
 
         //connect
         if(strcmp(command, "connect") == 0){
-            if(sockfd >= 0){
-                printf("%d", sockfd);
+            if(cluster != NULL){
                 printf("Error: Already connected to server. Disconnect first.\n");
                 continue;
             }
-            
-            char *hostname = strtok(NULL, " ");
-            char* port_str = strtok(NULL, " ");
 
-            if(hostname == NULL || port_str == NULL){
-                fprintf(stderr, "Usage: connect <IP address> <port number>\n");
-                continue;
+            //keys are spread over every server given
+            const char *hosts[MAX_SERVERS];
+            int ports[MAX_SERVERS];
+            int nservers = 0;
+            char *hostname;
+            char *port_str = NULL;
+            while(nservers < MAX_SERVERS && (hostname = strtok(NULL, " ")) != NULL && (port_str = strtok(NULL, " ")) != NULL){
+                hosts[nservers] = hostname;
+                ports[nservers] = atoi(port_str);
+                nservers++;
             }
-            int portno = atoi(port_str);
-
-            struct sockaddr_in serv_addr;
 
-            sockfd = socket(AF_INET, SOCK_STREAM, 0);
-            if(sockfd < 0){
-                error("ERROR opening socket");
+            if(nservers == 0 || port_str == NULL){
+                fprintf(stderr, "Usage: connect <IP address> <port number> [<IP address> <port number> ...]\n");
+                continue;
             }
-            bzero((char *)&serv_addr, sizeof(serv_addr));
-            serv_addr.sin_family = AF_INET;
-            serv_addr.sin_port = htons(portno);
 
-            // Convert IPv4 address from text to binary form
-            if(inet_pton(AF_INET, hostname, &serv_addr.sin_addr) <= 0){
-
-                //gethostbyname resolves hostname to IP address
-                struct hostent *server = gethostbyname(hostname);
-                if(server == NULL){
+            //resolves hostnames unless they are IPv4 addresses already
+            cluster = decs_cluster_open(hosts, ports, nservers, NULL);
+            if(cluster == NULL){
+                if(errno == ENXIO){
                     fprintf(stderr, "ERROR, no such host\n");
-                    close(sockfd);
-                    sockfd = -1;
-                    continue;
                 }
-                bcopy((char *)server->h_addr_list[0], (char *)&serv_addr.sin_addr.s_addr, server->h_length);
+                else{
+                    printf("ERROR connecting");
+                }
+                continue;
+            }
+            for(int i = 0; i < nservers; i++){
+                printf("Successfuly connected to server %s\n", decs_pool_address(decs_cluster_node(cluster, i)));
             }
+        }
 
-            if(connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0){
-                printf("ERROR connecting");
-                close(sockfd);
-                sockfd = -1;
+        //addserver or removeserver: change the servers the keys are spread over
+        else if(strcmp(command, "addserver") == 0 || strcmp(command, "removeserver") == 0){
+            if(cluster == NULL){
+                printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
                 continue;
             }
+
+            int add = strcmp(command, "addserver") == 0;
+            char *hostname = strtok(NULL, " ");
+            char* port_str = strtok(NULL, " ");
+
+            if(hostname == NULL || port_str == NULL){
+                fprintf(stderr, "Usage: %s <IP address> <port number>\n", command);
+                continue;
+            }
+            if(!add && decs_cluster_size(cluster) == 1){
+                printf("Error: Cannot remove the last server. Use 'disconnect'\n");
+                continue;
+            }
+
+            //requests sent so far go where the keys were
+            wait_for_responses(1);
+            int rc = add ? decs_cluster_add(cluster, hostname, atoi(port_str)) : decs_cluster_remove(cluster, hostname, atoi(port_str));
+            if(rc == 0){
+                printf("%s server %s:%d\n", add ? "Added" : "Removed", hostname, atoi(port_str));
+            }
+            else if(errno == ENXIO){
+                fprintf(stderr, "ERROR, no such host\n");
+            }
+            else if(errno == EEXIST){
+                printf("Error: Already connected to server %s:%d\n", hostname, atoi(port_str));
+            }
+            else if(errno == ENOENT){
+                printf("Error: Not connected to server %s:%d\n", hostname, atoi(port_str));
+            }
             else{
-                printf("Successfuly connected to server %s:%d\n", inet_ntoa(serv_addr.sin_addr), ntohs(serv_addr.sin_port));
+                printf("ERROR connecting\n");
             }
         }
 
         //disconnect
         else if(strcmp(command, "disconnect") == 0){
-            if(sockfd < 0){
+            if(cluster == NULL){
                 printf("Error: Not connected to any server.\n");
             }
             else{
-                close(sockfd);
-                sockfd = -1;
+                wait_for_responses(1);
+                decs_cluster_close(cluster);
+                cluster = NULL;
                 printf("Disconnected from server\n");
             }
         }
 
         //exit
         else if(strcmp(command, "exit") == 0){
-            if(sockfd >= 0){
-                close(sockfd);
-                sockfd = -1;
+            if(cluster != NULL){
+                wait_for_responses(1);
+                decs_cluster_close(cluster);
+                cluster = NULL;
             }
             printf("Exiting client program.\n");
             break;
         }
 
-        //create or update
-        else if(strcmp(command, "create") == 0 || strcmp(command, "update") == 0){
-            if(sockfd < 0){
+        //create, update, append, prepend, getset or cas: commands that send a value
+        else if(strcmp(command, "create") == 0 || strcmp(command, "update") == 0 || strcmp(command, "append") == 0 ||
+                strcmp(command, "prepend") == 0 || strcmp(command, "getset") == 0 || strcmp(command, "cas") == 0){
+            if(cluster == NULL){
                 printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
                 continue;
             }
 
+            int opcode = proto_opcode_from_name(command);
+            //append and prepend keep the expiry time, the others can set it
+            int takes_ttl = opcode != OP_APPEND && opcode != OP_PREPEND;
             char* key_str = strtok(NULL, " ");
+            char* version_str = opcode == OP_CAS ? strtok(NULL, " ") : "";
             char* value_size_str = strtok(NULL, " ");
 
-            if(key_str == NULL || value_size_str == NULL){
-                fprintf(stderr, "Usage: %s <key> <value_size> <value>\n", command);
+            if(key_str == NULL || version_str == NULL || value_size_str == NULL){
+                fprintf(stderr, "Usage: %s <key>%s <value_size> <value>%s\n", command,
+                        opcode == OP_CAS ? " <version>" : "", takes_ttl ? " [ttl <seconds>]" : "");
+                continue;
+            }
+            if(!valid_key(key_str)){
                 continue;
             }
             int value_size = atoi(value_size_str);
             char *value = strtok(NULL, "");
+
+            //anything after value_size bytes of value has to be a ttl
+            unsigned ttl = 0;
+            int has_ttl = 0;
+            if(takes_ttl && value != NULL && value_size >= 0 && (int)strlen(value) > value_size){
+                char *options = value + value_size;
+                int used = 0;
+                if(sscanf(options, " ttl %u%n", &ttl, &used) == 1 && options[used] == '\0'){
+                    has_ttl = 1;
+                    *options = '\0';
+                }
+            }
             
             if(value == NULL || (int)strlen(value) != value_size){
                 fprintf(stderr, "Error: Value size does not match the specified size of %d bytes\n", value_size);
                 continue;
             }
 
-            //send command
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, command);
-            n = write(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
+            int rc;
+            if(opcode == OP_CAS){
+                rc = decs_cluster_submit_cas(cluster, key_str, strlen(key_str), strtoul(version_str, NULL, 10), value, value_size, has_ttl, ttl, print_reply, new_request(NULL, NULL));
+            }
+            else if(has_ttl){
+                rc = decs_cluster_submit_ttl(cluster, opcode, key_str, strlen(key_str), value, value_size, ttl, print_reply, new_request(NULL, NULL));
+            }
+            else{
+                rc = decs_cluster_submit(cluster, opcode, key_str, strlen(key_str), value, value_size, print_reply, new_request(NULL, NULL));
+            }
+            if(rc < 0){
                 error("ERROR writing to socket");
             }
+            wait_for_responses(window);
+        }
+
+        //read or gets
+        else if(strcmp(command, "read") == 0 || strcmp(command, "gets") == 0){
+            if(cluster == NULL){
+                printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
+                continue;
+            }
 
-            //send key
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, key_str);
-            n = write(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
-                error("ERROR writing to socket");
+            char* key_str = strtok(NULL, " ");
+
+            if(key_str == NULL){
+                fprintf(stderr, "Usage: %s <key>\n", command);
+                continue;
+            }
+            if(!valid_key(key_str)){
+                continue;
             }
 
-            //send value size
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, value_size_str);
-            n = write(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
+            if(decs_cluster_submit(cluster, proto_opcode_from_name(command), key_str, strlen(key_str), NULL, 0, print_reply, new_request(NULL, NULL)) < 0){
                 error("ERROR writing to socket");
             }
+            wait_for_responses(window);
+        }
 
-            //send value
-            int sent_bytes = 0;
+        //incr or decr, by 1 unless told otherwise
+        else if(strcmp(command, "incr") == 0 || strcmp(command, "decr") == 0){
+            if(cluster == NULL){
+                printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
+                continue;
+            }
 
-            while(sent_bytes < value_size){
-                int len_to_send;
-                if(value_size - sent_bytes > MAX_BUFFER_SIZE - 1){
-                    len_to_send = MAX_BUFFER_SIZE - 1;
-                }
-                else{
-                    len_to_send = value_size - sent_bytes;
-                }
+            char* key_str = strtok(NULL, " ");
+            char* delta_str = strtok(NULL, " ");
 
-                n = write(sockfd, value + sent_bytes, len_to_send);
-                if(n < 0){
-                    error("ERROR writing to socket");
-                }
-                sent_bytes += n;
+            if(key_str == NULL){
+                fprintf(stderr, "Usage: %s <key> [delta]\n", command);
+                continue;
+            }
+            if(!valid_key(key_str)){
+                continue;
             }
 
-            //read response
-            n = read(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
-                error("ERROR reading from socket");
+            int delta_size = delta_str != NULL ? strlen(delta_str) : 0;
+            if(decs_cluster_submit(cluster, proto_opcode_from_name(command), key_str, strlen(key_str), delta_str, delta_size, print_reply, new_request(NULL, NULL)) < 0){
+                error("ERROR writing to socket");
             }
-            buffer[n] = '\0';
-            printf(">> %s\n", buffer);
+            wait_for_responses(window);
         }
 
-        //read
-        else if(strcmp(command, "read") == 0){
-            if(sockfd < 0){
+        //delete
+        else if(strcmp(command, "delete") == 0){
+            if(cluster == NULL){
                 printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
                 continue;
             }
@@ -244,102 +568,150 @@ int main(int argc, char* argv[])
             char* key_str = strtok(NULL, " ");
 
             if(key_str == NULL){
-                fprintf(stderr, "Usage: read <key>\n");
+                fprintf(stderr, "Usage: delete <key>\n");
+                continue;
+            }
+            if(!valid_key(key_str)){
                 continue;
             }
 
-            //send command
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, command);
-            n = write(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
+            if(decs_cluster_submit(cluster, OP_DELETE, key_str, strlen(key_str), NULL, 0, print_reply, new_request(NULL, NULL)) < 0){
                 error("ERROR writing to socket");
             }
+            wait_for_responses(window);
+        }
+        //mget, mset or mdelete
+        else if(strcmp(command, "mget") == 0 || strcmp(command, "mset") == 0 || strcmp(command, "mdelete") == 0){
+            if(cluster == NULL){
+                printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
+                continue;
+            }
 
-            //send key
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, key_str);
-            n = write(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
-                error("ERROR writing to socket");
+            int opcode = proto_opcode_from_name(command);
+            int nkeys = 0;
+            int capacity = 16;
+            char **keys = (char **)malloc(capacity * sizeof(char *));
+            char **values = (char **)malloc(capacity * sizeof(char *));
+            if(keys == NULL || values == NULL){
+                error("ERROR allocating keys");
             }
 
-            //read response
-            n = read(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
-                error("ERROR reading from socket");
+            //mset takes key value pairs, values without spaces
+            char *key_str;
+            int missing_value = 0;
+            int bad_key = 0;
+            while((key_str = strtok(NULL, " ")) != NULL){
+                if(nkeys == capacity){
+                    capacity *= 2;
+                    keys = (char **)realloc(keys, capacity * sizeof(char *));
+                    values = (char **)realloc(values, capacity * sizeof(char *));
+                    if(keys == NULL || values == NULL){
+                        error("ERROR allocating keys");
+                    }
+                }
+                if(!valid_key(key_str)){
+                    bad_key = 1;
+                    break;
+                }
+                values[nkeys] = NULL;
+                if(opcode == OP_MSET && (values[nkeys] = strtok(NULL, " ")) == NULL){
+                    missing_value = 1;
+                    break;
+                }
+                //the line is reused for the next command, the keys outlive it
+                keys[nkeys] = strdup(key_str);
+                if(keys[nkeys] == NULL){
+                    error("ERROR allocating keys");
+                }
+                nkeys++;
             }
-            buffer[n] = '\0';
-            char *status = strtok(buffer, " ");
-            if(strcmp(status, "ERROR") == 0){
-                char *error_msg = strtok(NULL, "");
-                printf(">> %s\n", error_msg);
+
+            if(bad_key){
+                free_keys(keys, nkeys);
+                free(values);
                 continue;
             }
-            char* value_size_str = strtok(NULL, " ");
-            
-            int value_size = atoi(value_size_str);
-            char *value = (char *)malloc(value_size + 1);
-
-            int received_bytes = 0;
-
-            while(received_bytes < value_size){
-                int len_to_recieve;
-                if(value_size - received_bytes > MAX_BUFFER_SIZE - 1){
-                    len_to_recieve = MAX_BUFFER_SIZE - 1;
+            if(nkeys == 0 || missing_value){
+                if(opcode == OP_MSET){
+                    fprintf(stderr, "Usage: mset <key> <value> [<key> <value> ...]\n");
                 }
                 else{
-                    len_to_recieve = value_size - received_bytes;
+                    fprintf(stderr, "Usage: %s <key> [<key> ...]\n", command);
                 }
+                free_keys(keys, nkeys);
+                free(values);
+                continue;
+            }
 
-                n = read(sockfd, value + received_bytes, len_to_recieve);
-                if(n < 0){
-                    error("ERROR reading from socket");
-                }
-                received_bytes += n;
+            //the keys label the results and are freed once they are printed
+            KeyList *list = (KeyList *)malloc(sizeof(KeyList));
+            if(list == NULL){
+                error("ERROR allocating keys");
+            }
+            list->nkeys = nkeys;
+            list->keys = keys;
+            if(decs_cluster_submit_multi(cluster, opcode, (const char *const *)keys, NULL, (const char *const *)values, NULL, nkeys, print_reply, new_request(list, NULL)) < 0){
+                error("ERROR writing to socket");
             }
-            value[value_size] = '\0';
-            printf(">> Value: %s\n", value);
-            free(value);
+            free(values);
+            wait_for_responses(window);
         }
 
-        //delete
-        else if(strcmp(command, "delete") == 0){
-            if(sockfd < 0){
+        //scan
+        else if(strcmp(command, "scan") == 0){
+            if(cluster == NULL){
                 printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
                 continue;
             }
 
-            char* key_str = strtok(NULL, " ");
+            //'-' leaves the start or the end of the range open
+            char *start_str = strtok(NULL, " ");
+            char *end_str = strtok(NULL, " ");
+            char *limit_str = strtok(NULL, " ");
 
-            if(key_str == NULL){
-                fprintf(stderr, "Usage: delete <key>\n");
+            if(start_str == NULL || end_str == NULL){
+                fprintf(stderr, "Usage: scan <start key>|- <end key>|- [limit]\n");
+                continue;
+            }
+            if(!valid_key(start_str) || !valid_key(end_str)){
                 continue;
             }
+            if(strcmp(start_str, "-") == 0){
+                start_str = "";
+            }
+            if(strcmp(end_str, "-") == 0){
+                end_str = "";
+            }
+            uint32_t limit = limit_str != NULL ? (uint32_t)atoi(limit_str) : 0;
 
-            //send command
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, command);
-            n = write(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
+            if(decs_cluster_submit_scan(cluster, start_str, strlen(start_str), end_str, strlen(end_str), limit, print_reply, new_request(NULL, NULL)) < 0){
                 error("ERROR writing to socket");
             }
+            wait_for_responses(window);
+        }
 
-            //send key
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, key_str);
-            n = write(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
-                error("ERROR writing to socket");
+        //snapshot
+        else if(strcmp(command, "snapshot") == 0){
+            if(cluster == NULL){
+                printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
+                continue;
             }
 
-            //read response
-            n = read(sockfd, buffer, MAX_BUFFER_SIZE-1);
-            if(n < 0){
-                error("ERROR reading from socket");
+            //the snapshot covers everything sent before it, on every server
+            submit_to_each(cluster, OP_SNAPSHOT);
+            wait_for_responses(1);
+        }
+
+        //stats
+        else if(strcmp(command, "stats") == 0){
+            if(cluster == NULL){
+                printf("Error: Not connected to any server. Use 'connect <IP address> <port number>'\n");
+                continue;
             }
-            buffer[n] = '\0';
-            printf(">> %s\n", buffer);
+
+            //stats describe each server after everything sent before them
+            submit_to_each(cluster, OP_STATS);
+            wait_for_responses(1);
         }
 
         //unknown command
@@ -354,10 +726,11 @@ int main(int argc, char* argv[])
     if(input_stream != stdin){
         fclose(input_stream);
     }
-    if(sockfd >= 0){
-        close(sockfd);
-        sockfd = -1;
+    if(cluster != NULL){
+        decs_cluster_close(cluster);
+        cluster = NULL;
     }
+    free(printer.slots);
     return 0;
 
 }
\ No newline at end of file
@@ -0,0 +1,1506 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<time.h>
+#include<netdb.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<sys/socket.h>
+#include<arpa/inet.h>
+
+#include "decs.h"
+
+#define READ_CHUNK_SIZE 65536
+#define DEFAULT_VIRTUAL_NODES 160
+
+//a request waiting for its response
+typedef struct Pending{
+    int opcode;
+    DecsCallback callback;
+    void *arg;
+} Pending;
+
+//a request to call back once the pool lock is released
+typedef struct Completion{
+    Pending pending;
+    DecsReply reply;
+} Completion;
+
+enum{
+    CONNECTION_DOWN,            //closed, reopened at retry_at
+    CONNECTION_CONNECTING,      //reopening, given up at retry_at
+    CONNECTION_UP
+};
+
+//one connection of a pool; the input and the bytes being written belong to the I/O thread,
+//everything else is guarded by the pool lock
+typedef struct Connection{
+    int fd;
+    int state;
+    long long retry_at;
+    int delay;                  //ms until the next reconnect if this one fails
+    Pending *pending;           //every outstanding request, oldest first (ring)
+    int head;
+    int count;
+    int cap;
+    unsigned char *out;         //requests queued but not yet handed to the I/O thread
+    size_t out_len;
+    size_t out_cap;
+    unsigned char *writing;     //requests being written
+    size_t write_off;
+    size_t write_len;
+    size_t write_cap;
+    unsigned char *in;          //bytes received but not yet consumed
+    size_t in_start;
+    size_t in_len;
+    size_t in_cap;
+} Connection;
+
+struct DecsPool{
+    DecsOptions options;
+    struct sockaddr_in addr;
+    char address[INET_ADDRSTRLEN + 8];
+    Connection *conns;
+    int nconns;
+    int next;                   //where the search for the least loaded connection starts
+    pthread_mutex_t lock;
+    pthread_cond_t idle_cond;   //signalled whenever requests complete
+    long outstanding;           //requests submitted whose callbacks have not returned
+    int stopping;
+    int sleeping;               //the I/O thread is blocked in poll, or about to be
+    int woken;
+    int wake[2];                //a byte on this pipe interrupts the poll
+    Completion *done;           //completions collected by the I/O thread
+    int ndone;
+    int done_cap;
+    pthread_t thread;
+};
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//returns 0 on success, -1 with errno set if the buffer cannot grow
+static int reserve(unsigned char **buf, size_t *cap, size_t need){
+    if(need <= *cap){
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap : 4096;
+    while(new_cap < need){
+        new_cap *= 2;
+    }
+    unsigned char *data = (unsigned char *)realloc(*buf, new_cap);
+    if(data == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    *buf = data;
+    *cap = new_cap;
+    return 0;
+}
+
+static int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+        return -1;
+    }
+    return 0;
+}
+
+//open a socket to the server; a nonblocking connect may return before it is done (errno EINPROGRESS)
+static int open_socket(DecsPool *pool, int nonblocking){
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0){
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(nonblocking && set_nonblocking(fd) < 0){
+        close(fd);
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr *)&pool->addr, sizeof(pool->addr)) < 0){
+        if(nonblocking && errno == EINPROGRESS){
+            return fd;
+        }
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if(!nonblocking && set_nonblocking(fd) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int add_completion(DecsPool *pool, const Pending *pending, const DecsReply *reply){
+    if(pool->ndone == pool->done_cap){
+        int cap = pool->done_cap ? pool->done_cap * 2 : 64;
+        Completion *done = (Completion *)realloc(pool->done, cap * sizeof(Completion));
+        if(done == NULL){
+            return -1;
+        }
+        pool->done = done;
+        pool->done_cap = cap;
+    }
+    pool->done[pool->ndone].pending = *pending;
+    pool->done[pool->ndone].reply = *reply;
+    pool->ndone++;
+    return 0;
+}
+
+//call back everything collected; called with the pool lock held, which is released meanwhile
+static void run_completions(DecsPool *pool){
+    int ndone = pool->ndone;
+
+    if(ndone == 0){
+        return;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 0; i < ndone; i++){
+        Completion *completion = &pool->done[i];
+        completion->pending.callback(&completion->reply, completion->pending.arg);
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->ndone = 0;
+    pool->outstanding -= ndone;
+    pthread_cond_broadcast(&pool->idle_cond);
+}
+
+//close a connection, fail everything outstanding on it with err and schedule the reconnect
+static void fail_connection(DecsPool *pool, Connection *conn, int err){
+    Pending *ring = conn->pending;
+    int head = conn->head;
+    int count = conn->count;
+    int cap = conn->cap;
+
+    //the connection is left consistent first: running callbacks below releases the lock
+    conn->pending = NULL;
+    conn->head = 0;
+    conn->count = 0;
+    conn->cap = 0;
+    conn->out_len = 0;
+    conn->write_off = 0;
+    conn->write_len = 0;
+    //responses already collected keep pointing into the input until their callbacks return
+    conn->in_start = 0;
+    conn->in_len = 0;
+    if(conn->fd >= 0){
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->state = CONNECTION_DOWN;
+    conn->retry_at = now_ms() + conn->delay;
+    conn->delay = conn->delay * 2 < pool->options.reconnect_max_delay ? conn->delay * 2 : pool->options.reconnect_max_delay;
+
+    DecsReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.error = err;
+    for(int i = 0; i < count; i++){
+        Pending *pending = &ring[(head + i) % cap];
+        reply.opcode = pending->opcode;
+        if(add_completion(pool, pending, &reply) == 0){
+            continue;
+        }
+        //every callback has to run: make room by running the ones collected so far, or with
+        //none to run, call this one back right away rather than wait for memory
+        run_completions(pool);
+        if(add_completion(pool, pending, &reply) < 0){
+            pthread_mutex_unlock(&pool->lock);
+            pending->callback(&reply, pending->arg);
+            pthread_mutex_lock(&pool->lock);
+            pool->outstanding--;
+            pthread_cond_broadcast(&pool->idle_cond);
+        }
+    }
+    free(ring);
+}
+
+static void start_reconnect(DecsPool *pool, Connection *conn){
+    conn->fd = open_socket(pool, 1);
+    if(conn->fd < 0){
+        fail_connection(pool, conn, errno);
+        return;
+    }
+    conn->state = CONNECTION_CONNECTING;
+    conn->retry_at = now_ms() + pool->options.connect_timeout;
+}
+
+static void finish_reconnect(DecsPool *pool, Connection *conn){
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0){
+        err = errno;
+    }
+    if(err != 0){
+        fail_connection(pool, conn, err);
+        return;
+    }
+    conn->state = CONNECTION_UP;
+    conn->delay = pool->options.reconnect_delay;
+}
+
+//write as much of the queued requests as the socket takes; returns 0 or an errno value
+static int write_output(Connection *conn){
+    while(conn->write_off < conn->write_len){
+        ssize_t n = send(conn->fd, conn->writing + conn->write_off, conn->write_len - conn->write_off, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : errno;
+        }
+        conn->write_off += n;
+    }
+    conn->write_off = 0;
+    conn->write_len = 0;
+    return 0;
+}
+
+//read what the socket has, at least enough for the response at the front; returns 0 or an errno value
+static int read_input(Connection *conn){
+    if(conn->in_start > 0){
+        memmove(conn->in, conn->in + conn->in_start, conn->in_len);
+        conn->in_start = 0;
+    }
+    size_t need = conn->in_len + READ_CHUNK_SIZE;
+    if(conn->in_len >= PROTO_RESPONSE_HEADER_SIZE){
+        ResponseHeader res;
+        proto_unpack_response(conn->in, &res);
+        if(PROTO_RESPONSE_HEADER_SIZE + (size_t)res.payload_len > need){
+            need = PROTO_RESPONSE_HEADER_SIZE + (size_t)res.payload_len;
+        }
+    }
+    if(reserve(&conn->in, &conn->in_cap, need) < 0){
+        return ENOMEM;
+    }
+
+    ssize_t n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+    if(n < 0){
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : errno;
+    }
+    if(n == 0){
+        return ECONNRESET;
+    }
+    conn->in_len += n;
+    return 0;
+}
+
+//match every whole response received to the oldest outstanding request; returns 0 or an errno value
+static int collect_responses(DecsPool *pool, Connection *conn){
+    while(conn->in_len >= PROTO_RESPONSE_HEADER_SIZE){
+        ResponseHeader res;
+        proto_unpack_response(conn->in + conn->in_start, &res);
+        if(res.version != PROTO_VERSION || res.payload_len > PROTO_MAX_VALUE_SIZE || conn->count == 0){
+            return EPROTO;
+        }
+        size_t frame_len = PROTO_RESPONSE_HEADER_SIZE + (size_t)res.payload_len;
+        if(conn->in_len < frame_len){
+            break;
+        }
+
+        Pending *pending = &conn->pending[conn->head];
+        DecsReply reply;
+        reply.error = 0;
+        reply.opcode = pending->opcode;
+        reply.status = res.status;
+        reply.payload = conn->in + conn->in_start + PROTO_RESPONSE_HEADER_SIZE;
+        reply.payload_len = res.payload_len;
+        if(add_completion(pool, pending, &reply) < 0){
+            return ENOMEM;
+        }
+        //the payload stays where it is until the next read_input
+        conn->in_start += frame_len;
+        conn->in_len -= frame_len;
+        conn->head = (conn->head + 1) % conn->cap;
+        conn->count--;
+    }
+    return 0;
+}
+
+static void *io_thread(void *arg){
+    DecsPool *pool = (DecsPool *)arg;
+    struct pollfd *fds = (struct pollfd *)calloc(pool->nconns + 1, sizeof(struct pollfd));
+
+    pthread_mutex_lock(&pool->lock);
+    while(fds != NULL && !pool->stopping){
+        //callbacks release the lock, so whatever they or other threads queued meanwhile is
+        //only seen below
+        run_completions(pool);
+
+        long long now = now_ms();
+        int timeout = -1;
+
+        fds[0].fd = pool->wake[0];
+        fds[0].events = POLLIN;
+        for(int i = 0; i < pool->nconns; i++){
+            Connection *conn = &pool->conns[i];
+            struct pollfd *pfd = &fds[i + 1];
+
+            if(conn->state == CONNECTION_DOWN && now >= conn->retry_at){
+                start_reconnect(pool, conn);
+            }
+            pfd->fd = conn->fd;
+            pfd->events = 0;
+            if(conn->state == CONNECTION_UP){
+                //hand the queued requests over unless the last ones are still being written
+                if(conn->write_len == 0 && conn->out_len > 0){
+                    unsigned char *buf = conn->writing;
+                    size_t cap = conn->write_cap;
+                    conn->writing = conn->out;
+                    conn->write_len = conn->out_len;
+                    conn->write_cap = conn->out_cap;
+                    conn->out = buf;
+                    conn->out_len = 0;
+                    conn->out_cap = cap;
+                }
+                pfd->events = POLLIN | (conn->write_len > 0 ? POLLOUT : 0);
+            }
+            else{
+                if(conn->state == CONNECTION_CONNECTING){
+                    pfd->events = POLLOUT;
+                }
+                int wait = conn->retry_at > now ? (int)(conn->retry_at - now) : 0;
+                if(timeout < 0 || wait < timeout){
+                    timeout = wait;
+                }
+            }
+        }
+        if(pool->ndone > 0){
+            //failed reconnects to call back first
+            continue;
+        }
+
+        pool->sleeping = 1;
+        pthread_mutex_unlock(&pool->lock);
+        int ready = poll(fds, pool->nconns + 1, timeout);
+        pthread_mutex_lock(&pool->lock);
+        pool->sleeping = 0;
+        if(ready < 0){
+            continue;
+        }
+
+        if(fds[0].revents){
+            char drain[64];
+            while(read(pool->wake[0], drain, sizeof(drain)) > 0){
+            }
+            pool->woken = 0;
+        }
+        now = now_ms();
+        for(int i = 0; i < pool->nconns; i++){
+            Connection *conn = &pool->conns[i];
+            short revents = fds[i + 1].revents;
+
+            if(fds[i + 1].fd != conn->fd){
+                continue;
+            }
+            if(conn->state == CONNECTION_CONNECTING){
+                if(revents){
+                    finish_reconnect(pool, conn);
+                }
+                else if(now >= conn->retry_at){
+                    fail_connection(pool, conn, ETIMEDOUT);
+                }
+                continue;
+            }
+            if(conn->state != CONNECTION_UP){
+                continue;
+            }
+
+            //responses that made it are collected before a failure to write
+            int err = 0;
+            if(revents & (POLLIN | POLLERR | POLLHUP)){
+                err = read_input(conn);
+                if(err == 0){
+                    err = collect_responses(pool, conn);
+                }
+            }
+            if(err == 0 && (revents & POLLOUT)){
+                err = write_output(conn);
+            }
+            if(err != 0){
+                fail_connection(pool, conn, err);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(fds);
+    return NULL;
+}
+
+//the connection with the fewest requests outstanding, preferring open ones
+static Connection *pick_connection(DecsPool *pool){
+    Connection *best = NULL;
+
+    for(int i = 0; i < pool->nconns; i++){
+        Connection *conn = &pool->conns[(pool->next + i) % pool->nconns];
+        if(best == NULL || (conn->state == CONNECTION_UP && best->state != CONNECTION_UP) ||
+           ((conn->state == CONNECTION_UP) == (best->state == CONNECTION_UP) && conn->count < best->count)){
+            best = conn;
+        }
+    }
+    pool->next = (pool->next + 1) % pool->nconns;
+    return best;
+}
+
+//lock the pool, queue a request header and key and record the request as outstanding
+//returns where its value_size bytes of value go, or NULL with errno set (and the pool unlocked)
+static unsigned char *begin_frame(DecsPool *pool, int opcode, const void *key, uint32_t key_len, size_t value_size, DecsCallback callback, void *arg){
+    size_t key_size = key != NULL ? key_len : 0;
+
+    pthread_mutex_lock(&pool->lock);
+    Connection *conn = pick_connection(pool);
+    if(conn->count == conn->cap){
+        int cap = conn->cap ? conn->cap * 2 : 64;
+        Pending *pending = (Pending *)malloc(cap * sizeof(Pending));
+        if(pending == NULL){
+            pthread_mutex_unlock(&pool->lock);
+            errno = ENOMEM;
+            return NULL;
+        }
+        for(int i = 0; i < conn->count; i++){
+            pending[i] = conn->pending[(conn->head + i) % conn->cap];
+        }
+        free(conn->pending);
+        conn->pending = pending;
+        conn->head = 0;
+        conn->cap = cap;
+    }
+    if(reserve(&conn->out, &conn->out_cap, conn->out_len + PROTO_REQUEST_HEADER_SIZE + key_size + value_size) < 0){
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    unsigned char *frame = conn->out + conn->out_len;
+    proto_pack_request(frame, opcode, key_len, value_size);
+    if(key_size > 0){
+        memcpy(frame + PROTO_REQUEST_HEADER_SIZE, key, key_size);
+    }
+    conn->out_len += PROTO_REQUEST_HEADER_SIZE + key_size + value_size;
+
+    Pending *pending = &conn->pending[(conn->head + conn->count) % conn->cap];
+    pending->opcode = opcode & ~PROTO_FLAG_TTL;
+    pending->callback = callback;
+    pending->arg = arg;
+    conn->count++;
+    pool->outstanding++;
+    return frame + PROTO_REQUEST_HEADER_SIZE + key_size;
+}
+
+//wake the I/O thread to send the request and unlock the pool
+static int end_frame(DecsPool *pool){
+    if(pool->sleeping && !pool->woken){
+        char byte = 0;
+        pool->woken = 1;
+        if(write(pool->wake[1], &byte, 1) < 0 && errno != EAGAIN){
+            pool->woken = 0;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int decs_submitv(DecsPool *pool, int opcode, const void *key, uint32_t key_len, const struct iovec *value, int nvalue, DecsCallback callback, void *arg){
+    size_t value_size = 0;
+    for(int i = 0; i < nvalue; i++){
+        value_size += value[i].iov_len;
+    }
+
+    unsigned char *dst = begin_frame(pool, opcode, key, key_len, value_size, callback, arg);
+    if(dst == NULL){
+        return -1;
+    }
+    for(int i = 0; i < nvalue; i++){
+        if(value[i].iov_len > 0){
+            memcpy(dst, value[i].iov_base, value[i].iov_len);
+            dst += value[i].iov_len;
+        }
+    }
+    return end_frame(pool);
+}
+
+int decs_submit(DecsPool *pool, int opcode, const void *key, uint32_t key_len, const void *value, uint32_t value_len, DecsCallback callback, void *arg){
+    unsigned char *dst = begin_frame(pool, opcode, key, key_len, value_len, callback, arg);
+    if(dst == NULL){
+        return -1;
+    }
+    if(value_len > 0){
+        memcpy(dst, value, value_len);
+    }
+    return end_frame(pool);
+}
+
+int decs_submit_ttl(DecsPool *pool, int opcode, const void *key, uint32_t key_len, const void *value, uint32_t value_len, unsigned ttl, DecsCallback callback, void *arg){
+    unsigned char *dst = begin_frame(pool, opcode | PROTO_FLAG_TTL, key, key_len, (size_t)value_len + 4, callback, arg);
+    if(dst == NULL){
+        return -1;
+    }
+    proto_pack_u32(dst, ttl);
+    if(value_len > 0){
+        memcpy(dst + 4, value, value_len);
+    }
+    return end_frame(pool);
+}
+
+int decs_submit_cas(DecsPool *pool, const void *key, uint32_t key_len, uint32_t version, const void *value, uint32_t value_len, int has_ttl, unsigned ttl, DecsCallback callback, void *arg){
+    int opcode = has_ttl ? OP_CAS | PROTO_FLAG_TTL : OP_CAS;
+    unsigned char *dst = begin_frame(pool, opcode, key, key_len, (has_ttl ? 8 : 4) + (size_t)value_len, callback, arg);
+    if(dst == NULL){
+        return -1;
+    }
+    if(has_ttl){
+        proto_pack_u32(dst, ttl);
+        dst += 4;
+    }
+    proto_pack_u32(dst, version);
+    if(value_len > 0){
+        memcpy(dst + 4, value, value_len);
+    }
+    return end_frame(pool);
+}
+
+int decs_submit_multi(DecsPool *pool, int opcode, const char *const *keys, const uint32_t *key_lens, const char *const *values, const uint32_t *value_lens, int nkeys, DecsCallback callback, void *arg){
+    size_t value_size = 0;
+    for(int i = 0; i < nkeys; i++){
+        value_size += 4 + (key_lens != NULL ? key_lens[i] : strlen(keys[i]));
+        if(opcode == OP_MSET){
+            value_size += 4 + (value_lens != NULL ? value_lens[i] : strlen(values[i]));
+        }
+    }
+
+    unsigned char *dst = begin_frame(pool, opcode, NULL, nkeys, value_size, callback, arg);
+    if(dst == NULL){
+        return -1;
+    }
+    for(int i = 0; i < nkeys; i++){
+        uint32_t key_len = key_lens != NULL ? key_lens[i] : strlen(keys[i]);
+        proto_pack_u32(dst, key_len);
+        memcpy(dst + 4, keys[i], key_len);
+        dst += 4 + key_len;
+        if(opcode == OP_MSET){
+            uint32_t len = value_lens != NULL ? value_lens[i] : strlen(values[i]);
+            proto_pack_u32(dst, len);
+            memcpy(dst + 4, values[i], len);
+            dst += 4 + len;
+        }
+    }
+    return end_frame(pool);
+}
+
+int decs_submit_scan(DecsPool *pool, const void *start, uint32_t start_len, const void *end, uint32_t end_len, uint32_t limit, DecsCallback callback, void *arg){
+    unsigned char *dst = begin_frame(pool, OP_SCAN, start, start_len, 4 + (size_t)end_len, callback, arg);
+    if(dst == NULL){
+        return -1;
+    }
+    proto_pack_u32(dst, limit);
+    if(end_len > 0){
+        memcpy(dst + 4, end, end_len);
+    }
+    return end_frame(pool);
+}
+
+void decs_default_options(DecsOptions *options){
+    options->connections = 1;
+    options->connect_timeout = 1000;
+    options->reconnect_delay = 100;
+    options->reconnect_max_delay = 5000;
+    options->virtual_nodes = DEFAULT_VIRTUAL_NODES;
+}
+
+static void free_pool(DecsPool *pool){
+    for(int i = 0; i < pool->nconns; i++){
+        Connection *conn = &pool->conns[i];
+        if(conn->fd >= 0){
+            close(conn->fd);
+        }
+        free(conn->pending);
+        free(conn->out);
+        free(conn->writing);
+        free(conn->in);
+    }
+    if(pool->wake[0] >= 0){
+        close(pool->wake[0]);
+        close(pool->wake[1]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool->conns);
+    free(pool->done);
+    free(pool);
+}
+
+//resolve host (a name or an IPv4 address) and name the server "address:port"
+//returns 0, or -1 with errno ENXIO if host does not resolve
+static int resolve_address(const char *host, int port, struct sockaddr_in *addr, char *name, size_t name_size){
+    struct addrinfo hints, *result;
+    char ip[INET_ADDRSTRLEN];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, NULL, &hints, &result) != 0){
+        errno = ENXIO;
+        return -1;
+    }
+    memcpy(addr, result->ai_addr, sizeof(*addr));
+    freeaddrinfo(result);
+    addr->sin_port = htons(port);
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    snprintf(name, name_size, "%s:%d", ip, port);
+    return 0;
+}
+
+DecsPool *decs_pool_open(const char *host, int port, const DecsOptions *options){
+    DecsPool *pool = (DecsPool *)calloc(1, sizeof(DecsPool));
+    if(pool == NULL){
+        return NULL;
+    }
+    if(options != NULL){
+        pool->options = *options;
+    }
+    else{
+        decs_default_options(&pool->options);
+    }
+    if(pool->options.connections < 1){
+        pool->options.connections = 1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pool->wake[0] = -1;
+
+    int saved;
+    if(resolve_address(host, port, &pool->addr, pool->address, sizeof(pool->address)) < 0){
+        goto fail;
+    }
+    pool->conns = (Connection *)calloc(pool->options.connections, sizeof(Connection));
+    if(pool->conns == NULL || pipe(pool->wake) < 0){
+        goto fail;
+    }
+    set_nonblocking(pool->wake[0]);
+    set_nonblocking(pool->wake[1]);
+    for(int i = 0; i < pool->options.connections; i++){
+        Connection *conn = &pool->conns[i];
+        conn->fd = open_socket(pool, 0);
+        pool->nconns++;
+        if(conn->fd < 0){
+            goto fail;
+        }
+        conn->state = CONNECTION_UP;
+        conn->delay = pool->options.reconnect_delay;
+    }
+    errno = pthread_create(&pool->thread, NULL, io_thread, pool);
+    if(errno != 0){
+        goto fail;
+    }
+    return pool;
+
+fail:
+    saved = errno;
+    free_pool(pool);
+    errno = saved;
+    return NULL;
+}
+
+void decs_pool_close(DecsPool *pool){
+    decs_pool_wait(pool, 1);
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    char byte = 0;
+    if(write(pool->wake[1], &byte, 1) < 0){
+        //the pipe is full, so the thread is already awake
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->thread, NULL);
+    free_pool(pool);
+}
+
+const char *decs_pool_address(const DecsPool *pool){
+    return pool->address;
+}
+
+void decs_pool_wait(DecsPool *pool, long limit){
+    pthread_mutex_lock(&pool->lock);
+    while(pool->outstanding > 0 && pool->outstanding >= limit){
+        pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void decs_future_init(DecsFuture *future){
+    memset(future, 0, sizeof(*future));
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->done_cond, NULL);
+}
+
+void decs_future_complete(const DecsReply *reply, void *arg){
+    DecsFuture *future = (DecsFuture *)arg;
+    DecsReply copy = *reply;
+
+    //the reply outlives the callback, so the payload is copied
+    copy.payload = NULL;
+    if(reply->payload_len > 0){
+        unsigned char *payload = (unsigned char *)malloc(reply->payload_len);
+        if(payload == NULL){
+            copy.error = ENOMEM;
+            copy.payload_len = 0;
+        }
+        else{
+            memcpy(payload, reply->payload, reply->payload_len);
+            copy.payload = payload;
+        }
+    }
+
+    pthread_mutex_lock(&future->lock);
+    future->reply = copy;
+    future->done = 1;
+    pthread_cond_broadcast(&future->done_cond);
+    pthread_mutex_unlock(&future->lock);
+}
+
+const DecsReply *decs_future_wait(DecsFuture *future){
+    pthread_mutex_lock(&future->lock);
+    while(!future->done){
+        pthread_cond_wait(&future->done_cond, &future->lock);
+    }
+    pthread_mutex_unlock(&future->lock);
+    return &future->reply;
+}
+
+void decs_future_destroy(DecsFuture *future){
+    free((void *)future->reply.payload);
+    pthread_mutex_destroy(&future->lock);
+    pthread_cond_destroy(&future->done_cond);
+}
+
+//a point on the hash ring, owned by a server
+typedef struct RingPoint{
+    uint64_t hash;
+    int node;
+} RingPoint;
+
+struct DecsCluster{
+    DecsOptions options;
+    pthread_rwlock_t lock;      //read locked to route requests, write locked to change the servers
+    DecsPool **nodes;
+    int nnodes;
+    RingPoint *ring;            //every server's points, by hash
+    int nring;
+};
+
+//a request split over servers, answered once every part is back
+typedef struct Gather Gather;
+
+typedef struct Part{
+    Gather *gather;
+    unsigned char *payload;     //a copy, kept until the parts are merged
+    uint32_t payload_len;
+} Part;
+
+struct Gather{
+    pthread_mutex_t lock;
+    int opcode;
+    int nkeys;
+    int *part_of;               //the part each key went to, in request order
+    uint32_t limit;             //of a scan
+    Part *parts;
+    int nparts;
+    int remaining;              //parts still to come back, plus one while they are being sent
+    int error;
+    int status;
+    DecsCallback callback;
+    void *arg;
+};
+
+//an entry of a scan part, to sort the parts' entries together
+typedef struct ScanEntry{
+    const unsigned char *key;
+    uint32_t key_len;
+    const unsigned char *entry; //| key length (4) | key | value length (4) | value |
+    size_t entry_len;
+} ScanEntry;
+
+//64-bit FNV-1a with a final mix; unseeded, so every client puts keys in the same place
+static uint64_t ring_hash(const void *data, size_t len){
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for(size_t i = 0; i < len; i++){
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b){
+    const RingPoint *x = (const RingPoint *)a;
+    const RingPoint *y = (const RingPoint *)b;
+
+    if(x->hash != y->hash){
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->node - y->node;
+}
+
+//the points of nnodes servers, by hash; returns NULL if there is no memory for them
+static RingPoint *build_ring(DecsPool **nodes, int nnodes, int vnodes){
+    RingPoint *ring = (RingPoint *)malloc(((size_t)nnodes * vnodes + 1) * sizeof(RingPoint));
+    char name[INET_ADDRSTRLEN + 32];
+
+    if(ring == NULL){
+        return NULL;
+    }
+    for(int n = 0; n < nnodes; n++){
+        for(int v = 0; v < vnodes; v++){
+            int len = snprintf(name, sizeof(name), "%s#%d", decs_pool_address(nodes[n]), v);
+            ring[n * vnodes + v].hash = ring_hash(name, len);
+            ring[n * vnodes + v].node = n;
+        }
+    }
+    qsort(ring, (size_t)nnodes * vnodes, sizeof(RingPoint), compare_points);
+    return ring;
+}
+
+//the server a key belongs to: the owner of the first point at or after its hash, wrapping around
+static int route(const DecsCluster *cluster, const void *key, uint32_t key_len){
+    uint64_t h = ring_hash(key, key_len);
+    int lo = 0;
+    int hi = cluster->nring;
+
+    while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if(cluster->ring[mid].hash < h){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return cluster->ring[lo == cluster->nring ? 0 : lo].node;
+}
+
+//install a new set of servers, rebuilding the ring; called write locked
+//returns -1 with errno set, leaving the cluster as it was, if there is no memory
+static int set_nodes(DecsCluster *cluster, DecsPool **nodes, int nnodes){
+    RingPoint *ring = build_ring(nodes, nnodes, cluster->options.virtual_nodes);
+
+    if(ring == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    free(cluster->nodes);
+    free(cluster->ring);
+    cluster->nodes = nodes;
+    cluster->nnodes = nnodes;
+    cluster->ring = ring;
+    cluster->nring = nnodes * cluster->options.virtual_nodes;
+    return 0;
+}
+
+//the index of the server named address, or -1
+static int find_node(DecsCluster *cluster, const char *address){
+    for(int i = 0; i < cluster->nnodes; i++){
+        if(strcmp(decs_pool_address(cluster->nodes[i]), address) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+int decs_cluster_add(DecsCluster *cluster, const char *host, int port){
+    DecsPool *pool = decs_pool_open(host, port, &cluster->options);
+    if(pool == NULL){
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&cluster->lock);
+    int err = EEXIST;
+    DecsPool **nodes = NULL;
+    if(find_node(cluster, decs_pool_address(pool)) < 0){
+        err = ENOMEM;
+        nodes = (DecsPool **)malloc((cluster->nnodes + 1) * sizeof(DecsPool *));
+    }
+    if(nodes != NULL){
+        memcpy(nodes, cluster->nodes, cluster->nnodes * sizeof(DecsPool *));
+        nodes[cluster->nnodes] = pool;
+        if(set_nodes(cluster, nodes, cluster->nnodes + 1) == 0){
+            pthread_rwlock_unlock(&cluster->lock);
+            return 0;
+        }
+        free(nodes);
+    }
+    pthread_rwlock_unlock(&cluster->lock);
+    decs_pool_close(pool);
+    errno = err;
+    return -1;
+}
+
+int decs_cluster_remove(DecsCluster *cluster, const char *host, int port){
+    struct sockaddr_in addr;
+    char address[INET_ADDRSTRLEN + 8];
+
+    if(resolve_address(host, port, &addr, address, sizeof(address)) < 0){
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&cluster->lock);
+    int i = find_node(cluster, address);
+    if(i < 0){
+        pthread_rwlock_unlock(&cluster->lock);
+        errno = ENOENT;
+        return -1;
+    }
+    DecsPool *pool = cluster->nodes[i];
+    DecsPool **nodes = (DecsPool **)malloc((cluster->nnodes > 1 ? cluster->nnodes - 1 : 1) * sizeof(DecsPool *));
+    if(nodes == NULL){
+        pthread_rwlock_unlock(&cluster->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(nodes, cluster->nodes, i * sizeof(DecsPool *));
+    memcpy(nodes + i, cluster->nodes + i + 1, (cluster->nnodes - i - 1) * sizeof(DecsPool *));
+    if(set_nodes(cluster, nodes, cluster->nnodes - 1) < 0){
+        pthread_rwlock_unlock(&cluster->lock);
+        free(nodes);
+        return -1;
+    }
+    pthread_rwlock_unlock(&cluster->lock);
+
+    //no new requests can reach it now
+    decs_pool_close(pool);
+    return 0;
+}
+
+DecsCluster *decs_cluster_open(const char *const *hosts, const int *ports, int nservers, const DecsOptions *options){
+    DecsCluster *cluster = (DecsCluster *)calloc(1, sizeof(DecsCluster));
+    if(cluster == NULL){
+        return NULL;
+    }
+    if(options != NULL){
+        cluster->options = *options;
+    }
+    else{
+        decs_default_options(&cluster->options);
+    }
+    if(cluster->options.virtual_nodes < 1){
+        cluster->options.virtual_nodes = DEFAULT_VIRTUAL_NODES;
+    }
+    pthread_rwlock_init(&cluster->lock, NULL);
+
+    for(int i = 0; i < nservers; i++){
+        if(decs_cluster_add(cluster, hosts[i], ports[i]) < 0){
+            int saved = errno;
+            decs_cluster_close(cluster);
+            errno = saved;
+            return NULL;
+        }
+    }
+    return cluster;
+}
+
+void decs_cluster_close(DecsCluster *cluster){
+    for(int i = 0; i < cluster->nnodes; i++){
+        decs_pool_close(cluster->nodes[i]);
+    }
+    pthread_rwlock_destroy(&cluster->lock);
+    free(cluster->nodes);
+    free(cluster->ring);
+    free(cluster);
+}
+
+int decs_cluster_size(DecsCluster *cluster){
+    pthread_rwlock_rdlock(&cluster->lock);
+    int n = cluster->nnodes;
+    pthread_rwlock_unlock(&cluster->lock);
+    return n;
+}
+
+DecsPool *decs_cluster_node(DecsCluster *cluster, int i){
+    pthread_rwlock_rdlock(&cluster->lock);
+    DecsPool *pool = i >= 0 && i < cluster->nnodes ? cluster->nodes[i] : NULL;
+    pthread_rwlock_unlock(&cluster->lock);
+    return pool;
+}
+
+DecsPool *decs_cluster_route(DecsCluster *cluster, const void *key, uint32_t key_len){
+    pthread_rwlock_rdlock(&cluster->lock);
+    DecsPool *pool = cluster->nnodes > 0 ? cluster->nodes[route(cluster, key, key_len)] : NULL;
+    pthread_rwlock_unlock(&cluster->lock);
+    if(pool == NULL){
+        errno = ENOTCONN;
+    }
+    return pool;
+}
+
+//read lock the cluster and find the pool of a key's server; returns NULL with errno set (and the
+//cluster unlocked) if there are no servers
+static DecsPool *lock_route(DecsCluster *cluster, const void *key, uint32_t key_len){
+    pthread_rwlock_rdlock(&cluster->lock);
+    if(cluster->nnodes == 0){
+        pthread_rwlock_unlock(&cluster->lock);
+        errno = ENOTCONN;
+        return NULL;
+    }
+    return cluster->nodes[route(cluster, key, key_len)];
+}
+
+//unlock the cluster, keeping the errno of a failed submit
+static int unlock_route(DecsCluster *cluster, int rc){
+    int saved = errno;
+    pthread_rwlock_unlock(&cluster->lock);
+    errno = saved;
+    return rc;
+}
+
+int decs_cluster_submit(DecsCluster *cluster, int opcode, const void *key, uint32_t key_len, const void *value, uint32_t value_len, DecsCallback callback, void *arg){
+    DecsPool *pool = lock_route(cluster, key, key_len);
+    if(pool == NULL){
+        return -1;
+    }
+    return unlock_route(cluster, decs_submit(pool, opcode, key, key_len, value, value_len, callback, arg));
+}
+
+int decs_cluster_submit_ttl(DecsCluster *cluster, int opcode, const void *key, uint32_t key_len, const void *value, uint32_t value_len, unsigned ttl, DecsCallback callback, void *arg){
+    DecsPool *pool = lock_route(cluster, key, key_len);
+    if(pool == NULL){
+        return -1;
+    }
+    return unlock_route(cluster, decs_submit_ttl(pool, opcode, key, key_len, value, value_len, ttl, callback, arg));
+}
+
+int decs_cluster_submit_cas(DecsCluster *cluster, const void *key, uint32_t key_len, uint32_t version, const void *value, uint32_t value_len, int has_ttl, unsigned ttl, DecsCallback callback, void *arg){
+    DecsPool *pool = lock_route(cluster, key, key_len);
+    if(pool == NULL){
+        return -1;
+    }
+    return unlock_route(cluster, decs_submit_cas(pool, key, key_len, version, value, value_len, has_ttl, ttl, callback, arg));
+}
+
+static Gather *gather_new(int opcode, int nkeys, int nparts, DecsCallback callback, void *arg){
+    Gather *g = (Gather *)calloc(1, sizeof(Gather));
+    if(g == NULL){
+        return NULL;
+    }
+    g->part_of = (int *)malloc((nkeys > 0 ? nkeys : 1) * sizeof(int));
+    g->parts = (Part *)calloc(nparts, sizeof(Part));
+    if(g->part_of == NULL || g->parts == NULL){
+        free(g->part_of);
+        free(g->parts);
+        free(g);
+        return NULL;
+    }
+    pthread_mutex_init(&g->lock, NULL);
+    g->opcode = opcode;
+    g->nkeys = nkeys;
+    g->nparts = nparts;
+    g->remaining = nparts + 1;
+    g->status = STATUS_OK;
+    g->callback = callback;
+    g->arg = arg;
+    for(int i = 0; i < nparts; i++){
+        g->parts[i].gather = g;
+    }
+    return g;
+}
+
+static void gather_free(Gather *g){
+    for(int i = 0; i < g->nparts; i++){
+        free(g->parts[i].payload);
+    }
+    pthread_mutex_destroy(&g->lock);
+    free(g->parts);
+    free(g->part_of);
+    free(g);
+}
+
+//put the per-key results of the parts back in request order; returns 0 or an errno value
+static int merge_multi(Gather *g, unsigned char **out, uint32_t *out_len){
+    size_t total = 0;
+    for(int i = 0; i < g->nparts; i++){
+        total += g->parts[i].payload_len;
+    }
+    size_t *offsets = (size_t *)calloc(g->nparts, sizeof(size_t));
+    unsigned char *buf = (unsigned char *)malloc(total > 0 ? total : 1);
+    if(offsets == NULL || buf == NULL){
+        free(offsets);
+        free(buf);
+        return ENOMEM;
+    }
+
+    size_t len = 0;
+    int err = 0;
+    for(int i = 0; i < g->nkeys && err == 0; i++){
+        Part *part = &g->parts[g->part_of[i]];
+        size_t off = offsets[g->part_of[i]];
+        size_t entry = 1;
+
+        //| status (1) |, followed by | value length (4) | value | for an mget
+        if(g->opcode == OP_MGET){
+            entry = part->payload_len - off >= 5 ? 5 + (size_t)proto_unpack_u32(part->payload + off + 1) : 5;
+        }
+        if(off + entry > part->payload_len){
+            err = EPROTO;
+            break;
+        }
+        memcpy(buf + len, part->payload + off, entry);
+        len += entry;
+        offsets[g->part_of[i]] += entry;
+    }
+    for(int i = 0; i < g->nparts && err == 0; i++){
+        if(offsets[i] != g->parts[i].payload_len){
+            err = EPROTO;
+        }
+    }
+    free(offsets);
+    if(err != 0){
+        free(buf);
+        return err;
+    }
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
+
+//bytewise, a key sorting before every longer key it is a prefix of, as the server orders them
+static int compare_scan_entries(const void *a, const void *b){
+    const ScanEntry *x = (const ScanEntry *)a;
+    const ScanEntry *y = (const ScanEntry *)b;
+    int c = memcmp(x->key, y->key, x->key_len < y->key_len ? x->key_len : y->key_len);
+
+    if(c != 0){
+        return c;
+    }
+    return x->key_len < y->key_len ? -1 : x->key_len > y->key_len;
+}
+
+//merge the entries every server returned for a scan and keep the first limit of them
+//returns 0 or an errno value
+static int merge_scan(Gather *g, unsigned char **out, uint32_t *out_len){
+    uint32_t limit = g->limit == 0 ? PROTO_SCAN_DEFAULT_LIMIT : g->limit;
+    if(limit > PROTO_SCAN_MAX_LIMIT){
+        limit = PROTO_SCAN_MAX_LIMIT;
+    }
+
+    //each server returns at most limit entries
+    ScanEntry *entries = (ScanEntry *)malloc(((size_t)g->nparts * limit + 1) * sizeof(ScanEntry));
+    if(entries == NULL){
+        return ENOMEM;
+    }
+    size_t n = 0;
+    ScanEntry next;                 //where to continue from, if anywhere
+    int more = 0;
+    memset(&next, 0, sizeof(next));
+    for(int i = 0; i < g->nparts; i++){
+        const unsigned char *payload = g->parts[i].payload;
+        const unsigned char *end = payload + g->parts[i].payload_len;
+
+        if(end - payload < 5){
+            free(entries);
+            return EPROTO;
+        }
+        ScanEntry part_next;
+        part_next.key_len = proto_unpack_u32(payload + 1);
+        part_next.key = payload + 5;
+        if((uint32_t)(end - part_next.key) < part_next.key_len){
+            free(entries);
+            return EPROTO;
+        }
+        //a server with more to give continues past every entry it gave
+        if(payload[0] && (!more || compare_scan_entries(&part_next, &next) < 0)){
+            next = part_next;
+            more = 1;
+        }
+        payload = part_next.key + part_next.key_len;
+        while(payload < end){
+            ScanEntry *entry = &entries[n];
+            if(end - payload < 4 || n == (size_t)g->nparts * limit){
+                free(entries);
+                return EPROTO;
+            }
+            entry->key_len = proto_unpack_u32(payload);
+            entry->key = payload + 4;
+            if((uint32_t)(end - entry->key) < entry->key_len || end - entry->key - entry->key_len < 4){
+                free(entries);
+                return EPROTO;
+            }
+            uint32_t value_len = proto_unpack_u32(entry->key + entry->key_len);
+            if((uint32_t)(end - entry->key - entry->key_len - 4) < value_len){
+                free(entries);
+                return EPROTO;
+            }
+            entry->entry = payload;
+            entry->entry_len = 8 + (size_t)entry->key_len + value_len;
+            payload += entry->entry_len;
+            n++;
+        }
+    }
+    qsort(entries, n, sizeof(ScanEntry), compare_scan_entries);
+    //whatever comes at or after the next key is returned again by the scan continuing there
+    while(more && n > 0 && compare_scan_entries(&entries[n - 1], &next) >= 0){
+        n--;
+    }
+    if(n > limit){
+        next = entries[limit];
+        more = 1;
+        n = limit;
+    }
+
+    //stop where the next entry would not fit in a frame, as the server does, leaving out an
+    //entry too large to fit even alone
+    size_t len = 5;
+    size_t kept = 0;
+    for(size_t i = 0; i < n; i++){
+        size_t after = i + 1 < n ? entries[i + 1].key_len : more ? next.key_len : 0;
+        if(len + entries[i].entry_len + after > PROTO_MAX_VALUE_SIZE){
+            if(kept > 0){
+                next = entries[i];
+                more = 1;
+                break;
+            }
+            continue;
+        }
+        len += entries[i].entry_len;
+        entries[kept++] = entries[i];
+    }
+    n = kept;
+    len += more ? next.key_len : 0;
+    unsigned char *buf = (unsigned char *)malloc(len);
+    if(buf == NULL){
+        free(entries);
+        return ENOMEM;
+    }
+    buf[0] = more;
+    proto_pack_u32(buf + 1, more ? next.key_len : 0);
+    unsigned char *dst = buf + 5;
+    if(more){
+        memcpy(dst, next.key, next.key_len);
+        dst += next.key_len;
+    }
+    for(size_t i = 0; i < n; i++){
+        memcpy(dst, entries[i].entry, entries[i].entry_len);
+        dst += entries[i].entry_len;
+    }
+    free(entries);
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
+
+//every part is back: call back with the merged response
+static void gather_finish(Gather *g){
+    DecsReply reply;
+    unsigned char *merged = NULL;
+
+    reply.error = g->error;
+    reply.opcode = g->opcode;
+    reply.status = g->status;
+    reply.payload = NULL;
+    reply.payload_len = 0;
+    if(reply.error == 0 && reply.status == STATUS_OK){
+        uint32_t len = 0;
+        reply.error = g->opcode == OP_SCAN ? merge_scan(g, &merged, &len) : merge_multi(g, &merged, &len);
+        reply.payload = merged;
+        reply.payload_len = len;
+    }
+    g->callback(&reply, g->arg);
+    free(merged);
+    gather_free(g);
+}
+
+//count a part, or the sender's hold, as done
+static void gather_release(Gather *g){
+    pthread_mutex_lock(&g->lock);
+    int last = --g->remaining == 0;
+    pthread_mutex_unlock(&g->lock);
+    if(last){
+        gather_finish(g);
+    }
+}
+
+//record why parts failed; the first error, or failing status, is the one reported
+static void gather_fail(Gather *g, int error, int status, int parts){
+    pthread_mutex_lock(&g->lock);
+    if(error != 0 && g->error == 0){
+        g->error = error;
+    }
+    if(status != STATUS_OK && g->status == STATUS_OK){
+        g->status = status;
+    }
+    g->remaining -= parts;
+    pthread_mutex_unlock(&g->lock);
+}
+
+//the callback of one part
+static void part_complete(const DecsReply *reply, void *arg){
+    Part *part = (Part *)arg;
+    int error = reply->error;
+
+    if(error == 0 && reply->status == STATUS_OK && reply->payload_len > 0){
+        part->payload = (unsigned char *)malloc(reply->payload_len);
+        if(part->payload == NULL){
+            error = ENOMEM;
+        }
+        else{
+            memcpy(part->payload, reply->payload, reply->payload_len);
+            part->payload_len = reply->payload_len;
+        }
+    }
+    if(error != 0 || reply->status != STATUS_OK){
+        gather_fail(part->gather, error, reply->status, 0);
+    }
+    gather_release(part->gather);
+}
+
+//the parts are being sent: a part that could not be is counted as failed with err, along with
+//the ones after it; returns the submit result for the whole request
+static int gather_sent(Gather *g, int sent, int err){
+    if(sent == 0){
+        //nothing went out, the caller hears of it from the return value alone
+        gather_free(g);
+        errno = err;
+        return -1;
+    }
+    if(sent < g->nparts){
+        gather_fail(g, err, STATUS_OK, g->nparts - sent);
+    }
+    gather_release(g);
+    return 0;
+}
+
+int decs_cluster_submit_multi(DecsCluster *cluster, int opcode, const char *const *keys, const uint32_t *key_lens, const char *const *values, const uint32_t *value_lens, int nkeys, DecsCallback callback, void *arg){
+    pthread_rwlock_rdlock(&cluster->lock);
+    if(cluster->nnodes == 0){
+        pthread_rwlock_unlock(&cluster->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    //the part of each server, in order of its first key
+    int *node_of = (int *)malloc((nkeys > 0 ? nkeys : 1) * sizeof(int));
+    int *part_of_node = (int *)malloc(cluster->nnodes * sizeof(int));
+    if(node_of == NULL || part_of_node == NULL){
+        free(node_of);
+        free(part_of_node);
+        pthread_rwlock_unlock(&cluster->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    int nparts = 0;
+    for(int n = 0; n < cluster->nnodes; n++){
+        part_of_node[n] = -1;
+    }
+    for(int i = 0; i < nkeys; i++){
+        node_of[i] = route(cluster, keys[i], key_lens != NULL ? key_lens[i] : strlen(keys[i]));
+        if(part_of_node[node_of[i]] < 0){
+            part_of_node[node_of[i]] = nparts++;
+        }
+    }
+
+    int rc;
+    if(nparts <= 1){
+        //all on one server, nothing to split
+        DecsPool *pool = cluster->nodes[nkeys > 0 ? node_of[0] : 0];
+        free(node_of);
+        free(part_of_node);
+        rc = decs_submit_multi(pool, opcode, keys, key_lens, values, value_lens, nkeys, callback, arg);
+        return unlock_route(cluster, rc);
+    }
+
+    Gather *g = gather_new(opcode, nkeys, nparts, callback, arg);
+    const char **part_keys = (const char **)malloc(nkeys * sizeof(char *));
+    const char **part_values = (const char **)malloc(nkeys * sizeof(char *));
+    uint32_t *part_key_lens = (uint32_t *)malloc(nkeys * sizeof(uint32_t));
+    uint32_t *part_value_lens = (uint32_t *)malloc(nkeys * sizeof(uint32_t));
+    if(g == NULL || part_keys == NULL || part_values == NULL || part_key_lens == NULL || part_value_lens == NULL){
+        if(g != NULL){
+            gather_free(g);
+        }
+        rc = -1;
+        errno = ENOMEM;
+    }
+    else{
+        for(int i = 0; i < nkeys; i++){
+            g->part_of[i] = part_of_node[node_of[i]];
+        }
+        //gather each server's keys and send them off
+        int sent = 0;
+        int err = 0;
+        for(int n = 0; n < cluster->nnodes && err == 0; n++){
+            if(part_of_node[n] < 0){
+                continue;
+            }
+            int count = 0;
+            for(int i = 0; i < nkeys; i++){
+                if(node_of[i] != n){
+                    continue;
+                }
+                part_keys[count] = keys[i];
+                part_key_lens[count] = key_lens != NULL ? key_lens[i] : strlen(keys[i]);
+                if(opcode == OP_MSET){
+                    part_values[count] = values[i];
+                    part_value_lens[count] = value_lens != NULL ? value_lens[i] : strlen(values[i]);
+                }
+                count++;
+            }
+            if(decs_submit_multi(cluster->nodes[n], opcode, part_keys, part_key_lens, part_values, part_value_lens, count, part_complete, &g->parts[part_of_node[n]]) < 0){
+                err = errno;
+            }
+            else{
+                sent++;
+            }
+        }
+        rc = gather_sent(g, sent, err);
+    }
+    free(part_keys);
+    free(part_values);
+    free(part_key_lens);
+    free(part_value_lens);
+    free(node_of);
+    free(part_of_node);
+    return unlock_route(cluster, rc);
+}
+
+int decs_cluster_submit_scan(DecsCluster *cluster, const void *start, uint32_t start_len, const void *end, uint32_t end_len, uint32_t limit, DecsCallback callback, void *arg){
+    pthread_rwlock_rdlock(&cluster->lock);
+    if(cluster->nnodes == 0){
+        pthread_rwlock_unlock(&cluster->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+    if(cluster->nnodes == 1){
+        return unlock_route(cluster, decs_submit_scan(cluster->nodes[0], start, start_len, end, end_len, limit, callback, arg));
+    }
+
+    //every server holds some of the range
+    Gather *g = gather_new(OP_SCAN, 0, cluster->nnodes, callback, arg);
+    if(g == NULL){
+        pthread_rwlock_unlock(&cluster->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    g->limit = limit;
+    int sent = 0;
+    int err = 0;
+    for(int n = 0; n < cluster->nnodes && err == 0; n++){
+        if(decs_submit_scan(cluster->nodes[n], start, start_len, end, end_len, limit, part_complete, &g->parts[n]) < 0){
+            err = errno;
+        }
+        else{
+            sent++;
+        }
+    }
+    return unlock_route(cluster, gather_sent(g, sent, err));
+}
@@ -0,0 +1,162 @@
+#ifndef DECS_H
+#define DECS_H
+
+#include<stdint.h>
+#include<pthread.h>
+#include<sys/uio.h>
+
+#include "protocol.h"
+
+/*
+ * Client library for the key-value server.
+ *
+ * A pool keeps a few connections to one server and a background I/O thread
+ * that drives them. Requests are submitted from any thread and return at once;
+ * each is queued on the connection with the fewest requests outstanding, so
+ * concurrent callers share connections and their requests go out pipelined,
+ * many to a write. When the response arrives the I/O thread calls the
+ * request's callback with it. Callbacks may submit further requests but must
+ * not block: they hold up every other response on the pool.
+ *
+ * Responses on one connection come back in the order their requests were
+ * submitted; a pool of one connection therefore completes everything in order.
+ *
+ * A connection that fails is reopened in the background, waiting
+ * reconnect_delay ms at first and twice as long after each failed attempt (up
+ * to reconnect_max_delay). Requests that were outstanding on it when it failed,
+ * or that were queued on it while it could not be reopened, complete with an
+ * error: whether the server acted on them is unknown, so they are not resent.
+ *
+ * A DecsFuture turns the callback into a value to wait for:
+ *
+ *     DecsFuture future;
+ *     decs_future_init(&future);
+ *     decs_submit(pool, OP_READ, "key", 3, NULL, 0, decs_future_complete, &future);
+ *     const DecsReply *reply = decs_future_wait(&future);
+ *     ...
+ *     decs_future_destroy(&future);
+ *
+ * A cluster shards the keys over several servers, one pool each, by
+ * consistent hashing. Every server owns virtual_nodes points on a 64-bit hash
+ * ring, placed by hashing its "address:port#i" names, and a key belongs to the
+ * server owning the first point at or after the key's hash. Clients given the
+ * same servers therefore agree on where every key lives, and adding or
+ * removing a server only moves the keys next to its points: about 1/n of
+ * them. Keys are not copied between servers when that happens.
+ *
+ * Single-key requests go to the key's server. An mget, mset or mdelete is split
+ * into one request per server involved, sent together, and their results are
+ * put back in request order for a single callback. A scan runs on every server
+ * and the entries are merged in key order. The callback of a request split
+ * over servers runs on the I/O thread of whichever server answers last, or in
+ * the submitting thread if they all answer before the submit returns.
+ */
+
+typedef struct DecsPool DecsPool;
+typedef struct DecsCluster DecsCluster;
+
+//a response, or why there is none
+typedef struct DecsReply{
+    int error;                  //0, or an errno value if the request failed without a response
+    int opcode;                 //of the request, without PROTO_FLAG_TTL
+    int status;                 //STATUS_* of the response when error is 0
+    const unsigned char *payload;   //only valid during the callback
+    uint32_t payload_len;
+} DecsReply;
+
+typedef void (*DecsCallback)(const DecsReply *reply, void *arg);
+
+typedef struct DecsOptions{
+    int connections;            //connections kept open to the server
+    int connect_timeout;        //ms a reconnect may take before it counts as failed
+    int reconnect_delay;        //ms before the first reconnect, doubling after each failed one
+    int reconnect_max_delay;    //ms the reconnect delay grows to at most
+    int virtual_nodes;          //points each server of a cluster owns on the hash ring
+} DecsOptions;
+
+typedef struct DecsFuture{
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int done;
+    DecsReply reply;            //with a copy of the payload owned by the future
+} DecsFuture;
+
+void decs_default_options(DecsOptions *options);
+
+//connect to host (a name or an IPv4 address) on port; options may be NULL for the defaults
+//returns NULL with errno set if any connection fails, errno is ENXIO if host does not resolve
+DecsPool *decs_pool_open(const char *host, int port, const DecsOptions *options);
+
+//wait for every outstanding request to complete, then close the connections
+void decs_pool_close(DecsPool *pool);
+
+//the server address as "IPv4 address:port"
+const char *decs_pool_address(const DecsPool *pool);
+
+//wait until fewer than limit requests are outstanding (limit 1 waits for all of them)
+//must not be called from a callback
+void decs_pool_wait(DecsPool *pool, long limit);
+
+//the submit functions return 0 once the request is queued, -1 with errno set otherwise; the
+//callback is then called exactly once, with the response or with an error
+
+//a request whose value is the concatenation of nvalue buffers; a multi-key request has no key
+//and passes its key count as key_len
+int decs_submitv(DecsPool *pool, int opcode, const void *key, uint32_t key_len, const struct iovec *value, int nvalue, DecsCallback callback, void *arg);
+
+//a single-key request
+int decs_submit(DecsPool *pool, int opcode, const void *key, uint32_t key_len, const void *value, uint32_t value_len, DecsCallback callback, void *arg);
+
+//a create, update, cas or getset whose key expires ttl seconds later (0 = never)
+int decs_submit_ttl(DecsPool *pool, int opcode, const void *key, uint32_t key_len, const void *value, uint32_t value_len, unsigned ttl, DecsCallback callback, void *arg);
+
+//a cas of a key still at version, with a ttl if has_ttl is set
+int decs_submit_cas(DecsPool *pool, const void *key, uint32_t key_len, uint32_t version, const void *value, uint32_t value_len, int has_ttl, unsigned ttl, DecsCallback callback, void *arg);
+
+//an mget, mset or mdelete of nkeys keys; values are only used by mset
+//key_lens and value_lens may be NULL for nul-terminated keys and values
+int decs_submit_multi(DecsPool *pool, int opcode, const char *const *keys, const uint32_t *key_lens, const char *const *values, const uint32_t *value_lens, int nkeys, DecsCallback callback, void *arg);
+
+//a scan of at most limit keys from start up to end (empty for no upper bound)
+int decs_submit_scan(DecsPool *pool, const void *start, uint32_t start_len, const void *end, uint32_t end_len, uint32_t limit, DecsCallback callback, void *arg);
+
+void decs_future_init(DecsFuture *future);
+
+//a DecsCallback that completes the future passed as its arg
+void decs_future_complete(const DecsReply *reply, void *future);
+
+//wait for the future's reply; it stays valid until the future is destroyed
+const DecsReply *decs_future_wait(DecsFuture *future);
+
+void decs_future_destroy(DecsFuture *future);
+
+//connect to nservers servers, hosts[i] on ports[i]; options apply to every server's pool
+//returns NULL with errno set if any connection fails, errno is ENXIO if a host does not resolve
+DecsCluster *decs_cluster_open(const char *const *hosts, const int *ports, int nservers, const DecsOptions *options);
+
+//wait for every outstanding request to complete, then close the connections
+void decs_cluster_close(DecsCluster *cluster);
+
+//add a server and rebuild the hash ring; returns -1 with errno set (EEXIST if it is already in)
+int decs_cluster_add(DecsCluster *cluster, const char *host, int port);
+
+//rebuild the hash ring without a server, then close its pool once its requests complete
+//returns -1 with errno set (ENOENT if it is not in the cluster); must not be called from a callback
+int decs_cluster_remove(DecsCluster *cluster, const char *host, int port);
+
+int decs_cluster_size(DecsCluster *cluster);
+
+//the pool of the i-th server, e.g. for its stats; valid until the server is removed
+DecsPool *decs_cluster_node(DecsCluster *cluster, int i);
+
+//the pool of the server a key belongs to, or NULL with errno ENOTCONN if there are no servers
+DecsPool *decs_cluster_route(DecsCluster *cluster, const void *key, uint32_t key_len);
+
+//the cluster versions of the submit functions; they fail with errno ENOTCONN if there are no servers
+int decs_cluster_submit(DecsCluster *cluster, int opcode, const void *key, uint32_t key_len, const void *value, uint32_t value_len, DecsCallback callback, void *arg);
+int decs_cluster_submit_ttl(DecsCluster *cluster, int opcode, const void *key, uint32_t key_len, const void *value, uint32_t value_len, unsigned ttl, DecsCallback callback, void *arg);
+int decs_cluster_submit_cas(DecsCluster *cluster, const void *key, uint32_t key_len, uint32_t version, const void *value, uint32_t value_len, int has_ttl, unsigned ttl, DecsCallback callback, void *arg);
+int decs_cluster_submit_multi(DecsCluster *cluster, int opcode, const char *const *keys, const uint32_t *key_lens, const char *const *values, const uint32_t *value_lens, int nkeys, DecsCallback callback, void *arg);
+int decs_cluster_submit_scan(DecsCluster *cluster, const void *start, uint32_t start_len, const void *end, uint32_t end_len, uint32_t limit, DecsCallback callback, void *arg);
+
+#endif
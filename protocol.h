@@ -0,0 +1,362 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+/*
+ * Binary wire protocol shared by the client and the server.
+ *
+ * request:  | version (1) | opcode (1) | key length (4) | value length (4) | key | value |
+ * response: | version (1) | status (1) | payload length (4) | payload |
+ *
+ * Keys are byte strings of up to PROTO_MAX_KEY_SIZE bytes. All integers are
+ * sent in network byte order and a whole request or response goes out in a
+ * single write. The version byte is never a printable character, so the server
+ * can tell a binary frame apart from the legacy text framing (fixed 255-byte
+ * messages starting with the command name). Version 1 frames, from clients
+ * that predate byte-string keys, carry a 4-byte integer where the key length
+ * is and no key; the server takes the integer's decimal text as the key, as it
+ * does for the key field of the text framing. Responses carry the version of
+ * the request they answer.
+ *
+ * The multi-key commands carry the number of keys in the key length field and
+ * no key (version 1: n x | key (4) | in place of each key):
+ *
+ * mget:    value = n x | key length (4) | key |
+ *          payload = n x | status (1) | value length (4) | value |
+ * mset:    value = n x | key length (4) | key | value length (4) | value |
+ *          payload = n x | status (1) |
+ * mdelete: value = n x | key length (4) | key |
+ *          payload = n x | status (1) |
+ *
+ * Per-key results come back in request order; the response status only says
+ * whether the batch as a whole was accepted. An mget whose payload would exceed
+ * PROTO_MAX_VALUE_SIZE is refused with STATUS_BAD_REQUEST.
+ *
+ * A create or update with PROTO_FLAG_TTL set in the opcode carries a time to
+ * live before its value; the key expires that many seconds later (0 = never):
+ *
+ *          value = | ttl (4) | value |
+ *
+ * scan returns the entries with keys from its key up to (not including) an end
+ * key in key order, at most limit of them (0 = PROTO_SCAN_DEFAULT_LIMIT, capped
+ * at PROTO_SCAN_MAX_LIMIT); an empty end key means no upper bound. It stops
+ * early where the next entry would take the payload past PROTO_MAX_VALUE_SIZE,
+ * and leaves out an entry too large to fit even alone. When more entries
+ * follow, the payload names the key to continue from:
+ *
+ * scan:    value = | limit (4) | end key |
+ *          payload = | more (1) | next key length (4) | next key |
+ *                    n x | key length (4) | key | value length (4) | value |
+ *
+ * The read-modify-write commands each run atomically on the server. Every write
+ * gives its key a new version number, which gets reads and cas compares:
+ *
+ * incr, decr:      value = | delta in decimal (empty for 1) |
+ *                  payload = | new value in decimal |
+ * append, prepend: value = | bytes to add |
+ * cas:             value = | version (4) | value |
+ *                  payload = | new version (4) |, or the current one if it did not match
+ * gets:            payload = | version (4) | value |
+ * getset:          value = | value |
+ *                  payload = | old value |
+ *
+ * incr and decr work on values holding a signed 64-bit decimal number and
+ * create a missing key from 0. append, prepend and getset keep to existing
+ * keys. cas and getset, like update, replace the expiry time and take
+ * PROTO_FLAG_TTL; the others keep it.
+ */
+
+#define PROTO_VERSION 0x02
+#define PROTO_VERSION_INT_KEYS 0x01
+#define PROTO_REQUEST_HEADER_SIZE 10
+#define PROTO_RESPONSE_HEADER_SIZE 6
+#define PROTO_MAX_KEY_SIZE 65535
+#define PROTO_MAX_VALUE_SIZE (64 * 1024 * 1024)
+#define PROTO_FLAG_TTL 0x80
+#define PROTO_SCAN_DEFAULT_LIMIT 100
+#define PROTO_SCAN_MAX_LIMIT 1000
+
+// size of every message in the legacy text framing
+#define LEGACY_MESSAGE_SIZE 255
+
+enum
+{
+    OP_CREATE = 1,
+    OP_READ = 2,
+    OP_UPDATE = 3,
+    OP_DELETE = 4,
+    OP_STATS = 5,
+    OP_MGET = 6,
+    OP_MSET = 7,
+    OP_MDELETE = 8,
+    OP_SNAPSHOT = 9,
+    OP_SCAN = 10,
+    OP_INCR = 11,
+    OP_DECR = 12,
+    OP_APPEND = 13,
+    OP_PREPEND = 14,
+    OP_CAS = 15,
+    OP_GETS = 16,
+    OP_GETSET = 17
+};
+
+enum
+{
+    STATUS_OK = 0,
+    STATUS_KEY_EXISTS = 1,
+    STATUS_NOT_FOUND = 2,
+    STATUS_BAD_REQUEST = 3,
+    STATUS_OUT_OF_MEMORY = 4,
+    STATUS_BUSY = 5,
+    STATUS_NOT_A_NUMBER = 6,
+    STATUS_VERSION_MISMATCH = 7
+};
+
+typedef struct RequestHeader
+{
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t key_len; // the key count of a multi-key request, the key itself in version 1
+    uint32_t value_len;
+} RequestHeader;
+
+typedef struct ResponseHeader
+{
+    uint8_t version;
+    uint8_t status;
+    uint32_t payload_len;
+} ResponseHeader;
+
+static inline const char *proto_opcode_name(int opcode)
+{
+    switch (opcode)
+    {
+    case OP_CREATE:
+        return "create";
+    case OP_READ:
+        return "read";
+    case OP_UPDATE:
+        return "update";
+    case OP_DELETE:
+        return "delete";
+    case OP_STATS:
+        return "stats";
+    case OP_MGET:
+        return "mget";
+    case OP_MSET:
+        return "mset";
+    case OP_MDELETE:
+        return "mdelete";
+    case OP_SNAPSHOT:
+        return "snapshot";
+    case OP_SCAN:
+        return "scan";
+    case OP_INCR:
+        return "incr";
+    case OP_DECR:
+        return "decr";
+    case OP_APPEND:
+        return "append";
+    case OP_PREPEND:
+        return "prepend";
+    case OP_CAS:
+        return "cas";
+    case OP_GETS:
+        return "gets";
+    case OP_GETSET:
+        return "getset";
+    }
+    return "unknown";
+}
+
+static inline int proto_opcode_from_name(const char *name)
+{
+    if (strcmp(name, "create") == 0)
+        return OP_CREATE;
+    if (strcmp(name, "read") == 0)
+        return OP_READ;
+    if (strcmp(name, "update") == 0)
+        return OP_UPDATE;
+    if (strcmp(name, "delete") == 0)
+        return OP_DELETE;
+    if (strcmp(name, "stats") == 0)
+        return OP_STATS;
+    if (strcmp(name, "mget") == 0)
+        return OP_MGET;
+    if (strcmp(name, "mset") == 0)
+        return OP_MSET;
+    if (strcmp(name, "mdelete") == 0)
+        return OP_MDELETE;
+    if (strcmp(name, "snapshot") == 0)
+        return OP_SNAPSHOT;
+    if (strcmp(name, "scan") == 0)
+        return OP_SCAN;
+    if (strcmp(name, "incr") == 0)
+        return OP_INCR;
+    if (strcmp(name, "decr") == 0)
+        return OP_DECR;
+    if (strcmp(name, "append") == 0)
+        return OP_APPEND;
+    if (strcmp(name, "prepend") == 0)
+        return OP_PREPEND;
+    if (strcmp(name, "cas") == 0)
+        return OP_CAS;
+    if (strcmp(name, "gets") == 0)
+        return OP_GETS;
+    if (strcmp(name, "getset") == 0)
+        return OP_GETSET;
+    return 0;
+}
+
+// human readable result of an operation, as printed by the client
+static inline const char *proto_status_message(int opcode, int status)
+{
+    switch (status)
+    {
+    case STATUS_OK:
+        if (opcode == OP_CREATE)
+            return "Key-Value pair created successfully";
+        if (opcode == OP_UPDATE || opcode == OP_APPEND || opcode == OP_PREPEND || opcode == OP_CAS)
+            return "Key-Value pair updated successfully";
+        if (opcode == OP_MSET)
+            return "Key-Value pair stored successfully";
+        if (opcode == OP_DELETE || opcode == OP_MDELETE)
+            return "Key-Value pair deleted successfully";
+        if (opcode == OP_SNAPSHOT)
+            return "Snapshot started";
+        return "OK";
+    case STATUS_KEY_EXISTS:
+        return "Error: Key already exists";
+    case STATUS_NOT_FOUND:
+        return "Error: Key not found";
+    case STATUS_BAD_REQUEST:
+        return "Error: Bad request";
+    case STATUS_OUT_OF_MEMORY:
+        return "Error: Server out of memory";
+    case STATUS_BUSY:
+        return "Error: Server busy";
+    case STATUS_NOT_A_NUMBER:
+        return "Error: Value is not a number or would overflow";
+    case STATUS_VERSION_MISMATCH:
+        return "Error: Version mismatch";
+    }
+    return "Error: Unknown status";
+}
+
+static inline void proto_pack_u32(unsigned char *buf, uint32_t value)
+{
+    uint32_t n = htonl(value);
+
+    memcpy(buf, &n, 4);
+}
+
+static inline uint32_t proto_unpack_u32(const unsigned char *buf)
+{
+    uint32_t n;
+
+    memcpy(&n, buf, 4);
+    return ntohl(n);
+}
+
+static inline void proto_pack_request(unsigned char *buf, int opcode, uint32_t key_len, uint32_t value_len)
+{
+    uint32_t nkey = htonl(key_len);
+    uint32_t nlen = htonl(value_len);
+
+    buf[0] = PROTO_VERSION;
+    buf[1] = (unsigned char)opcode;
+    memcpy(buf + 2, &nkey, 4);
+    memcpy(buf + 6, &nlen, 4);
+}
+
+static inline void proto_unpack_request(const unsigned char *buf, RequestHeader *req)
+{
+    uint32_t nkey, nlen;
+
+    memcpy(&nkey, buf + 2, 4);
+    memcpy(&nlen, buf + 6, 4);
+    req->version = buf[0];
+    req->opcode = buf[1];
+    req->key_len = ntohl(nkey);
+    req->value_len = ntohl(nlen);
+}
+
+static inline void proto_pack_response(unsigned char *buf, int version, int status, uint32_t payload_len)
+{
+    uint32_t nlen = htonl(payload_len);
+
+    buf[0] = (unsigned char)version;
+    buf[1] = (unsigned char)status;
+    memcpy(buf + 2, &nlen, 4);
+}
+
+static inline void proto_unpack_response(const unsigned char *buf, ResponseHeader *res)
+{
+    uint32_t nlen;
+
+    memcpy(&nlen, buf + 2, 4);
+    res->version = buf[0];
+    res->status = buf[1];
+    res->payload_len = ntohl(nlen);
+}
+
+// read exactly len bytes; returns len, 0 on a clean EOF before any byte, -1 otherwise
+static inline ssize_t read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+        {
+            if (done == 0)
+                return 0;
+            errno = ECONNRESET;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// write all iov buffers, retrying on short writes; returns 0 on success, -1 on error
+static inline int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+#endif
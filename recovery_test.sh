@@ -0,0 +1,110 @@
+#!/bin/sh
+# Crash recovery check: write a data set through the client, take a snapshot halfway, kill
+# the server with SIGKILL, start it again on the same write-ahead log and snapshot, and diff
+# what the reads return before and after. Run it from the directory holding the built
+# ./server and ./client:
+#
+#     ./recovery_test.sh [port] [server options...]
+#
+# e.g. ./recovery_test.sh 9600 --engine open. Exits non-zero if anything differs.
+
+port=${1:-9600}
+[ $# -gt 0 ] && shift
+dir=$(mktemp -d)
+pid=
+
+cleanup() {
+    [ -n "$pid" ] && kill -9 "$pid" 2>/dev/null
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+# start the server and wait until it answers; a restart may have to wait for the port to
+# come free, and until then a connect can still reach the killed server's listener
+start_server() {
+    printf 'connect 127.0.0.1 %s\nread recovery-ping\nexit\n' "$port" > "$dir/ping"
+    for attempt in $(seq 120); do
+        ./server 127.0.0.1 "$port" --wal "$dir/wal" --wal-sync always --snapshot "$dir/snapshot" \
+            --ordered-index "$@" >> "$dir/server.log" 2>&1 &
+        pid=$!
+        for wait in $(seq 20); do
+            if timeout 2 ./client batch "$dir/ping" 2>/dev/null | grep -q '^>>' && kill -0 "$pid" 2>/dev/null; then
+                return 0
+            fi
+            kill -0 "$pid" 2>/dev/null || break
+            sleep 0.1
+        done
+        kill -9 "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+        sleep 1
+    done
+    echo "server did not start, see its log:" >&2
+    cat "$dir/server.log" >&2
+    exit 1
+}
+
+run() {
+    { printf 'connect 127.0.0.1 %s\n' "$port"; cat "$1"; printf 'disconnect\nexit\n'; } > "$dir/batch"
+    ./client batch "$dir/batch"
+}
+
+# creates, updates and deletes on both sides of the snapshot, so that recovery has to
+# load the snapshot and replay the log records after it
+i=1
+while [ $i -le 400 ]; do
+    echo "create key$i 12 value-$(printf %06d $i)"
+    [ $i -eq 200 ] && echo snapshot
+    [ $((i % 3)) -eq 0 ] && echo "update key$((i / 3)) 7 updated"
+    [ $((i % 5)) -eq 0 ] && echo "delete key$((i / 5))"
+    i=$((i + 1))
+done > "$dir/writes"
+cat >> "$dir/writes" <<EOF
+incr counter 41
+incr counter
+decr other 7
+append key399 4 more
+prepend key398 4 some
+mset multi1 a multi2 bb multi3 ccc
+mdelete multi2
+create ttl 5 later ttl 86400
+getset key397 3 new
+EOF
+
+i=1
+while [ $i -le 400 ]; do
+    echo "read key$i"
+    i=$((i + 1))
+done > "$dir/reads"
+cat >> "$dir/reads" <<EOF
+read counter
+read other
+mget multi1 multi2 multi3 ttl
+scan - - 1000
+EOF
+
+start_server "$@"
+run "$dir/writes" > "$dir/writes.out" || exit 1
+if grep -q Error "$dir/writes.out"; then
+    echo "writes failed:" >&2
+    grep Error "$dir/writes.out" >&2
+    exit 1
+fi
+# let the background snapshot finish, so the restart loads it rather than the whole log
+for wait in $(seq 100); do
+    grep -q "Snapshot written" "$dir/server.log" && break
+    sleep 0.1
+done
+run "$dir/reads" > "$dir/before"
+
+kill -9 "$pid"
+wait "$pid" 2>/dev/null
+pid=
+start_server "$@"
+run "$dir/reads" > "$dir/after"
+
+if diff -u "$dir/before" "$dir/after"; then
+    echo "recovery ok: $(grep -c '^>>' "$dir/before") responses match after a restart from the log and snapshot"
+else
+    echo "recovery FAILED: reads differ after the restart" >&2
+    exit 1
+fi
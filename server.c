@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -8,425 +9,7713 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "protocol.h"
 
-#define TABLE_SIZE 1024
 #define MAX_BUFFER_SIZE 256
+#define READ_CHUNK_SIZE 65536
+// connection buffers grown past this for a large request or response are let go afterwards
+#define BUFFER_KEEP_SIZE (1024 * 1024)
+// iovecs per writev of a connection's output
+#define FLUSH_IOV 64
+#define MAX_EVENTS 256
+
+// per-thread records (log rings, epoch records, statistics): a thread claims a free record
+// from a list, or adds a new one, the first time it needs one and gives it back when it
+// exits. Records are never freed, so a list can be walked at any time without a lock, and
+// a thread that exits leaves its record, with whatever is still in it, to the next one
+typedef struct ThreadRecord
+{
+    int in_use;
+    struct ThreadRecord *next;
+} ThreadRecord;
+
+typedef struct ThreadRecordList
+{
+    ThreadRecord *head;
+    size_t size;       // of a record, which starts with its ThreadRecord
+    pthread_key_t key; // hands the record back when its thread exits
+} ThreadRecordList;
+
+// release is called with the record of each exiting thread and ends with thread_record_release
+void thread_records_init(ThreadRecordList *list, void (*release)(void *))
+{
+    pthread_key_create(&list->key, release);
+}
+
+static inline ThreadRecord *thread_records(ThreadRecordList *list)
+{
+    return __atomic_load_n(&list->head, __ATOMIC_ACQUIRE);
+}
+
+// a record for the calling thread: one given back by a thread that has exited, or else a new
+// zeroed one. Returns NULL if out of memory
+void *thread_record_acquire(ThreadRecordList *list)
+{
+    ThreadRecord *record;
+
+    for (record = thread_records(list); record != NULL; record = record->next)
+    {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&record->in_use, &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (record == NULL)
+    {
+        record = aligned_alloc(64, list->size);
+        if (record == NULL)
+        {
+            return NULL;
+        }
+        memset(record, 0, list->size);
+        record->in_use = 1;
+        record->next = __atomic_load_n(&list->head, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&list->head, &record->next, record, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+    }
+
+    pthread_setspecific(list->key, record);
+    return record;
+}
+
+void thread_record_release(void *record)
+{
+    __atomic_store_n(&((ThreadRecord *)record)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// logging: a thread formats a record into its own ring of fixed-size slots and moves on;
+// one writer thread drains every ring to stdout (warnings and errors to stderr), so no
+// request thread ever takes a lock or blocks on the terminal. A full ring drops the record
+// and counts it. Lines of different threads may come out slightly out of time order.
+#define LOG_RING_SLOTS 256
+#define LOG_RECORD_SIZE 256
+#define LOG_FLUSH_INTERVAL_MS 20
+#define LOG_OUTPUT_SIZE 65536
+// bytes of a value shown in a command line
+#define LOG_VALUE_PREVIEW 32
+
+enum
+{
+    LOG_OFF,
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG // every command, subject to log_sample
+};
+
+const char *log_level_names[] = {"off", "error", "warn", "info", "debug"};
+
+typedef struct LogRecord
+{
+    struct timespec time;
+    int level;
+    int len;
+    char text[LOG_RECORD_SIZE - sizeof(struct timespec) - 2 * sizeof(int)];
+} LogRecord;
+
+// single producer (the owning thread), single consumer (the writer)
+typedef struct LogRing
+{
+    ThreadRecord link;
+    unsigned long head; // next slot the owner fills
+    unsigned long tail __attribute__((aligned(64))); // next slot the writer drains
+    LogRecord records[LOG_RING_SLOTS];
+} __attribute__((aligned(64))) LogRing;
+
+int log_level = LOG_INFO;
+int log_sample = 1; // log one in this many commands
+ThreadRecordList log_rings = {.size = sizeof(LogRing)};
+__thread LogRing *log_ring;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; // held while draining
+unsigned long long log_dropped;
+
+static inline int log_enabled(int level)
+{
+    return level <= log_level;
+}
+
+// arguments are only evaluated when the level is enabled
+#define log_message(level, ...)               \
+    do                                        \
+    {                                         \
+        if (log_enabled(level))               \
+        {                                     \
+            log_write(level, __VA_ARGS__);    \
+        }                                     \
+    } while (0)
+
+void log_release_ring(void *arg)
+{
+    log_ring = NULL;
+    thread_record_release(arg);
+}
+
+LogRing *log_thread_ring(void)
+{
+    if (log_ring == NULL)
+    {
+        log_ring = thread_record_acquire(&log_rings);
+    }
+    return log_ring;
+}
+
+__attribute__((format(printf, 2, 3))) void log_write(int level, const char *fmt, ...)
+{
+    LogRing *ring = log_thread_ring();
+    if (ring == NULL || ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS)
+    {
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *record = &ring->records[ring->head % LOG_RING_SLOTS];
+    clock_gettime(CLOCK_REALTIME_COARSE, &record->time);
+    record->level = level;
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(record->text, sizeof(record->text), fmt, args);
+    va_end(args);
+    record->len = len < 0 ? 0 : len < (int)sizeof(record->text) ? len : (int)sizeof(record->text) - 1;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+size_t log_format(char *dst, const struct timespec *time, int level, const char *text, int len)
+{
+    struct tm tm;
+    localtime_r(&time->tv_sec, &tm);
+    size_t n = strftime(dst, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    n += sprintf(dst + n, ".%03ld %-5s ", time->tv_nsec / 1000000, log_level_names[level]);
+    memcpy(dst + n, text, len);
+    n += len;
+    dst[n++] = '\n';
+    return n;
+}
+
+void log_output(int fd, char *data, size_t len)
+{
+    struct iovec iov = {data, len};
+
+    // nowhere left to report a failure to
+    writev_full(fd, &iov, 1);
+}
+
+// write out every record published so far; returns how many there were
+int log_drain(void)
+{
+    // [0] goes to stdout, [1] to stderr
+    static char out[2][LOG_OUTPUT_SIZE];
+    static unsigned long long reported;
+    size_t used[2] = {0, 0};
+    int count = 0;
+
+    pthread_mutex_lock(&log_lock);
+    for (ThreadRecord *link = thread_records(&log_rings); link != NULL; link = link->next)
+    {
+        LogRing *ring = (LogRing *)link;
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (unsigned long tail = ring->tail; tail != head; tail++)
+        {
+            LogRecord *record = &ring->records[tail % LOG_RING_SLOTS];
+            int err = record->level <= LOG_WARN;
+            if (used[err] + LOG_RECORD_SIZE + 64 > LOG_OUTPUT_SIZE)
+            {
+                log_output(err ? 2 : 1, out[err], used[err]);
+                used[err] = 0;
+            }
+            used[err] += log_format(out[err] + used[err], &record->time, record->level, record->text, record->len);
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+            count++;
+        }
+    }
+
+    unsigned long long dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+    if (dropped != reported)
+    {
+        char text[64];
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        int len = snprintf(text, sizeof(text), "dropped %llu log records", dropped - reported);
+        used[1] += log_format(out[1] + used[1], &now, LOG_WARN, text, len);
+        reported = dropped;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (used[i] > 0)
+        {
+            log_output(i + 1, out[i], used[i]);
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return count;
+}
+
+void log_flush(void)
+{
+    if (log_level != LOG_OFF)
+    {
+        log_drain();
+    }
+}
+
+void *log_writer(void *arg)
+{
+    (void)arg;
+    struct timespec pause = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+
+    while (1)
+    {
+        if (log_drain() == 0)
+        {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// with the level off nothing is set up and every log call is a single compare
+void log_init(void)
+{
+    if (log_level == LOG_OFF)
+    {
+        return;
+    }
+
+    thread_records_init(&log_rings, log_release_ring);
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, log_writer, NULL) != 0)
+    {
+        perror("ERROR starting the log writer");
+        exit(1);
+    }
+    pthread_detach(writer);
+    // whatever is still queued when the server exits
+    atexit(log_flush);
+}
+
+void error(char *msg)
+{
+    log_flush();
+    perror(msg);
+    exit(1);
+}
+
+// a large value queued on a buffer by reference instead of being copied in; its bytes go
+// out right before the byte at offset at
+typedef struct BufferValue
+{
+    size_t at;
+    size_t len;
+    const struct Value *value;
+} BufferValue;
+
+// growable byte buffer; bytes in [start, len) are pending. Connection output buffers
+// (zero_copy set) also take large values by reference, see buffer_append_value
+typedef struct Buffer
+{
+    char *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+    int zero_copy;
+    BufferValue *values; // oldest first
+    size_t value_count;
+    size_t value_cap;
+    size_t value_sent;   // bytes of the first value already written out
+    size_t value_bytes;  // total length of every value queued and not truncated, for payload lengths
+} Buffer;
+
+void value_unpin(const struct Value *value);
+
+// drop the consumed prefix, moving the pending bytes to the front
+void buffer_compact(Buffer *buf)
+{
+    memmove(buf->data, buf->data + buf->start, buf->len - buf->start);
+    for (size_t i = 0; i < buf->value_count; i++)
+    {
+        buf->values[i].at -= buf->start;
+    }
+    buf->len -= buf->start;
+    buf->start = 0;
+}
+
+// make room for at least extra more bytes after len
+int buffer_reserve(Buffer *buf, size_t extra)
+{
+    if (buf->start > 0 && buf->start == buf->len)
+    {
+        buffer_compact(buf);
+    }
+    if (buf->len + extra <= buf->cap)
+    {
+        return 0;
+    }
+
+    // reclaim the consumed prefix before growing
+    if (buf->start > 0)
+    {
+        buffer_compact(buf);
+        if (buf->len + extra <= buf->cap)
+        {
+            return 0;
+        }
+    }
+
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + extra)
+    {
+        cap *= 2;
+    }
+    char *data = realloc(buf->data, cap);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+// position of the end of the pending bytes; unlike len it survives buffer_reserve compacting
+size_t buffer_offset(const Buffer *buf)
+{
+    return buf->len - buf->start;
+}
+
+int buffer_append(Buffer *buf, const void *data, size_t len)
+{
+    if (buffer_reserve(buf, len) < 0)
+    {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+int buffer_printf(Buffer *buf, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (len < 0 || buffer_reserve(buf, len + 1) < 0)
+    {
+        return -1;
+    }
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, len + 1, fmt, args);
+    va_end(args);
+    buf->len += len;
+    return 0;
+}
+
+// cut the pending bytes back to offset, dropping any value queued after it
+void buffer_truncate(Buffer *buf, size_t offset)
+{
+    buf->len = buf->start + offset;
+    while (buf->value_count > 0 && buf->values[buf->value_count - 1].at > buf->len)
+    {
+        const BufferValue *queued = &buf->values[--buf->value_count];
+        buf->value_bytes -= queued->len;
+        value_unpin(queued->value);
+    }
+}
+
+// replace the old_len bytes at offset with new_len bytes of data, moving what follows them
+// along with any value queued there
+int buffer_splice(Buffer *buf, size_t offset, size_t old_len, const void *data, size_t new_len)
+{
+    if (new_len > old_len && buffer_reserve(buf, new_len - old_len) < 0)
+    {
+        return -1;
+    }
+    char *at = buf->data + buf->start + offset;
+    memmove(at + new_len, at + old_len, buf->len - (buf->start + offset + old_len));
+    memcpy(at, data, new_len);
+    for (size_t i = 0; i < buf->value_count; i++)
+    {
+        if (buf->values[i].at > buf->start + offset)
+        {
+            buf->values[i].at = buf->values[i].at - old_len + new_len;
+        }
+    }
+    buf->len = buf->len - old_len + new_len;
+    return 0;
+}
+
+void buffer_free(Buffer *buf)
+{
+    for (size_t i = 0; i < buf->value_count; i++)
+    {
+        value_unpin(buf->values[i].value);
+    }
+    free(buf->values);
+    free(buf->data);
+    int zero_copy = buf->zero_copy;
+    memset(buf, 0, sizeof(Buffer));
+    buf->zero_copy = zero_copy;
+}
+
+// slab allocator for table nodes and values: objects are carved out of large pages per
+// size class, and each thread keeps a small free list per class so that most allocations
+// and frees touch no lock at all. Sizes above the largest class go to malloc.
+#define SLAB_PAGE_SIZE (256 * 1024)
+#define SLAB_BATCH 32
+#define SLAB_BATCH_BYTES 8192
+#define SLAB_MAX_SIZE 4096
+#define NUM_SIZE_CLASSES 17
+
+const unsigned slab_sizes[NUM_SIZE_CLASSES] = {16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+
+typedef struct FreeObject
+{
+    struct FreeObject *next;
+} FreeObject;
+
+typedef struct SizeClass
+{
+    pthread_mutex_t lock;
+    FreeObject *free;
+    char *bump; // unused tail of the newest page
+    char *bump_end;
+    size_t pages;
+} SizeClass;
+
+// allocation counters are per thread and only summed up when stats are requested
+typedef struct ThreadCache
+{
+    FreeObject *free[NUM_SIZE_CLASSES];
+    unsigned count[NUM_SIZE_CLASSES];
+    unsigned long long allocs[NUM_SIZE_CLASSES];
+    unsigned long long frees[NUM_SIZE_CLASSES];
+    unsigned long long large_allocs;
+    unsigned long long large_frees;
+    unsigned long long large_bytes;
+    struct ThreadCache *next;
+    struct ThreadCache *prev;
+} ThreadCache;
+
+SizeClass size_classes[NUM_SIZE_CLASSES];
+unsigned char class_index[SLAB_MAX_SIZE / 8 + 1];
+
+// caches of live threads, plus the totals of threads that have exited
+pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+ThreadCache *caches;
+ThreadCache retired;
+pthread_key_t cache_key;
+__thread ThreadCache *thread_cache;
+
+void slab_release_cache(void *arg);
+
+void slab_init(void)
+{
+    int c = 0;
+
+    for (unsigned size = 0; size <= SLAB_MAX_SIZE; size += 8)
+    {
+        while (slab_sizes[c] < size)
+        {
+            c++;
+        }
+        class_index[size / 8] = c;
+    }
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        pthread_mutex_init(&size_classes[i].lock, NULL);
+    }
+    pthread_key_create(&cache_key, slab_release_cache);
+}
+
+int slab_class(size_t size)
+{
+    return class_index[(size + 7) / 8];
+}
+
+// objects moved between a thread cache and its class at a time; bounded in bytes so that
+// many threads caching large classes do not pin much memory
+unsigned slab_batch(int c)
+{
+    unsigned batch = SLAB_BATCH_BYTES / slab_sizes[c];
+    return batch < 1 ? 1 : batch > SLAB_BATCH ? SLAB_BATCH : batch;
+}
+
+// bytes actually reserved for an object of this size
+size_t slab_capacity(size_t size)
+{
+    return size <= SLAB_MAX_SIZE ? slab_sizes[slab_class(size)] : size;
+}
+
+ThreadCache *slab_cache(void)
+{
+    if (thread_cache == NULL)
+    {
+        thread_cache = calloc(1, sizeof(ThreadCache));
+        if (thread_cache == NULL)
+        {
+            error("ERROR allocating thread cache");
+        }
+        pthread_mutex_lock(&caches_lock);
+        thread_cache->next = caches;
+        if (caches != NULL)
+        {
+            caches->prev = thread_cache;
+        }
+        caches = thread_cache;
+        pthread_mutex_unlock(&caches_lock);
+        pthread_setspecific(cache_key, thread_cache);
+    }
+    return thread_cache;
+}
+
+// move a batch of objects from the class into the thread cache
+void slab_refill(ThreadCache *cache, int c)
+{
+    SizeClass *sc = &size_classes[c];
+    size_t size = slab_sizes[c];
+    unsigned batch = slab_batch(c);
+
+    pthread_mutex_lock(&sc->lock);
+    while (cache->count[c] < batch)
+    {
+        FreeObject *obj = sc->free;
+        if (obj != NULL)
+        {
+            sc->free = obj->next;
+        }
+        else
+        {
+            if (sc->bump + size > sc->bump_end)
+            {
+                char *page = malloc(SLAB_PAGE_SIZE);
+                if (page == NULL)
+                {
+                    break;
+                }
+                sc->bump = page;
+                sc->bump_end = page + SLAB_PAGE_SIZE;
+                sc->pages++;
+            }
+            obj = (FreeObject *)sc->bump;
+            sc->bump += size;
+        }
+        obj->next = cache->free[c];
+        cache->free[c] = obj;
+        cache->count[c]++;
+    }
+    pthread_mutex_unlock(&sc->lock);
+}
+
+// hand objects of a class back until only keep remain in the thread cache
+void slab_drain(ThreadCache *cache, int c, unsigned keep)
+{
+    SizeClass *sc = &size_classes[c];
+
+    pthread_mutex_lock(&sc->lock);
+    while (cache->count[c] > keep)
+    {
+        FreeObject *obj = cache->free[c];
+        cache->free[c] = obj->next;
+        obj->next = sc->free;
+        sc->free = obj;
+        cache->count[c]--;
+    }
+    pthread_mutex_unlock(&sc->lock);
+}
+
+void *slab_alloc(size_t size)
+{
+    ThreadCache *cache = slab_cache();
+
+    if (size > SLAB_MAX_SIZE)
+    {
+        void *ptr = malloc(size);
+        if (ptr != NULL)
+        {
+            cache->large_allocs++;
+            cache->large_bytes += size;
+        }
+        return ptr;
+    }
+
+    int c = slab_class(size);
+    if (cache->free[c] == NULL)
+    {
+        slab_refill(cache, c);
+        if (cache->free[c] == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    FreeObject *obj = cache->free[c];
+    cache->free[c] = obj->next;
+    cache->count[c]--;
+    cache->allocs[c]++;
+    return obj;
+}
+
+// size must be the size the object was allocated with, or its capacity
+void slab_free(void *ptr, size_t size)
+{
+    ThreadCache *cache = slab_cache();
 
-pthread_mutex_t lock;
+    if (ptr == NULL)
+    {
+        return;
+    }
+    if (size > SLAB_MAX_SIZE)
+    {
+        cache->large_frees++;
+        cache->large_bytes -= size;
+        free(ptr);
+        return;
+    }
+
+    int c = slab_class(size);
+    FreeObject *obj = ptr;
+    obj->next = cache->free[c];
+    cache->free[c] = obj;
+    cache->count[c]++;
+    cache->frees[c]++;
+
+    if (cache->count[c] > 2 * slab_batch(c))
+    {
+        slab_drain(cache, c, slab_batch(c));
+    }
+}
+
+// thread exit: give the cached objects back and keep the thread's counters
+void slab_release_cache(void *arg)
+{
+    ThreadCache *cache = arg;
+
+    for (int c = 0; c < NUM_SIZE_CLASSES; c++)
+    {
+        slab_drain(cache, c, 0);
+    }
+
+    pthread_mutex_lock(&caches_lock);
+    for (int c = 0; c < NUM_SIZE_CLASSES; c++)
+    {
+        retired.allocs[c] += cache->allocs[c];
+        retired.frees[c] += cache->frees[c];
+    }
+    retired.large_allocs += cache->large_allocs;
+    retired.large_frees += cache->large_frees;
+    retired.large_bytes += cache->large_bytes;
+
+    if (cache->prev != NULL)
+    {
+        cache->prev->next = cache->next;
+    }
+    else
+    {
+        caches = cache->next;
+    }
+    if (cache->next != NULL)
+    {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    thread_cache = NULL;
+    free(cache);
+}
+
+int slab_stats(Buffer *out)
+{
+    ThreadCache total;
+
+    // sum the live threads' counters on top of those of exited threads
+    pthread_mutex_lock(&caches_lock);
+    total = retired;
+    for (ThreadCache *cache = caches; cache != NULL; cache = cache->next)
+    {
+        for (int c = 0; c < NUM_SIZE_CLASSES; c++)
+        {
+            total.allocs[c] += cache->allocs[c];
+            total.frees[c] += cache->frees[c];
+        }
+        total.large_allocs += cache->large_allocs;
+        total.large_frees += cache->large_frees;
+        total.large_bytes += cache->large_bytes;
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    size_t reserved = 0, in_use = 0;
+    for (int c = 0; c < NUM_SIZE_CLASSES; c++)
+    {
+        unsigned long long objects = total.allocs[c] - total.frees[c];
+        size_t pages = __atomic_load_n(&size_classes[c].pages, __ATOMIC_RELAXED);
+
+        reserved += pages * SLAB_PAGE_SIZE;
+        in_use += objects * slab_sizes[c];
+        if (pages > 0 && buffer_printf(out, "slab_class_%u objects=%llu pages=%zu\n", slab_sizes[c], objects, pages) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return buffer_printf(out,
+                         "slab_reserved_bytes %zu\n"
+                         "slab_in_use_bytes %zu\n"
+                         "large_objects %llu\n"
+                         "large_bytes %llu\n",
+                         reserved, in_use, total.large_allocs - total.large_frees, total.large_bytes);
+}
+
+// epoch based reclamation: readers never lock, so memory a writer unlinks (nodes, values,
+// old bucket arrays) is only freed once every reader that might still see it has finished.
+// A reader announces the global epoch on entry; the epoch moves on once all active readers
+// have caught up with it, and memory retired in epoch e is freed once the epoch reaches e + 2.
+// Sections nest, so a writer can read lock-free inside a caller's section.
+#define EPOCH_RECLAIM_INTERVAL 64
+
+typedef struct Retired
+{
+    void *ptr;
+    size_t size; // slab size, or 0 for plain malloc memory
+    unsigned long epoch;
+} Retired;
+
+// a thread that exits leaves its record, and anything it still has to reclaim, for the
+// next thread to pick up
+typedef struct EpochRecord
+{
+    ThreadRecord link;
+    unsigned long epoch;
+    int active;
+    int depth; // nested sections, only touched by the owning thread
+    Retired *retired;
+    size_t retired_count;
+    size_t retired_cap;
+} __attribute__((aligned(64))) EpochRecord;
+
+unsigned long global_epoch = 2;
+ThreadRecordList epoch_records = {.size = sizeof(EpochRecord)};
+__thread EpochRecord *epoch_record;
+
+void epoch_release_record(void *arg)
+{
+    EpochRecord *record = arg;
+
+    __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+    epoch_record = NULL;
+    thread_record_release(record);
+}
+
+void epoch_init(void)
+{
+    thread_records_init(&epoch_records, epoch_release_record);
+}
+
+EpochRecord *epoch_thread_record(void)
+{
+    if (epoch_record == NULL)
+    {
+        epoch_record = thread_record_acquire(&epoch_records);
+        if (epoch_record == NULL)
+        {
+            error("ERROR allocating epoch record");
+        }
+    }
+    return epoch_record;
+}
+
+void epoch_enter(void)
+{
+    EpochRecord *record = epoch_thread_record();
+
+    if (record->depth++ > 0)
+    {
+        return;
+    }
+    __atomic_store_n(&record->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&record->active, 1, __ATOMIC_RELAXED);
+    // the announcement must be visible before any shared pointer is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+    if (--epoch_record->depth == 0)
+    {
+        __atomic_store_n(&epoch_record->active, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// advance the global epoch if no active reader is still in an older one
+unsigned long epoch_try_advance(void)
+{
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    for (ThreadRecord *link = thread_records(&epoch_records); link != NULL; link = link->next)
+    {
+        EpochRecord *record = (EpochRecord *)link;
+        if (__atomic_load_n(&record->active, __ATOMIC_SEQ_CST) && __atomic_load_n(&record->epoch, __ATOMIC_SEQ_CST) != epoch)
+        {
+            return epoch;
+        }
+    }
+
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+int value_keep_pinned(void *ptr, size_t size);
+
+void epoch_reclaim(EpochRecord *record)
+{
+    unsigned long epoch = epoch_try_advance();
+    size_t kept = 0;
+
+    for (size_t i = 0; i < record->retired_count; i++)
+    {
+        Retired *item = &record->retired[i];
+        if (item->epoch + 2 > epoch)
+        {
+            record->retired[kept++] = *item;
+        }
+        else if (value_keep_pinned(item->ptr, item->size))
+        {
+            // still being sent; the last unpin frees it
+        }
+        else if (item->size > 0)
+        {
+            slab_free(item->ptr, item->size);
+        }
+        else
+        {
+            free(item->ptr);
+        }
+    }
+    record->retired_count = kept;
+}
+
+// free ptr once no reader can hold a reference to it any more
+void epoch_retire(void *ptr, size_t size)
+{
+    EpochRecord *record = epoch_thread_record();
+
+    if (record->retired_count == record->retired_cap)
+    {
+        size_t cap = record->retired_cap ? record->retired_cap * 2 : 256;
+        Retired *retired = realloc(record->retired, cap * sizeof(Retired));
+        if (retired == NULL)
+        {
+            error("ERROR allocating retire list");
+        }
+        record->retired = retired;
+        record->retired_cap = cap;
+    }
+
+    Retired *item = &record->retired[record->retired_count++];
+    item->ptr = ptr;
+    item->size = size;
+    item->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    if (record->retired_count % EPOCH_RECLAIM_INTERVAL == 0)
+    {
+        epoch_reclaim(record);
+    }
+}
+
+// values are immutable once published: an update installs a new Value and retires the old one.
+// The one exception is an append that fits in the slack of the allocation: the new bytes go
+// past the end first and len is raised after them, so a reader that loads len once always
+// sees bytes that no longer change
+typedef struct Value
+{
+    unsigned len;
+    char data[];
+} Value;
+
+Value *value_create(const char *data, int len)
+{
+    Value *value = slab_alloc(sizeof(Value) + len);
+
+    if (value != NULL)
+    {
+        value->len = len;
+        memcpy(value->data, data, len);
+    }
+    return value;
+}
+
+size_t value_size(const Value *value)
+{
+    return sizeof(Value) + value->len;
+}
+
+// what a value counts against the memory limit
+size_t value_memory(const Value *value)
+{
+    return slab_capacity(value_size(value));
+}
+
+// the snapshot loaded at startup; values in it are used in place until replaced
+const char *snapshot_map;
+size_t snapshot_map_size;
+
+// hand a value that was replaced or deleted to the epoch reclaimer, unless it lives in the
+// snapshot mapping, which is never freed
+void value_retire(Value *value)
+{
+    if ((const char *)value >= snapshot_map && (const char *)value < snapshot_map + snapshot_map_size)
+    {
+        return;
+    }
+    epoch_retire(value, value_size(value));
+}
+
+// bytes a value can grow by in place: what its size class rounds up, none for values from
+// malloc or the snapshot mapping
+size_t value_slack(const Value *value)
+{
+    if ((const char *)value >= snapshot_map && (const char *)value < snapshot_map + snapshot_map_size)
+    {
+        return 0;
+    }
+    return slab_capacity(value_size(value)) - value_size(value);
+}
+
+// values of at least ZERO_COPY_MIN_SIZE bytes are sent to clients straight from the table
+// instead of being copied into the connection's output buffer. The connection pins each such
+// value it queues, inside the epoch section that found it, and a pinned value the reclaimer
+// comes to free is left to the last unpin instead. Pins are few, one per large response
+// waiting to go out, so a single lock does
+#define ZERO_COPY_MIN_SIZE (64 * 1024)
+#define PIN_BUCKETS 64
+
+typedef struct Pin
+{
+    const Value *value;
+    unsigned count;
+    size_t retired_size; // slab size once the reclaimer has handed the value over, else 0
+    struct Pin *next;
+} Pin;
+
+pthread_mutex_t pins_lock = PTHREAD_MUTEX_INITIALIZER;
+Pin *pins[PIN_BUCKETS];
+unsigned pinned_values; // distinct values pinned, so the reclaimer can skip the lock
+
+Pin **pin_find(const void *ptr)
+{
+    Pin **link = &pins[((uintptr_t)ptr >> 6) % PIN_BUCKETS];
+
+    while (*link != NULL && (*link)->value != ptr)
+    {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// returns -1 if out of memory
+int value_pin(const Value *value)
+{
+    pthread_mutex_lock(&pins_lock);
+    Pin **link = pin_find(value);
+    if (*link == NULL)
+    {
+        Pin *pin = malloc(sizeof(Pin));
+        if (pin == NULL)
+        {
+            pthread_mutex_unlock(&pins_lock);
+            return -1;
+        }
+        pin->value = value;
+        pin->count = 0;
+        pin->retired_size = 0;
+        pin->next = NULL;
+        *link = pin;
+        __atomic_add_fetch(&pinned_values, 1, __ATOMIC_RELAXED);
+    }
+    (*link)->count++;
+    pthread_mutex_unlock(&pins_lock);
+    return 0;
+}
+
+void value_unpin(const Value *value)
+{
+    pthread_mutex_lock(&pins_lock);
+    Pin **link = pin_find(value);
+    Pin *pin = *link;
+    if (--pin->count == 0)
+    {
+        *link = pin->next;
+        __atomic_sub_fetch(&pinned_values, 1, __ATOMIC_RELAXED);
+        if (pin->retired_size > 0)
+        {
+            slab_free((void *)value, pin->retired_size);
+        }
+        free(pin);
+    }
+    pthread_mutex_unlock(&pins_lock);
+}
+
+// the reclaimer's last check before freeing retired memory; returns 1 if ptr is a pinned
+// value, which the pins now own. Anything that could have pinned it did so inside an epoch
+// section that ended before the reclaimer got here
+int value_keep_pinned(void *ptr, size_t size)
+{
+    if (size < sizeof(Value) + ZERO_COPY_MIN_SIZE || __atomic_load_n(&pinned_values, __ATOMIC_RELAXED) == 0)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pins_lock);
+    Pin *pin = *pin_find(ptr);
+    if (pin != NULL)
+    {
+        pin->retired_size = size;
+    }
+    pthread_mutex_unlock(&pins_lock);
+    return pin != NULL;
+}
+
+int pin_stats(Buffer *out)
+{
+    return buffer_printf(out, "pinned_values %u\n", __atomic_load_n(&pinned_values, __ATOMIC_RELAXED));
+}
+
+// append a value the caller found inside an epoch section: a large one is queued by
+// reference on a connection's output buffer, anything else is copied
+int buffer_append_value(Buffer *buf, const Value *value)
+{
+    unsigned len = __atomic_load_n(&value->len, __ATOMIC_ACQUIRE);
+
+    // values this large come from malloc and have no slack to grow into, so their len is fixed
+    if (!buf->zero_copy || len < ZERO_COPY_MIN_SIZE)
+    {
+        return buffer_append(buf, value->data, len);
+    }
+
+    if (buf->value_count == buf->value_cap)
+    {
+        size_t cap = buf->value_cap ? buf->value_cap * 2 : 8;
+        BufferValue *values = realloc(buf->values, cap * sizeof(BufferValue));
+        if (values == NULL)
+        {
+            return -1;
+        }
+        buf->values = values;
+        buf->value_cap = cap;
+    }
+    if (value_pin(value) < 0)
+    {
+        return -1;
+    }
+    buf->values[buf->value_count].at = buf->len;
+    buf->values[buf->value_count].len = len;
+    buf->values[buf->value_count].value = value;
+    buf->value_count++;
+    buf->value_bytes += len;
+    return 0;
+}
+
+// bytes still to be sent, counting the values queued by reference
+size_t buffer_pending(const Buffer *buf)
+{
+    size_t pending = buf->len - buf->start;
+
+    for (size_t i = 0; i < buf->value_count; i++)
+    {
+        pending += buf->values[i].value->len;
+    }
+    return pending - buf->value_sent;
+}
+
+// describe the pending bytes, values included, in at most max iovecs; returns how many
+int buffer_iov(const Buffer *buf, struct iovec *iov, int max)
+{
+    size_t at = buf->start;
+    size_t i;
+    int n = 0;
+
+    for (i = 0; i < buf->value_count && n + 2 <= max; i++)
+    {
+        const BufferValue *ref = &buf->values[i];
+        if (ref->at > at)
+        {
+            iov[n].iov_base = buf->data + at;
+            iov[n++].iov_len = ref->at - at;
+        }
+        size_t skip = i == 0 ? buf->value_sent : 0;
+        iov[n].iov_base = (char *)ref->value->data + skip;
+        iov[n++].iov_len = ref->value->len - skip;
+        at = ref->at;
+    }
+    if (i == buf->value_count && n < max && at < buf->len)
+    {
+        iov[n].iov_base = buf->data + at;
+        iov[n++].iov_len = buf->len - at;
+    }
+    return n;
+}
+
+// count n bytes of the pending ones as sent, unpinning the values that are fully out
+void buffer_consume(Buffer *buf, size_t n)
+{
+    while (n > 0)
+    {
+        if (buf->value_count == 0 || buf->start < buf->values[0].at)
+        {
+            size_t end = buf->value_count > 0 ? buf->values[0].at : buf->len;
+            size_t step = n < end - buf->start ? n : end - buf->start;
+            buf->start += step;
+            n -= step;
+            continue;
+        }
+
+        const Value *value = buf->values[0].value;
+        size_t step = n < value->len - buf->value_sent ? n : value->len - buf->value_sent;
+        buf->value_sent += step;
+        n -= step;
+        if (buf->value_sent == value->len)
+        {
+            value_unpin(value);
+            buf->value_count--;
+            memmove(buf->values, buf->values + 1, buf->value_count * sizeof(BufferValue));
+            buf->value_sent = 0;
+        }
+    }
+}
+
+// keys are byte strings of up to PROTO_MAX_KEY_SIZE bytes. A request's key is hashed once
+// and the hash travels with it; stored keys keep their hash and length in front of the
+// bytes, so almost every mismatch is rejected without comparing key bytes
+typedef struct Key
+{
+    const char *data;
+    unsigned len;
+    unsigned hash;
+} Key;
+
+// random per process, so clients cannot pick keys that pile up in one bucket
+unsigned long long hash_seed;
+
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+
+static inline unsigned long long hash_mix(unsigned long long a, unsigned long long b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (unsigned long long)product ^ (unsigned long long)(product >> 64);
+}
+
+static inline unsigned long long hash_read8(const unsigned char *p)
+{
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline unsigned long long hash_read4(const unsigned char *p)
+{
+    unsigned v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// wyhash-style: keys up to 16 bytes take two multiplies and no loop, longer ones one
+// multiply per 16 bytes
+unsigned hash_bytes(const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned long long seed = hash_seed ^ hash_mix(hash_seed ^ HASH_P0, HASH_P1);
+    unsigned long long a, b;
+
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = hash_read4(p) << 32 | hash_read4(p + ((len >> 3) << 2));
+            b = hash_read4(p + len - 4) << 32 | hash_read4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = (unsigned long long)p[0] << 16 | (unsigned long long)p[len >> 1] << 8 | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t left = len;
+        for (; left > 16; left -= 16, p += 16)
+        {
+            seed = hash_mix(hash_read8(p) ^ HASH_P1, hash_read8(p + 8) ^ seed);
+        }
+        a = hash_read8(p + left - 16);
+        b = hash_read8(p + left - 8);
+    }
+    __uint128_t product = (__uint128_t)(a ^ HASH_P1) * (b ^ seed);
+    return (unsigned)hash_mix((unsigned long long)product ^ HASH_P0 ^ len, (unsigned long long)(product >> 64) ^ HASH_P2);
+}
+
+void hash_init(void)
+{
+    if (getrandom(&hash_seed, sizeof(hash_seed), 0) != sizeof(hash_seed))
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        hash_seed = (unsigned long long)now.tv_nsec << 32 ^ now.tv_sec ^ getpid();
+    }
+}
+
+static inline Key key_make(const char *data, unsigned len)
+{
+    Key key = {data, len, hash_bytes(data, len)};
+    return key;
+}
+
+// a stored key against a request's key: hash and length first, the bytes only if both match
+static inline int key_equals(unsigned hash, unsigned len, const char *data, const Key *key)
+{
+    return hash == key->hash && len == key->len && memcmp(data, key->data, len) == 0;
+}
+
+// integer keys, from clients that predate byte-string keys and from old log and snapshot
+// files, stand for their decimal text; text needs INT_KEY_TEXT_SIZE bytes
+#define INT_KEY_TEXT_SIZE 12
+
+Key int_key(int value, char *text)
+{
+    return key_make(text, snprintf(text, INT_KEY_TEXT_SIZE, "%d", value));
+}
+
+// write-ahead log: every successful create, update and delete is appended to an in-memory
+// log buffer while the key's lock is still held, so the records of a key are in the order
+// the table saw them. One writer thread moves the buffer to disk with a single write and,
+// depending on the sync policy, a single fdatasync, committing many writers' records at once.
+//
+// header: | magic (8) | base position (8) |
+// record: | crc32 (4) | opcode (1) | key length (4) | value length (4) | key | value |
+// the checksum covers everything after it; replay stops at the first torn or corrupt record.
+// The key bytes are counted in the value length. Records written before keys were byte
+// strings lack WAL_FLAG_KEY in the opcode and have an integer key in place of the length
+// and no key bytes. A create or update of a key that expires has WAL_FLAG_EXPIRES set in
+// the opcode and its absolute expiry time (4) in front of the key, also counted. An append
+// or prepend is logged with just the bytes it added; the other read-modify-write commands
+// are logged as the update they amount to.
+// Log positions count record bytes since the log was created; once a snapshot covers the
+// log up to some position, the records before it are dropped and the base moves up.
+#define WAL_MAGIC "DECSWAL1"
+#define WAL_HEADER_SIZE 16
+#define WAL_RECORD_HEADER_SIZE 13
+#define WAL_FLAG_EXPIRES 0x80
+#define WAL_FLAG_KEY 0x40
+
+enum
+{
+    WAL_SYNC_ALWAYS,   // acknowledge a write only once it is on disk
+    WAL_SYNC_INTERVAL, // fdatasync every interval_ms, never on a request thread
+    WAL_SYNC_OS        // write promptly and let the kernel decide when to flush
+};
+
+const char *wal_sync_names[] = {"always", "interval", "os"};
+
+typedef struct Wal
+{
+    int enabled; // off until replay has finished
+    int fd;
+    const char *path;
+    int policy;
+    int interval_ms;
+    pthread_mutex_t lock;
+    pthread_cond_t work;   // wakes the writer when records arrive
+    pthread_cond_t synced; // wakes writers waiting for their records to be durable
+    Buffer pending;        // records appended but not yet written
+    unsigned long long appended; // log position after the last appended record
+    unsigned long long durable;  // log position up to which records are written (and synced)
+    unsigned long long base;     // log position of the first record in the file
+    unsigned long long writes;
+    int compact;                 // drop the records before compact_to on the next round
+    unsigned long long compact_to;
+} Wal;
+
+Wal wal = {.fd = -1,
+           .policy = WAL_SYNC_INTERVAL,
+           .interval_ms = 10,
+           .lock = PTHREAD_MUTEX_INITIALIZER,
+           .work = PTHREAD_COND_INITIALIZER,
+           .synced = PTHREAD_COND_INITIALIZER};
+
+// log position of the last record this thread appended
+__thread unsigned long long wal_position;
+
+// slicing-by-8 tables (little-endian hosts): eight bytes per step, so checking a large
+// snapshot stays disk bound
+unsigned crc32_table[8][256];
+
+void crc32_init(void)
+{
+    for (unsigned i = 0; i < 256; i++)
+    {
+        unsigned c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc32_table[0][i] = c;
+    }
+    for (unsigned i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^ crc32_table[0][crc32_table[t - 1][i] & 0xff];
+        }
+    }
+}
+
+// start with crc = 0 and feed the pieces of a record in order
+unsigned crc32_update(unsigned crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        unsigned lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+              crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+              crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+    }
+    while (len-- > 0)
+    {
+        crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// caller holds the key's lock; a no-op while the log is off or being replayed
+void wal_append(int opcode, const Key *key, const char *value, int value_len, unsigned expires)
+{
+    if (!wal.enabled)
+    {
+        return;
+    }
+
+    // the expiry time is written right after the header, ahead of the key
+    unsigned char header[WAL_RECORD_HEADER_SIZE + 4];
+    int header_size = WAL_RECORD_HEADER_SIZE;
+    if (expires != 0)
+    {
+        opcode |= WAL_FLAG_EXPIRES;
+        proto_pack_u32(header + WAL_RECORD_HEADER_SIZE, expires);
+        header_size += 4;
+    }
+    header[4] = opcode | WAL_FLAG_KEY;
+    proto_pack_u32(header + 5, key->len);
+    proto_pack_u32(header + 9, header_size - WAL_RECORD_HEADER_SIZE + key->len + value_len);
+    unsigned crc = crc32_update(crc32_update(0, header + 4, header_size - 4), key->data, key->len);
+    proto_pack_u32(header, crc32_update(crc, value, value_len));
+
+    pthread_mutex_lock(&wal.lock);
+    int was_empty = wal.pending.len == 0;
+    if (buffer_append(&wal.pending, header, header_size) < 0 ||
+        (key->len > 0 && buffer_append(&wal.pending, key->data, key->len) < 0) ||
+        (value_len > 0 && buffer_append(&wal.pending, value, value_len) < 0))
+    {
+        error("ERROR growing the write-ahead log buffer");
+    }
+    wal.appended += header_size + key->len + value_len;
+    wal_position = wal.appended;
+    if (was_empty && wal.policy != WAL_SYNC_INTERVAL)
+    {
+        pthread_cond_signal(&wal.work);
+    }
+    pthread_mutex_unlock(&wal.lock);
+}
+
+// under the always policy, block until everything this thread logged is on disk; called
+// once per batch of requests so pipelined writes share a sync
+void wal_wait(void)
+{
+    if (!wal.enabled || wal.policy != WAL_SYNC_ALWAYS ||
+        __atomic_load_n(&wal.durable, __ATOMIC_ACQUIRE) >= wal_position)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    while (wal.durable < wal_position)
+    {
+        pthread_cond_wait(&wal.synced, &wal.lock);
+    }
+    pthread_mutex_unlock(&wal.lock);
+}
+
+void wal_pack_header(unsigned char *header, unsigned long long base)
+{
+    memcpy(header, WAL_MAGIC, 8);
+    proto_pack_u32(header + 8, base >> 32);
+    proto_pack_u32(header + 12, base);
+}
+
+// make a rename or create in the directory holding path durable: the file's own fsync does
+// not cover its directory entry, so a crash could otherwise bring back the old file
+int sync_directory(const char *path)
+{
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL)
+    {
+        strcpy(dir, ".");
+    }
+    else
+    {
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// copy the records from position on into a new log starting there and swap it in; runs on
+// the writer thread, the only one touching the file. A failure keeps the old log
+void wal_rewrite(unsigned long long position)
+{
+    char tmp_path[4096];
+    unsigned char header[WAL_HEADER_SIZE];
+    char chunk[READ_CHUNK_SIZE];
+
+    if (position <= wal.base)
+    {
+        return;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", wal.path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        log_message(LOG_ERROR, "compacting the write-ahead log: %m");
+        return;
+    }
+
+    wal_pack_header(header, position);
+    struct iovec iov = {header, WAL_HEADER_SIZE};
+    int rc = writev_full(fd, &iov, 1);
+    off_t offset = WAL_HEADER_SIZE + (position - wal.base);
+    ssize_t n;
+    while (rc == 0 && (n = pread(wal.fd, chunk, sizeof(chunk), offset)) != 0)
+    {
+        iov.iov_base = chunk;
+        iov.iov_len = n;
+        if (n < 0 || writev_full(fd, &iov, 1) < 0)
+        {
+            rc = -1;
+        }
+        offset += n;
+    }
+    if (rc < 0 || fdatasync(fd) < 0 || rename(tmp_path, wal.path) < 0)
+    {
+        log_message(LOG_ERROR, "compacting the write-ahead log: %m");
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+
+    // the new log is in place either way; until its entry is synced a crash may bring back
+    // the old one, which still holds every record and is replayed the same way
+    if (sync_directory(wal.path) < 0)
+    {
+        log_message(LOG_ERROR, "syncing the write-ahead log directory: %m");
+    }
+    close(wal.fd);
+    wal.fd = fd;
+    wal.base = position;
+}
+
+// called once a snapshot covering the log up to position is safely on disk, directory
+// entry included
+void wal_compact(unsigned long long position)
+{
+    pthread_mutex_lock(&wal.lock);
+    wal.compact = 1;
+    wal.compact_to = position;
+    pthread_cond_signal(&wal.work);
+    pthread_mutex_unlock(&wal.lock);
+}
+
+// group commit: take everything appended so far, write it and sync it while new records
+// pile up behind it for the next round
+void *wal_writer(void *arg)
+{
+    Buffer batch = {0};
+
+    (void)arg;
+    pthread_mutex_lock(&wal.lock);
+    while (1)
+    {
+        if (wal.policy == WAL_SYNC_INTERVAL)
+        {
+            pthread_mutex_unlock(&wal.lock);
+            struct timespec pause = {wal.interval_ms / 1000, (wal.interval_ms % 1000) * 1000000L};
+            nanosleep(&pause, NULL);
+            pthread_mutex_lock(&wal.lock);
+            if (wal.pending.len == 0 && !wal.compact)
+            {
+                continue;
+            }
+        }
+        while (wal.pending.len == 0 && !wal.compact)
+        {
+            pthread_cond_wait(&wal.work, &wal.lock);
+        }
+
+        Buffer full = wal.pending;
+        wal.pending = batch;
+        batch = full;
+        unsigned long long end = wal.appended;
+        int compact = wal.compact;
+        unsigned long long compact_to = wal.compact_to;
+        wal.compact = 0;
+        pthread_mutex_unlock(&wal.lock);
+
+        if (batch.len > 0)
+        {
+            struct iovec iov = {batch.data, batch.len};
+            if (writev_full(wal.fd, &iov, 1) < 0)
+            {
+                error("ERROR writing the write-ahead log");
+            }
+            if (wal.policy != WAL_SYNC_OS && fdatasync(wal.fd) < 0)
+            {
+                error("ERROR syncing the write-ahead log");
+            }
+            batch.start = batch.len = 0;
+        }
+        if (compact)
+        {
+            wal_rewrite(compact_to);
+        }
+
+        pthread_mutex_lock(&wal.lock);
+        __atomic_store_n(&wal.durable, end, __ATOMIC_RELEASE);
+        wal.writes++;
+        pthread_cond_broadcast(&wal.synced);
+    }
+    return NULL;
+}
+
+int wal_stats(Buffer *out)
+{
+    if (!wal.enabled)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    int rc = buffer_printf(out, "wal_sync %s\nwal_appended_bytes %llu\nwal_durable_bytes %llu\nwal_base %llu\nwal_writes %llu\n",
+                           wal_sync_names[wal.policy], wal.appended, wal.durable, wal.base, wal.writes);
+    pthread_mutex_unlock(&wal.lock);
+    return rc;
+}
+
+// request statistics: each thread counts into its own record, which is only summed up when
+// stats are requested. Latencies go into log-linear histograms in nanoseconds: below
+// 2^LATENCY_SUB_BITS every value has its own bucket, above that each power of two is split
+// into 2^LATENCY_SUB_BITS buckets, so a reported percentile is within about 12%
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+#define NUM_OPCODES (OP_GETSET + 1)
+
+enum
+{
+    LATENCY_PARSE,     // decoding a request out of the input buffer
+    LATENCY_LOCK_WAIT, // blocked on a stripe or segment lock; uncontended takes count as 0.
+                       // Only request threads sample it, see request_thread
+    LATENCY_TABLE,     // the engine operation, lock wait included
+    LATENCY_WRITE,     // writing a batch of responses to the socket
+    NUM_LATENCIES
+};
+
+const char *latency_names[NUM_LATENCIES] = {"parse", "lock_wait", "table", "write"};
+
+typedef struct Latency
+{
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+} Latency;
+
+// a thread that exits leaves its counts to the next one
+typedef struct ThreadStats
+{
+    ThreadRecord link;
+    unsigned long long commands[NUM_OPCODES]; // [0] counts unknown opcodes
+    unsigned long long connections_opened;
+    unsigned long long connections_closed;
+    unsigned long long hits; // reads, including the keys of an mget
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long expired; // keys removed by the expiry thread
+    unsigned long long forwarded; // requests handed to the core owning their key
+    unsigned long long busy;      // requests turned away while the pool's queue was full
+    unsigned long long timeouts;  // connections dropped partway through a request
+    Latency latency[NUM_LATENCIES];
+} __attribute__((aligned(64))) ThreadStats;
+
+ThreadRecordList thread_stats_list = {.size = sizeof(ThreadStats)};
+__thread ThreadStats *thread_stats;
+
+void stats_release_record(void *arg)
+{
+    thread_stats = NULL;
+    thread_record_release(arg);
+}
+
+void stats_init(void)
+{
+    thread_records_init(&thread_stats_list, stats_release_record);
+}
+
+ThreadStats *stats_thread_record(void)
+{
+    if (thread_stats == NULL)
+    {
+        thread_stats = thread_record_acquire(&thread_stats_list);
+        if (thread_stats == NULL)
+        {
+            error("ERROR allocating thread statistics");
+        }
+    }
+    return thread_stats;
+}
+
+unsigned long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int latency_index(unsigned long long ns)
+{
+    if (ns < LATENCY_SUB_COUNT)
+    {
+        return ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_COUNT + (int)((ns >> shift) - LATENCY_SUB_COUNT);
+}
+
+// highest value that lands in a bucket
+unsigned long long latency_value(int index)
+{
+    if (index < LATENCY_SUB_COUNT)
+    {
+        return index;
+    }
+    int shift = index / LATENCY_SUB_COUNT - 1;
+    unsigned long long low = (unsigned long long)(LATENCY_SUB_COUNT + index % LATENCY_SUB_COUNT) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void stats_count_read(int status)
+{
+    if (status == STATUS_OK)
+    {
+        stats_thread_record()->hits++;
+    }
+    else if (status == STATUS_NOT_FOUND)
+    {
+        stats_thread_record()->misses++;
+    }
+}
+
+void stats_record(int which, unsigned long long ns)
+{
+    Latency *latency = &stats_thread_record()->latency[which];
+
+    latency->counts[latency_index(ns)]++;
+    latency->total++;
+    if (ns > latency->max)
+    {
+        latency->max = ns;
+    }
+}
+
+// set on the threads that serve connections. The lock waits of the others, such as the
+// expiry thread's sweeps, say nothing about request latency and are not sampled
+__thread int request_thread;
+
+// take a stripe or segment lock, timing only the waits: an uncontended lock costs no clock read
+void stats_lock(pthread_mutex_t *lock)
+{
+    if (pthread_mutex_trylock(lock) == 0)
+    {
+        if (request_thread)
+        {
+            stats_record(LATENCY_LOCK_WAIT, 0);
+        }
+        return;
+    }
+    if (!request_thread)
+    {
+        pthread_mutex_lock(lock);
+        return;
+    }
+    unsigned long long start = now_ns();
+    pthread_mutex_lock(lock);
+    stats_record(LATENCY_LOCK_WAIT, now_ns() - start);
+}
+
+// per_10000 is the percentile in hundredths of a percent
+unsigned long long latency_percentile(const Latency *latency, unsigned per_10000)
+{
+    unsigned long long rank = (latency->total * per_10000 + 9999) / 10000;
+    unsigned long long seen = 0;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += latency->counts[i];
+        if (seen >= rank)
+        {
+            return latency_value(i) < latency->max ? latency_value(i) : latency->max;
+        }
+    }
+    return latency->max;
+}
+
+// the owners keep counting while this runs, so the sums are only approximately consistent
+int request_stats(Buffer *out)
+{
+    ThreadStats *total = calloc(1, sizeof(ThreadStats));
+    if (total == NULL)
+    {
+        return -1;
+    }
+
+    for (ThreadRecord *link = thread_records(&thread_stats_list); link != NULL; link = link->next)
+    {
+        ThreadStats *stats = (ThreadStats *)link;
+        for (int op = 0; op < NUM_OPCODES; op++)
+        {
+            total->commands[op] += stats->commands[op];
+        }
+        total->connections_opened += stats->connections_opened;
+        total->connections_closed += stats->connections_closed;
+        total->hits += stats->hits;
+        total->misses += stats->misses;
+        total->evictions += stats->evictions;
+        total->expired += stats->expired;
+        total->forwarded += stats->forwarded;
+        total->busy += stats->busy;
+        total->timeouts += stats->timeouts;
+        for (int l = 0; l < NUM_LATENCIES; l++)
+        {
+            for (int i = 0; i < LATENCY_BUCKETS; i++)
+            {
+                total->latency[l].counts[i] += stats->latency[l].counts[i];
+            }
+            total->latency[l].total += stats->latency[l].total;
+            if (stats->latency[l].max > total->latency[l].max)
+            {
+                total->latency[l].max = stats->latency[l].max;
+            }
+        }
+    }
+
+    int rc = buffer_printf(out,
+                           "connections_active %llu\nconnections_total %llu\nhits %llu\nmisses %llu\nevictions %llu\n"
+                           "expired_keys %llu\nforwarded_requests %llu\nbusy_responses %llu\nread_timeouts %llu\n",
+                           total->connections_opened - total->connections_closed, total->connections_opened,
+                           total->hits, total->misses, total->evictions, total->expired, total->forwarded, total->busy,
+                           total->timeouts);
+    for (int op = 1; op < NUM_OPCODES && rc == 0; op++)
+    {
+        rc = buffer_printf(out, "cmd_%s %llu\n", proto_opcode_name(op), total->commands[op]);
+    }
+    if (rc == 0)
+    {
+        rc = buffer_printf(out, "cmd_unknown %llu\n", total->commands[0]);
+    }
+    for (int l = 0; l < NUM_LATENCIES && rc == 0; l++)
+    {
+        const Latency *latency = &total->latency[l];
+        rc = buffer_printf(out, "latency_%s_us count=%llu p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+                           latency_names[l], latency->total, latency_percentile(latency, 5000) / 1000.0,
+                           latency_percentile(latency, 9000) / 1000.0, latency_percentile(latency, 9900) / 1000.0,
+                           latency_percentile(latency, 9990) / 1000.0, latency->max / 1000.0);
+    }
+
+    free(total);
+    return rc;
+}
+
+// memory limit: with --maxmemory the keys and values are accounted for as they change, and
+// a write first evicts entries until they fit again. Candidates are picked by sampling a few
+// random entries and taking the one idle longest (lru) or used least (lfu), so an access
+// only updates a 16-bit field in the entry itself: no list, no lock on the read path.
+//
+// lru: the access field holds the coarse clock in seconds, modulo 2^16
+// lfu: the high byte holds the clock in minutes, the low byte a logarithmic counter that is
+//      bumped with falling probability and loses one per LFU_DECAY_MINUTES of idleness
+#define EVICTION_SAMPLES 5
+#define EVICTION_ROUNDS 64 // evictions a single write may trigger before it gives up
+#define LFU_INIT 5         // starting count, so that a new key is not the first to go
+#define LFU_LOG_FACTOR 10
+#define LFU_DECAY_MINUTES 1
+
+enum
+{
+    EVICT_NONE, // refuse writes over the limit
+    EVICT_LRU,
+    EVICT_LFU
+};
+
+const char *eviction_names[] = {"none", "lru", "lfu"};
+
+unsigned long long maxmemory;       // 0 for no limit
+unsigned long long memory_used;     // only kept while there is a limit
+int eviction_policy = EVICT_LRU;
+int track_access;                   // a limit with an eviction policy: keep access fields up to date
+__thread unsigned long long eviction_random;
+
+void memory_charge(long long bytes)
+{
+    if (maxmemory > 0)
+    {
+        __atomic_add_fetch(&memory_used, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+unsigned eviction_next_random(void)
+{
+    if (eviction_random == 0)
+    {
+        eviction_random = ((unsigned long long)(uintptr_t)&eviction_random ^ now_ns()) | 1;
+    }
+    eviction_random ^= eviction_random << 13;
+    eviction_random ^= eviction_random >> 7;
+    eviction_random ^= eviction_random << 17;
+    return eviction_random >> 32;
+}
+
+unsigned coarse_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+unsigned lfu_count(unsigned short access, unsigned minutes)
+{
+    unsigned count = access & 0xff;
+    unsigned periods = ((minutes - (access >> 8)) & 0xff) / LFU_DECAY_MINUTES;
+
+    return periods >= count ? 0 : count - periods;
+}
+
+// access field of a new entry
+unsigned short access_new(void)
+{
+    if (!track_access)
+    {
+        return 0;
+    }
+    unsigned now = coarse_seconds();
+    return eviction_policy == EVICT_LFU ? ((now / 60) & 0xff) << 8 | LFU_INIT : now & 0xffff;
+}
+
+// readers race on the field without a lock; a lost update only blurs the estimate
+void access_touch(unsigned short *access)
+{
+    unsigned now = coarse_seconds();
+    unsigned short old = __atomic_load_n(access, __ATOMIC_RELAXED);
+    unsigned short value = now & 0xffff;
+
+    if (eviction_policy == EVICT_LFU)
+    {
+        unsigned count = lfu_count(old, now / 60);
+        if (count < 255 && (count <= LFU_INIT || eviction_next_random() % ((count - LFU_INIT) * LFU_LOG_FACTOR + 1) == 0))
+        {
+            count++;
+        }
+        value = ((now / 60) & 0xff) << 8 | count;
+    }
+    // leave the cache line clean when nothing changed
+    if (value != old)
+    {
+        __atomic_store_n(access, value, __ATOMIC_RELAXED);
+    }
+}
+
+// the higher, the better a candidate for eviction
+unsigned access_score(unsigned short access)
+{
+    unsigned now = coarse_seconds();
+
+    if (eviction_policy == EVICT_LFU)
+    {
+        return 255 - lfu_count(access, now / 60);
+    }
+    return (now - access) & 0xffff;
+}
+
+// an eviction candidate; its key is copied out, as the entry may be gone by the time it is
+// deleted, and kept in a buffer at key_at since keys vary in length
+typedef struct Sample
+{
+    unsigned short access;
+    unsigned key_len;
+    size_t key_at;
+} Sample;
+
+int sample_add(Buffer *keys, Sample *sample, const char *key, unsigned key_len, unsigned short access)
+{
+    sample->access = access;
+    sample->key_len = key_len;
+    sample->key_at = keys->len;
+    return buffer_append(keys, key, key_len);
+}
+
+// key expiry: an entry may carry an absolute expiry time in wall-clock seconds (0 = never).
+// Reads treat an expired entry as missing and writers drop it when they come across it;
+// everything else is reclaimed by the expiry thread through one timing wheel per stripe.
+//
+// A wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots: a slot of level l covers
+// WHEEL_SLOTS^l seconds, so four levels of 64 reach about 194 days ahead (timers further
+// out wait in the last level and are re-placed when they come up). As the wheel's clock
+// passes the start of a higher slot, that slot's timers cascade one level down, and the
+// timers of the current level-0 slot become due. A timer only names a key and an expiry
+// time: an update or delete leaves it in place, and it is dropped if the entry no longer
+// expires at that time when it comes due. A wheel only changes under its stripe lock; the
+// expiry thread peeks at it without, to pass over the stripes with nothing due.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+// expired entries removed per stripe lock hold, so a mass expiry never stalls a stripe
+#define EXPIRY_SLICE 32
+#define EXPIRY_INTERVAL_MS 100
+
+typedef struct Timer
+{
+    struct Timer *next;
+    unsigned expires;
+    unsigned hash;
+    unsigned short key_len;
+    char key[];
+} Timer;
+
+typedef struct Wheel
+{
+    unsigned current; // wall-clock second the wheel has advanced to
+    unsigned count;   // timers in the wheel
+    Timer *due;       // timers whose second has come, not yet handled
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} Wheel;
+
+unsigned long long expiry_timers; // pending timers of all wheels
+
+unsigned wall_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return now.tv_sec;
+}
+
+// set while the snapshot and the write-ahead log are loaded: the records must be applied as
+// they happened, even to entries that have expired since
+int expiry_suspended;
+
+// the clock is only read for entries that expire at all
+static inline int entry_expired(unsigned expires)
+{
+    return expires != 0 && !expiry_suspended && expires <= wall_seconds();
+}
+
+void wheel_place(Wheel *wheel, Timer *timer)
+{
+    unsigned delta = timer->expires - wheel->current;
+    Timer **slot;
+
+    if (timer->expires <= wheel->current)
+    {
+        slot = &wheel->due;
+    }
+    else if (delta < WHEEL_SLOTS)
+    {
+        slot = &wheel->slots[0][timer->expires & (WHEEL_SLOTS - 1)];
+    }
+    else if (delta < 1u << (2 * WHEEL_BITS))
+    {
+        slot = &wheel->slots[1][(timer->expires >> WHEEL_BITS) & (WHEEL_SLOTS - 1)];
+    }
+    else if (delta < 1u << (3 * WHEEL_BITS))
+    {
+        slot = &wheel->slots[2][(timer->expires >> (2 * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+    }
+    else
+    {
+        unsigned limit = wheel->current + (1u << (4 * WHEEL_BITS)) - 1;
+        unsigned at = timer->expires < limit ? timer->expires : limit;
+        slot = &wheel->slots[3][(at >> (3 * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+    }
+    timer->next = *slot;
+    __atomic_store_n(slot, timer, __ATOMIC_RELAXED); // wheel_idle peeks at due
+}
+
+// caller holds the stripe lock; the wheel is created on first use. Returns -1 if out of memory
+int wheel_add(Wheel **wheel, const Key *key, unsigned expires)
+{
+    if (*wheel == NULL)
+    {
+        Wheel *created = calloc(1, sizeof(Wheel));
+        if (created == NULL)
+        {
+            return -1;
+        }
+        created->current = wall_seconds();
+        __atomic_store_n(wheel, created, __ATOMIC_RELEASE);
+    }
+    // an empty wheel is not advanced, see wheel_idle; its clock only has to catch up now
+    else if ((*wheel)->count == 0)
+    {
+        __atomic_store_n(&(*wheel)->current, wall_seconds(), __ATOMIC_RELAXED);
+    }
+
+    Timer *timer = slab_alloc(sizeof(Timer) + key->len);
+    if (timer == NULL)
+    {
+        return -1;
+    }
+    timer->expires = expires;
+    timer->hash = key->hash;
+    timer->key_len = key->len;
+    memcpy(timer->key, key->data, key->len);
+    wheel_place(*wheel, timer);
+    __atomic_store_n(&(*wheel)->count, (*wheel)->count + 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&expiry_timers, 1, __ATOMIC_RELAXED);
+    memory_charge(slab_capacity(sizeof(Timer) + key->len));
+    return 0;
+}
+
+static inline Key timer_key(const Timer *timer)
+{
+    Key key = {timer->key, timer->key_len, timer->hash};
+    return key;
+}
+
+// next timer due by now, advancing the wheel as far as needed; the caller frees it with
+// wheel_free_timer. Returns NULL once nothing more is due
+Timer *wheel_pop(Wheel *wheel, unsigned now)
+{
+    if (wheel == NULL)
+    {
+        return NULL;
+    }
+
+    while (wheel->due == NULL)
+    {
+        if (wheel->current >= now)
+        {
+            return NULL;
+        }
+        __atomic_store_n(&wheel->current, wheel->current + 1, __ATOMIC_RELAXED);
+
+        // higher levels first: a timer cascading from level 3 may land in the level 2 or 1
+        // slot that is also coming up now
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            if ((wheel->current & ((1u << (level * WHEEL_BITS)) - 1)) != 0)
+            {
+                continue;
+            }
+            Timer **slot = &wheel->slots[level][(wheel->current >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+            Timer *timer = *slot;
+            *slot = NULL;
+            while (timer != NULL)
+            {
+                Timer *next = timer->next;
+                wheel_place(wheel, timer);
+                timer = next;
+            }
+        }
+
+        Timer **slot = &wheel->slots[0][wheel->current & (WHEEL_SLOTS - 1)];
+        Timer *timer = *slot;
+        *slot = NULL;
+        while (timer != NULL)
+        {
+            Timer *next = timer->next;
+            timer->next = wheel->due;
+            __atomic_store_n(&wheel->due, timer, __ATOMIC_RELAXED);
+            timer = next;
+        }
+    }
+
+    Timer *timer = wheel->due;
+    __atomic_store_n(&wheel->due, timer->next, __ATOMIC_RELAXED);
+    __atomic_store_n(&wheel->count, wheel->count - 1, __ATOMIC_RELAXED);
+    return timer;
+}
+
+// whether wheel_pop is sure to find nothing due by now; read without the stripe lock, so
+// the expiry thread can pass over the stripes with nothing to do. A timer added meanwhile
+// is only late by a sweep
+int wheel_idle(Wheel *const *slot, unsigned now)
+{
+    Wheel *wheel = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    return wheel == NULL || __atomic_load_n(&wheel->count, __ATOMIC_RELAXED) == 0 ||
+           (__atomic_load_n(&wheel->due, __ATOMIC_RELAXED) == NULL && __atomic_load_n(&wheel->current, __ATOMIC_RELAXED) >= now);
+}
+
+void wheel_free_timer(Timer *timer)
+{
+    __atomic_sub_fetch(&expiry_timers, 1, __ATOMIC_RELAXED);
+    memory_charge(-(long long)slab_capacity(sizeof(Timer) + timer->key_len));
+    slab_free(timer, sizeof(Timer) + timer->key_len);
+}
+
+int expiry_stats(Buffer *out)
+{
+    return buffer_printf(out, "expiry_timers %llu\n", __atomic_load_n(&expiry_timers, __ATOMIC_RELAXED));
+}
+
+// ordered index: with --ordered-index every live key is also kept in a skiplist in key
+// order (bytewise, a prefix before its extensions), which is what scan walks. Writers add
+// and remove keys while holding the key's stripe lock, so a key is never added twice. They
+// search for the neighbours without a lock, then lock only those, check that nothing
+// changed in between, and link or unlink; writers on different parts of the index do not
+// wait for each other. Locks are always taken from the higher key down, so they cannot
+// deadlock. Readers take no lock. A node is linked bottom level first and unlinked top
+// level first, so a reader always finds a path forward, and is retired through the epochs
+// like table nodes. Only key creation and removal touch the index; reads and updates
+// never do.
+#define INDEX_MAX_HEIGHT 24
+
+typedef struct IndexNode
+{
+    unsigned short key_len;
+    unsigned char height;
+    unsigned char lock;    // held while linking after this node or unlinking it
+    unsigned char removed; // set under the lock once the node is being unlinked
+    struct IndexNode *next[]; // height pointers, then the key bytes
+} IndexNode;
+
+int ordered_index;
+IndexNode *index_head;
+unsigned long long index_keys;
+
+static inline const char *index_key(const IndexNode *node)
+{
+    return (const char *)(node->next + node->height);
+}
+
+static inline size_t index_node_size(int height, unsigned key_len)
+{
+    return sizeof(IndexNode) + height * sizeof(IndexNode *) + key_len;
+}
+
+// bytewise order, a key sorting before every longer key it is a prefix of
+int key_compare(const char *a, unsigned a_len, const char *b, unsigned b_len)
+{
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (c != 0)
+    {
+        return c;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+void index_init(void)
+{
+    index_head = calloc(1, index_node_size(INDEX_MAX_HEIGHT, 0));
+    if (index_head == NULL)
+    {
+        error("ERROR allocating the ordered index");
+    }
+    index_head->height = INDEX_MAX_HEIGHT;
+}
+
+// the last node before key and the one after it on every level, found without a lock; the
+// caller is inside an epoch section and checks them again under the locks
+void index_find(const Key *key, IndexNode **preds, IndexNode **succs)
+{
+    IndexNode *node = index_head;
+
+    for (int level = INDEX_MAX_HEIGHT - 1; level >= 0; level--)
+    {
+        IndexNode *next;
+        while ((next = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE)) != NULL &&
+               key_compare(index_key(next), next->key_len, key->data, key->len) < 0)
+        {
+            node = next;
+        }
+        preds[level] = node;
+        succs[level] = next;
+    }
+}
+
+// held for a handful of pointer stores, so waiting is a yield rather than a sleep
+static inline void index_lock_node(IndexNode *node)
+{
+    while (__atomic_test_and_set(&node->lock, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&node->lock, __ATOMIC_RELAXED))
+        {
+            sched_yield();
+        }
+    }
+}
+
+static inline void index_unlock_node(IndexNode *node)
+{
+    __atomic_clear(&node->lock, __ATOMIC_RELEASE);
+}
+
+void index_unlock_preds(IndexNode **preds, int levels)
+{
+    for (int level = 0; level < levels; level++)
+    {
+        if (level == 0 || preds[level] != preds[level - 1])
+        {
+            index_unlock_node(preds[level]);
+        }
+    }
+}
+
+// lock the predecessors on levels below height, lowest level (highest key) first, and
+// check that each is still linked and still points at succs; a node shared by several
+// levels is locked once. On a mismatch everything is unlocked again and 0 returned
+int index_lock_preds(IndexNode **preds, IndexNode *const *succs, int height)
+{
+    for (int level = 0; level < height; level++)
+    {
+        if (level == 0 || preds[level] != preds[level - 1])
+        {
+            index_lock_node(preds[level]);
+        }
+        if (preds[level]->removed || __atomic_load_n(&preds[level]->next[level], __ATOMIC_RELAXED) != succs[level])
+        {
+            index_unlock_preds(preds, level + 1);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// each level holds a quarter of the nodes of the one below
+int index_random_height(void)
+{
+    static __thread unsigned long long state;
+
+    if (state == 0)
+    {
+        state = (unsigned long long)(uintptr_t)&state ^ hash_seed ^ 0x9E3779B97F4A7C15ULL;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    int height = 1;
+    for (unsigned long long bits = state; height < INDEX_MAX_HEIGHT && (bits & 3) == 0; bits >>= 2)
+    {
+        height++;
+    }
+    return height;
+}
+
+// add a key the table is about to create; returns -1 if out of memory
+int index_add(const Key *key)
+{
+    if (!ordered_index)
+    {
+        return 0;
+    }
+
+    int height = index_random_height();
+    IndexNode *node = slab_alloc(index_node_size(height, key->len));
+    if (node == NULL)
+    {
+        return -1;
+    }
+    node->key_len = key->len;
+    node->height = height;
+    node->lock = 0;
+    node->removed = 0;
+    memcpy((char *)index_key(node), key->data, key->len);
+
+    IndexNode *preds[INDEX_MAX_HEIGHT];
+    IndexNode *succs[INDEX_MAX_HEIGHT];
+    epoch_enter();
+    do
+    {
+        index_find(key, preds, succs);
+    } while (!index_lock_preds(preds, succs, height));
+    // the node is not reachable yet, so it can point at its successors before any link
+    for (int level = 0; level < height; level++)
+    {
+        node->next[level] = succs[level];
+    }
+    for (int level = 0; level < height; level++)
+    {
+        __atomic_store_n(&preds[level]->next[level], node, __ATOMIC_RELEASE);
+    }
+    index_unlock_preds(preds, height);
+    epoch_exit();
+    __atomic_add_fetch(&index_keys, 1, __ATOMIC_RELAXED);
+    memory_charge(slab_capacity(index_node_size(height, key->len)));
+    return 0;
+}
+
+// drop a key the table no longer holds
+void index_remove(const Key *key)
+{
+    if (!ordered_index)
+    {
+        return;
+    }
+
+    IndexNode *preds[INDEX_MAX_HEIGHT];
+    IndexNode *succs[INDEX_MAX_HEIGHT];
+    epoch_enter();
+    index_find(key, preds, succs);
+    IndexNode *node = succs[0];
+    if (node == NULL || key_compare(index_key(node), node->key_len, key->data, key->len) != 0)
+    {
+        epoch_exit();
+        return;
+    }
+
+    // once marked, nothing links after the node, so its own pointers stay put
+    index_lock_node(node);
+    node->removed = 1;
+    for (int level = 0; level < node->height; level++)
+    {
+        succs[level] = node;
+    }
+    while (!index_lock_preds(preds, succs, node->height))
+    {
+        index_find(key, preds, succs);
+        for (int level = 0; level < node->height; level++)
+        {
+            succs[level] = node;
+        }
+    }
+    for (int level = node->height - 1; level >= 0; level--)
+    {
+        __atomic_store_n(&preds[level]->next[level], node->next[level], __ATOMIC_RELEASE);
+    }
+    index_unlock_preds(preds, node->height);
+    index_unlock_node(node);
+    epoch_exit();
+    __atomic_sub_fetch(&index_keys, 1, __ATOMIC_RELAXED);
+
+    size_t size = index_node_size(node->height, node->key_len);
+    memory_charge(-(long long)slab_capacity(size));
+    epoch_retire(node, size);
+}
+
+// the first node at or after key, for a reader inside an epoch section
+const IndexNode *index_seek(const char *key, unsigned key_len)
+{
+    const IndexNode *node = index_head;
+
+    for (int level = INDEX_MAX_HEIGHT - 1; level >= 0; level--)
+    {
+        const IndexNode *next;
+        while ((next = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE)) != NULL &&
+               key_compare(index_key(next), next->key_len, key, key_len) < 0)
+        {
+            node = next;
+        }
+    }
+    return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+static inline const IndexNode *index_next(const IndexNode *node)
+{
+    return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+int index_stats(Buffer *out)
+{
+    if (!ordered_index)
+    {
+        return 0;
+    }
+    return buffer_printf(out, "index_keys %llu\n", __atomic_load_n(&index_keys, __ATOMIC_RELAXED));
+}
+
+// a read-modify-write command (incr, decr, append, prepend, cas or getset). The engine finds
+// the entry under its lock, has modify_apply work out the new value from the old one, and
+// stores it before letting go of the lock
+typedef struct Modify
+{
+    int opcode;
+    const char *arg; // the request value: the delta, the bytes to add or the new value
+    int arg_len;
+    unsigned expires; // for cas and getset, which replace it like an update
+    unsigned version; // cas: the version expected; on return, the entry's version
+    // the new value is head, then the old value if keep is set, then tail
+    const char *head;
+    int head_len;
+    int keep;
+    const char *tail;
+    int tail_len;
+    // getset: the old value, which stays alive for the caller's epoch section; if it was
+    // stored inline by the open engine, old is NULL and the bytes are copied into bytes
+    const Value *old;
+    unsigned old_len;
+    char bytes[24]; // also incr's result, in decimal
+} Modify;
+
+static inline int modify_opcode(int opcode)
+{
+    return opcode >= OP_INCR && opcode <= OP_GETSET && opcode != OP_GETS;
+}
+
+static inline int keeps_expiry(int opcode)
+{
+    return opcode != OP_CAS && opcode != OP_GETSET;
+}
+
+// a value holding a signed 64-bit number in decimal, nothing else; returns 0 if it is not one
+int parse_number(const char *data, unsigned len, long long *number)
+{
+    unsigned i = len > 0 && data[0] == '-';
+    long long n = 0;
+
+    if (i == len)
+    {
+        return 0;
+    }
+    for (; i < len; i++)
+    {
+        int digit = data[i] - '0';
+        if (digit < 0 || digit > 9 || __builtin_mul_overflow(n, 10, &n) ||
+            (data[0] == '-' ? __builtin_sub_overflow(n, digit, &n) : __builtin_add_overflow(n, digit, &n)))
+        {
+            return 0;
+        }
+    }
+    *number = n;
+    return 1;
+}
+
+// decide the new value of the entry holding data (found is 0 if the key is missing, and
+// value is NULL if the data is not in a Value of its own); returns a protocol status, and
+// STATUS_OK means the result is to be stored
+int modify_apply(Modify *op, int found, const Value *value, const char *data, unsigned len, unsigned version)
+{
+    op->head = op->tail = NULL;
+    op->head_len = op->tail_len = op->keep = 0;
+
+    if (op->opcode == OP_INCR || op->opcode == OP_DECR)
+    {
+        // a missing key counts from 0
+        long long number = 0, delta = 1;
+        if ((found && !parse_number(data, len, &number)) || (op->arg_len > 0 && !parse_number(op->arg, op->arg_len, &delta)) ||
+            (op->opcode == OP_INCR ? __builtin_add_overflow(number, delta, &number) : __builtin_sub_overflow(number, delta, &number)))
+        {
+            return STATUS_NOT_A_NUMBER;
+        }
+        op->head = op->bytes;
+        op->head_len = snprintf(op->bytes, sizeof(op->bytes), "%lld", number);
+        return STATUS_OK;
+    }
+    if (!found)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    if (op->opcode == OP_APPEND || op->opcode == OP_PREPEND)
+    {
+        if (len + (unsigned long long)op->arg_len > PROTO_MAX_VALUE_SIZE)
+        {
+            return STATUS_BAD_REQUEST;
+        }
+        op->keep = 1;
+        if (op->opcode == OP_APPEND)
+        {
+            op->tail = op->arg;
+            op->tail_len = op->arg_len;
+        }
+        else
+        {
+            op->head = op->arg;
+            op->head_len = op->arg_len;
+        }
+        return STATUS_OK;
+    }
+
+    if (op->opcode == OP_CAS && version != op->version)
+    {
+        op->version = version;
+        return STATUS_VERSION_MISMATCH;
+    }
+    if (op->opcode == OP_GETSET)
+    {
+        op->old = value;
+        op->old_len = len;
+        if (value == NULL)
+        {
+            memcpy(op->bytes, data, len);
+        }
+    }
+    op->head = op->arg;
+    op->head_len = op->arg_len;
+    return STATUS_OK;
+}
+
+static inline unsigned modify_length(const Modify *op, unsigned len)
+{
+    return op->head_len + (op->keep ? len : 0) + op->tail_len;
+}
+
+// write the new value of an entry holding data to dst
+void modify_join(char *dst, const Modify *op, const char *data, unsigned len)
+{
+    memcpy(dst, op->head, op->head_len);
+    if (op->keep)
+    {
+        memcpy(dst + op->head_len, data, len);
+    }
+    memcpy(dst + modify_length(op, len) - op->tail_len, op->tail, op->tail_len);
+}
+
+// the new value of an entry holding data, in old if that is where data is; an append that
+// fits in the slack of old is written into it and old comes back grown, otherwise a new
+// Value is built. Returns NULL if out of memory
+Value *value_modify(Value *old, const char *data, unsigned len, const Modify *op)
+{
+    if (old != NULL && op->keep && op->head_len == 0 && value_slack(old) >= (size_t)op->tail_len)
+    {
+        memcpy(old->data + len, op->tail, op->tail_len);
+        __atomic_store_n(&old->len, len + op->tail_len, __ATOMIC_RELEASE);
+        return old;
+    }
+
+    Value *value = slab_alloc(sizeof(Value) + modify_length(op, len));
+    if (value != NULL)
+    {
+        value->len = modify_length(op, len);
+        modify_join(value->data, op, data, len);
+    }
+    return value;
+}
+
+// an append or prepend is logged as itself, the rest as the update they amount to
+void modify_log(const Key *key, const Modify *op, const char *value, unsigned value_len, unsigned expires)
+{
+    if (op->opcode == OP_APPEND || op->opcode == OP_PREPEND)
+    {
+        wal_append(op->opcode, key, op->arg, op->arg_len, 0);
+    }
+    else
+    {
+        wal_append(OP_UPDATE, key, value, value_len, expires);
+    }
+}
+
+// the key bytes follow the node, so a lookup touches one allocation until the value
+typedef struct KeyValue
+{
+    unsigned hash;
+    unsigned short key_len;
+    unsigned short access; // for eviction, see access_touch
+    unsigned expires;      // wall-clock second the entry expires, 0 for never
+    unsigned version;      // see Stripe
+    Value *value;
+    struct KeyValue *next;
+    char key[];
+} KeyValue;
+
+static inline size_t node_size(const KeyValue *node)
+{
+    return sizeof(KeyValue) + node->key_len;
+}
+
+static inline Key node_key(const KeyValue *node)
+{
+    Key key = {node->key, node->key_len, node->hash};
+    return key;
+}
+
+// writers take the stripe lock of the key: bucket i belongs to stripe i % NUM_STRIPES
+#define NUM_STRIPES 256
+
+// bucket arrays are powers of two and never smaller than NUM_STRIPES, so a key maps to
+// the same stripe in every table size and a bucket is always rehashed under one stripe lock
+#define INITIAL_TABLE_SIZE 1024
+
+// grow when there is more than one entry per bucket, shrink below one per eight buckets
+#define MAX_LOAD_FACTOR 1
+#define MIN_LOAD_DIVISOR 8
+
+// old buckets a writer migrates per operation while a rehash is in progress
+#define REHASH_STEP 4
+
+// padded so that neighbouring stripes never share a cache line. Every write of a key gives
+// it the next version of its stripe, so a key never gets a version back once it has moved
+// past it, not even by being deleted and created again; the counts start at random so
+// they are not repeated after a restart either
+typedef struct Stripe
+{
+    pthread_mutex_t lock;
+    Wheel *wheel; // expiry timers of the stripe's keys
+    unsigned version;
+} __attribute__((aligned(64))) Stripe;
+
+// the bucket arrays in use, replaced as a whole so that lock-free readers always see a
+// consistent set; while rehashing, entries are copied from old_buckets into buckets a few
+// buckets at a time, each stripe migrating its own old buckets in order and counting them
+// in rehash_cursor
+typedef struct TableState
+{
+    KeyValue **buckets;
+    unsigned size;
+    KeyValue **old_buckets;
+    unsigned old_size;
+    unsigned rehash_cursor[NUM_STRIPES];
+} TableState;
+
+typedef struct HashTable
+{
+    TableState *state;
+    int stripes_rehashing;
+    unsigned help_cursor;
+
+    long count;
+    pthread_mutex_t resize_lock;
+    Stripe stripes[NUM_STRIPES];
+} HashTable;
+
+HashTable table;
+
+void table_init(HashTable *ht)
+{
+    ht->state = calloc(1, sizeof(TableState));
+    if (ht->state == NULL)
+    {
+        error("ERROR allocating hash table");
+    }
+    ht->state->size = INITIAL_TABLE_SIZE;
+    ht->state->buckets = calloc(INITIAL_TABLE_SIZE, sizeof(KeyValue *));
+    if (ht->state->buckets == NULL)
+    {
+        error("ERROR allocating hash table");
+    }
+    pthread_mutex_init(&ht->resize_lock, NULL);
+    for (int i = 0; i < NUM_STRIPES; i++)
+    {
+        pthread_mutex_init(&ht->stripes[i].lock, NULL);
+        ht->stripes[i].version = hash_mix(hash_seed, i);
+    }
+}
+
+TableState *table_state(HashTable *ht)
+{
+    return __atomic_load_n(&ht->state, __ATOMIC_ACQUIRE);
+}
+
+// the bucket a key currently lives in: its old bucket until that has been migrated
+KeyValue **find_bucket(TableState *st, unsigned h)
+{
+    if (st->old_buckets != NULL)
+    {
+        unsigned index = h & (st->old_size - 1);
+        if (index / NUM_STRIPES >= __atomic_load_n(&st->rehash_cursor[index % NUM_STRIPES], __ATOMIC_ACQUIRE))
+        {
+            return &st->old_buckets[index];
+        }
+    }
+    return &st->buckets[h & (st->size - 1)];
+}
+
+// copy up to REHASH_STEP old buckets of a stripe into the new array; the old chains are
+// left intact for readers still walking them and their nodes retired
+// caller holds the stripe lock; returns 1 if this finished the last stripe
+int rehash_step(HashTable *ht, int stripe)
+{
+    TableState *st = ht->state;
+    unsigned per_stripe = st->old_size / NUM_STRIPES;
+
+    if (st->old_buckets == NULL || st->rehash_cursor[stripe] == per_stripe)
+    {
+        return 0;
+    }
+
+    for (int step = 0; step < REHASH_STEP && st->rehash_cursor[stripe] < per_stripe; step++)
+    {
+        unsigned index = st->rehash_cursor[stripe] * NUM_STRIPES + stripe;
+
+        // build all copies first, so running out of memory leaves the bucket untouched
+        KeyValue *copies = NULL;
+        for (KeyValue *current = st->old_buckets[index]; current != NULL; current = current->next)
+        {
+            KeyValue *copy = slab_alloc(node_size(current));
+            if (copy == NULL)
+            {
+                while (copies != NULL)
+                {
+                    KeyValue *next = copies->next;
+                    slab_free(copies, node_size(copies));
+                    copies = next;
+                }
+                return 0;
+            }
+            memcpy(copy, current, node_size(current));
+            copy->next = copies;
+            copies = copy;
+        }
+
+        while (copies != NULL)
+        {
+            KeyValue *copy = copies;
+            KeyValue **bucket = &st->buckets[copy->hash & (st->size - 1)];
+            copies = copy->next;
+            copy->next = *bucket;
+            __atomic_store_n(bucket, copy, __ATOMIC_RELEASE);
+        }
+
+        // readers now look in the new array; the old nodes go once they are done
+        __atomic_store_n(&st->rehash_cursor[stripe], st->rehash_cursor[stripe] + 1, __ATOMIC_RELEASE);
+        for (KeyValue *current = st->old_buckets[index]; current != NULL; current = current->next)
+        {
+            epoch_retire(current, node_size(current));
+        }
+    }
+
+    if (st->rehash_cursor[stripe] < per_stripe)
+    {
+        return 0;
+    }
+    return __atomic_sub_fetch(&ht->stripes_rehashing, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+void lock_all_stripes(HashTable *ht)
+{
+    for (int i = 0; i < NUM_STRIPES; i++)
+    {
+        pthread_mutex_lock(&ht->stripes[i].lock);
+    }
+}
+
+void unlock_all_stripes(HashTable *ht)
+{
+    for (int i = 0; i < NUM_STRIPES; i++)
+    {
+        pthread_mutex_unlock(&ht->stripes[i].lock);
+    }
+}
+
+// install a new state; the old one (and the old bucket array, if given) is retired
+void publish_state(HashTable *ht, KeyValue **buckets, unsigned size, KeyValue **old_buckets, unsigned old_size, KeyValue **retired_buckets)
+{
+    TableState *st = calloc(1, sizeof(TableState));
+    if (st == NULL)
+    {
+        error("ERROR allocating hash table");
+    }
+    st->buckets = buckets;
+    st->size = size;
+    st->old_buckets = old_buckets;
+    st->old_size = old_size;
+
+    TableState *old = ht->state;
+    __atomic_store_n(&ht->state, st, __ATOMIC_RELEASE);
+    epoch_retire(old, 0);
+    if (retired_buckets != NULL)
+    {
+        epoch_retire(retired_buckets, 0);
+    }
+}
+
+// every stripe has migrated its buckets: drop the old array
+void finish_rehash(HashTable *ht)
+{
+    lock_all_stripes(ht);
+    TableState *st = ht->state;
+    publish_state(ht, st->buckets, st->size, NULL, 0, st->old_buckets);
+    unlock_all_stripes(ht);
+}
+
+// migrate a few buckets of some other stripe, so stripes that see no writes still finish
+void help_rehash(HashTable *ht)
+{
+    int stripe = __atomic_fetch_add(&ht->help_cursor, 1, __ATOMIC_RELAXED) % NUM_STRIPES;
+    pthread_mutex_t *lock = &ht->stripes[stripe].lock;
+
+    if (pthread_mutex_trylock(lock) != 0)
+    {
+        return;
+    }
+    int finished = rehash_step(ht, stripe);
+    pthread_mutex_unlock(lock);
+
+    if (finished)
+    {
+        finish_rehash(ht);
+    }
+}
+
+// start growing or shrinking if the load factor is out of range; the entries themselves
+// are moved later by rehash_step, so this only costs an allocation and one pass over the locks
+// caller holds no stripe lock
+void maybe_resize(HashTable *ht)
+{
+    long count = __atomic_load_n(&ht->count, __ATOMIC_RELAXED);
+    unsigned new_size;
+
+    // the state may be retired under us, so only look at it inside an epoch
+    epoch_enter();
+    TableState *st = table_state(ht);
+    unsigned size = st->size;
+    int rehashing = st->old_buckets != NULL;
+    epoch_exit();
+
+    if (rehashing)
+    {
+        help_rehash(ht);
+        return;
+    }
+
+    if (count > (long)size * MAX_LOAD_FACTOR)
+    {
+        new_size = size * 2;
+    }
+    else if (size > INITIAL_TABLE_SIZE && count < (long)size / MIN_LOAD_DIVISOR)
+    {
+        new_size = size / 2;
+    }
+    else
+    {
+        return;
+    }
+
+    // one resize at a time, and never on top of one that is still migrating
+    if (pthread_mutex_trylock(&ht->resize_lock) != 0)
+    {
+        return;
+    }
+
+    KeyValue **buckets = calloc(new_size, sizeof(KeyValue *));
+    if (buckets == NULL)
+    {
+        pthread_mutex_unlock(&ht->resize_lock);
+        return;
+    }
+
+    lock_all_stripes(ht);
+    if (ht->state->old_buckets == NULL && ht->state->size == size)
+    {
+        ht->stripes_rehashing = NUM_STRIPES;
+        publish_state(ht, buckets, new_size, ht->state->buckets, size, NULL);
+        buckets = NULL;
+    }
+    unlock_all_stripes(ht);
+
+    free(buckets);
+    pthread_mutex_unlock(&ht->resize_lock);
+}
+
+KeyValue *createNode(const Key *key, const char *value, int value_len, unsigned expires)
+{
+    KeyValue *newNode = (KeyValue *)slab_alloc(sizeof(KeyValue) + key->len);
+
+    if (newNode == NULL)
+    {
+        return NULL;
+    }
+
+    newNode->hash = key->hash;
+    newNode->key_len = key->len;
+    memcpy(newNode->key, key->data, key->len);
+    newNode->access = access_new();
+    newNode->expires = expires;
+    // values arrive straight from the connection buffer, so copy them
+    newNode->value = value_create(value, value_len);
+
+    // if the allocation fails
+    if (newNode->value == NULL)
+    {
+        slab_free(newNode, node_size(newNode));
+        return NULL;
+    }
+
+    newNode->next = NULL;
+
+    return newNode;
+}
+
+// safe without a lock inside an epoch section; writers call it under the stripe lock
+KeyValue *search(HashTable *ht, const Key *key)
+{
+    KeyValue *current = __atomic_load_n(find_bucket(table_state(ht), key->hash), __ATOMIC_ACQUIRE);
+
+    while (current != NULL)
+    {
+        if (key_equals(current->hash, current->key_len, current->key, key))
+        {
+            return current;
+        }
+        current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE);
+    }
+
+    return NULL;
+}
+
+// the functions below expect the caller to hold the key's stripe lock; nodes are fully
+// built before they are linked in, and unlinked memory is retired rather than freed.
+// Every change is logged before the lock is released
+
+// the key's expiry timer goes into its stripe's wheel; returns 0 if out of memory. A timer
+// left behind by a write that fails afterwards is harmless, it is dropped when it comes due
+int add_timer(HashTable *ht, const Key *key, unsigned expires)
+{
+    return expires == 0 || wheel_add(&ht->stripes[key->hash & (NUM_STRIPES - 1)].wheel, key, expires) == 0;
+}
+
+static inline unsigned next_version(HashTable *ht, const Key *key)
+{
+    return ++ht->stripes[key->hash & (NUM_STRIPES - 1)].version;
+}
+
+// a reader that sees the new version also sees the new value, so a value read together with
+// its version (see chained_read) is never older than the version
+static inline void set_version(HashTable *ht, KeyValue *node, const Key *key)
+{
+    __atomic_store_n(&node->version, next_version(ht, key), __ATOMIC_RELEASE);
+}
+
+int insert(HashTable *ht, const Key *key, const char *value, int value_len, unsigned expires)
+{
+    KeyValue **bucket = find_bucket(ht->state, key->hash);
+
+    if (!add_timer(ht, key, expires) || index_add(key) < 0)
+    {
+        return 0;
+    }
+    KeyValue *newNode = createNode(key, value, value_len, expires);
+    if (newNode == NULL)
+    {
+        index_remove(key);
+        return 0;
+    }
+    newNode->version = next_version(ht, key);
+
+    newNode->next = *bucket;
+    __atomic_store_n(bucket, newNode, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ht->count, 1, __ATOMIC_RELAXED);
+    memory_charge(slab_capacity(node_size(newNode)) + value_memory(newNode->value));
+    wal_append(OP_CREATE, key, value, value_len, expires);
+    return 1;
+}
+
+// returns 0 if the key was not there or had already expired (it is removed either way)
+int delete(HashTable *ht, const Key *key)
+{
+    KeyValue **bucket = find_bucket(ht->state, key->hash);
+
+    KeyValue *current = *bucket;
+    KeyValue *prev = NULL;
+
+    while (current != NULL)
+    {
+        if (key_equals(current->hash, current->key_len, current->key, key))
+        {
+            if (prev == NULL)
+            {
+                // deleting head node
+                __atomic_store_n(bucket, current->next, __ATOMIC_RELEASE);
+            }
+            else
+            {
+                __atomic_store_n(&prev->next, current->next, __ATOMIC_RELEASE);
+            }
+
+            int expired = entry_expired(current->expires);
+            index_remove(key);
+            memory_charge(-(long long)(slab_capacity(node_size(current)) + value_memory(current->value)));
+            value_retire(current->value);
+            epoch_retire(current, node_size(current));
+            __atomic_sub_fetch(&ht->count, 1, __ATOMIC_RELAXED);
+            wal_append(OP_DELETE, key, NULL, 0, 0);
+            return !expired;
+        }
+
+        prev = current;
+        current = current->next;
+    }
+    // deletion failed, key not found
+    return 0;
+}
+
+// an update replaces the expiry time along with the value
+int update(HashTable *ht, const Key *key, const char *newValue, int value_len, unsigned expires)
+{
+    KeyValue *current = search(ht, key);
+
+    if (current == NULL || entry_expired(current->expires))
+    {
+        // update failed, key not found; an expired entry goes now that we hold its lock
+        if (current != NULL)
+        {
+            delete(ht, key);
+        }
+        return 0;
+    }
+
+    if (expires != current->expires && !add_timer(ht, key, expires))
+    {
+        return -1;
+    }
+    Value *value = value_create(newValue, value_len);
+    if (value == NULL)
+    {
+        return -1;
+    }
+
+    Value *old = current->value;
+    __atomic_store_n(&current->value, value, __ATOMIC_RELEASE);
+    __atomic_store_n(&current->expires, expires, __ATOMIC_RELAXED);
+    set_version(ht, current, key);
+    memory_charge((long long)value_memory(value) - (long long)value_memory(old));
+    value_retire(old);
+    if (track_access)
+    {
+        access_touch(&current->access);
+    }
+    wal_append(OP_UPDATE, key, newValue, value_len, expires);
+    return 1;
+}
+
+// store what modify_apply made of an entry; returns 0 if out of memory
+int modify(HashTable *ht, KeyValue *current, const Key *key, Modify *op)
+{
+    unsigned expires = keeps_expiry(op->opcode) ? current->expires : op->expires;
+
+    if (expires != current->expires && !add_timer(ht, key, expires))
+    {
+        return 0;
+    }
+    Value *old = current->value;
+    size_t old_memory = value_memory(old);
+    Value *value = value_modify(old, old->data, old->len, op);
+    if (value == NULL)
+    {
+        return 0;
+    }
+
+    if (value != old)
+    {
+        __atomic_store_n(&current->value, value, __ATOMIC_RELEASE);
+        value_retire(old);
+    }
+    __atomic_store_n(&current->expires, expires, __ATOMIC_RELAXED);
+    set_version(ht, current, key);
+    op->version = current->version;
+    memory_charge((long long)value_memory(value) - (long long)old_memory);
+    if (track_access)
+    {
+        access_touch(&current->access);
+    }
+    modify_log(key, op, value->data, value->len, expires);
+    return 1;
+}
+
+// one key of a multi-key write; the engine fills in status
+typedef struct BatchItem
+{
+    Key key;
+    int stripe;
+    int index; // position in the request, responses go back in this order
+    const char *value;
+    int value_len;
+    unsigned expires;
+    int status;
+} BatchItem;
+
+// called for every key by an engine's walk; expired entries are skipped
+typedef void (*EntryVisitor)(const Key *key, const char *value, unsigned value_len, unsigned expires, void *arg);
+
+// chained engine: writes under the key's stripe lock, lock-free reads; returns a protocol status
+
+void chained_init(void)
+{
+    table_init(&table);
+}
+
+// writers take the stripe lock through here so they also push a pending rehash forward
+pthread_mutex_t *write_lock(HashTable *ht, const Key *key)
+{
+    int stripe = key->hash & (NUM_STRIPES - 1);
+    pthread_mutex_t *lock = &ht->stripes[stripe].lock;
+
+    stats_lock(lock);
+    if (rehash_step(ht, stripe))
+    {
+        // this was the last stripe: the old array can go, but not while we hold a stripe
+        pthread_mutex_unlock(lock);
+        finish_rehash(ht);
+        stats_lock(lock);
+    }
+    return lock;
+}
+
+int chained_create(const Key *key, const char *value, int value_len, unsigned expires)
+{
+    int status = STATUS_OK;
+
+    // the existence check and the insert happen under one lock; an expired entry makes way
+    pthread_mutex_t *lock = write_lock(&table, key);
+    KeyValue *current = search(&table, key);
+    if (current != NULL && entry_expired(current->expires))
+    {
+        delete(&table, key);
+        current = NULL;
+    }
+    if (current != NULL)
+    {
+        status = STATUS_KEY_EXISTS;
+    }
+    else if (!insert(&table, key, value, value_len, expires))
+    {
+        status = STATUS_OUT_OF_MEMORY;
+    }
+    pthread_mutex_unlock(lock);
+
+    maybe_resize(&table);
+    return status;
+}
+
+// append the value to out without taking any lock; the epoch keeps the value alive until
+// it has been copied, so a concurrent update or delete never frees it under us. The version,
+// if asked for, is loaded first: the value may be newer, which only makes a cas fail
+int chained_read(const Key *key, Buffer *out, unsigned *version)
+{
+    int status = STATUS_OK;
+
+    epoch_enter();
+    KeyValue *node = search(&table, key);
+    if (node == NULL || entry_expired(__atomic_load_n(&node->expires, __ATOMIC_RELAXED)))
+    {
+        status = STATUS_NOT_FOUND;
+    }
+    else
+    {
+        if (version != NULL)
+        {
+            *version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+        }
+        Value *value = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+        if (buffer_append_value(out, value) < 0)
+        {
+            status = STATUS_OUT_OF_MEMORY;
+        }
+        if (track_access)
+        {
+            access_touch(&node->access);
+        }
+    }
+    epoch_exit();
+    return status;
+}
+
+int chained_update(const Key *key, const char *value, int value_len, unsigned expires)
+{
+    pthread_mutex_t *lock = write_lock(&table, key);
+    int rc = update(&table, key, value, value_len, expires);
+    pthread_mutex_unlock(lock);
+
+    if (rc == 0)
+    {
+        return STATUS_NOT_FOUND;
+    }
+    return rc < 0 ? STATUS_OUT_OF_MEMORY : STATUS_OK;
+}
+
+int chained_modify(const Key *key, Modify *op)
+{
+    pthread_mutex_t *lock = write_lock(&table, key);
+    KeyValue *current = search(&table, key);
+    if (current != NULL && entry_expired(current->expires))
+    {
+        delete(&table, key);
+        current = NULL;
+    }
+
+    int status;
+    if (current == NULL)
+    {
+        // only incr and decr create the key
+        status = modify_apply(op, 0, NULL, NULL, 0, 0);
+        if (status == STATUS_OK && !insert(&table, key, op->head, op->head_len, 0))
+        {
+            status = STATUS_OUT_OF_MEMORY;
+        }
+        else if (status == STATUS_OK)
+        {
+            op->version = table.stripes[key->hash & (NUM_STRIPES - 1)].version;
+        }
+    }
+    else
+    {
+        status = modify_apply(op, 1, current->value, current->value->data, current->value->len, current->version);
+        if (status == STATUS_OK && !modify(&table, current, key, op))
+        {
+            status = STATUS_OUT_OF_MEMORY;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    if (current == NULL)
+    {
+        maybe_resize(&table);
+    }
+    return status;
+}
+
+int chained_delete(const Key *key)
+{
+    pthread_mutex_t *lock = write_lock(&table, key);
+    int rc = delete(&table, key);
+    pthread_mutex_unlock(lock);
+
+    maybe_resize(&table);
+    return rc ? STATUS_OK : STATUS_NOT_FOUND;
+}
+
+// apply mset (create or update) or mdelete to items sorted by stripe, locking each stripe once
+void chained_multi_write(BatchItem *items, int n, int opcode)
+{
+    for (int i = 0; i < n;)
+    {
+        int stripe = items[i].stripe;
+        pthread_mutex_t *lock = write_lock(&table, &items[i].key);
+
+        for (; i < n && items[i].stripe == stripe; i++)
+        {
+            BatchItem *item = &items[i];
+
+            if (opcode == OP_MDELETE)
+            {
+                item->status = delete(&table, &item->key) ? STATUS_OK : STATUS_NOT_FOUND;
+                continue;
+            }
+            int rc = update(&table, &item->key, item->value, item->value_len, item->expires);
+            if (rc == 0)
+            {
+                rc = insert(&table, &item->key, item->value, item->value_len, item->expires) ? 1 : -1;
+            }
+            item->status = rc < 0 ? STATUS_OUT_OF_MEMORY : STATUS_OK;
+        }
+        pthread_mutex_unlock(lock);
+    }
+
+    maybe_resize(&table);
+}
+
+// visit every entry; only safe while no writer runs, as in a forked snapshot process
+void chained_walk(EntryVisitor visit, void *arg)
+{
+    TableState *st = table.state;
+
+    // old buckets that have not been migrated yet, then the new array
+    for (unsigned i = 0; st->old_buckets != NULL && i < st->old_size; i++)
+    {
+        if (i / NUM_STRIPES < st->rehash_cursor[i % NUM_STRIPES])
+        {
+            continue;
+        }
+        for (KeyValue *node = st->old_buckets[i]; node != NULL; node = node->next)
+        {
+            if (!entry_expired(node->expires))
+            {
+                Key key = node_key(node);
+                visit(&key, node->value->data, node->value->len, node->expires, arg);
+            }
+        }
+    }
+    for (unsigned i = 0; i < st->size; i++)
+    {
+        for (KeyValue *node = st->buckets[i]; node != NULL; node = node->next)
+        {
+            if (!entry_expired(node->expires))
+            {
+                Key key = node_key(node);
+                visit(&key, node->value->data, node->value->len, node->expires, arg);
+            }
+        }
+    }
+}
+
+typedef struct ChainStats
+{
+    unsigned long long entries;
+    unsigned long long used;
+    unsigned long long longest;
+    unsigned long long key_bytes;
+    unsigned long long value_bytes;
+} ChainStats;
+
+void chain_stats(KeyValue *node, ChainStats *cs)
+{
+    unsigned long long length = 0;
+
+    for (; node != NULL; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))
+    {
+        length++;
+        cs->key_bytes += node->key_len;
+        cs->value_bytes += __atomic_load_n(&node->value, __ATOMIC_ACQUIRE)->len;
+    }
+    cs->entries += length;
+    cs->used += length > 0;
+    if (length > cs->longest)
+    {
+        cs->longest = length;
+    }
+}
+
+// bucket occupancy and chain lengths, walked without locks like a read: a chain that
+// changes meanwhile may be counted before or after the change
+int chained_stats(Buffer *out)
+{
+    ChainStats cs = {0};
+
+    epoch_enter();
+    TableState *st = table_state(&table);
+    unsigned buckets = st->size;
+    for (unsigned i = 0; st->old_buckets != NULL && i < st->old_size; i++)
+    {
+        if (i / NUM_STRIPES >= __atomic_load_n(&st->rehash_cursor[i % NUM_STRIPES], __ATOMIC_ACQUIRE))
+        {
+            chain_stats(__atomic_load_n(&st->old_buckets[i], __ATOMIC_ACQUIRE), &cs);
+        }
+    }
+    for (unsigned i = 0; i < st->size; i++)
+    {
+        chain_stats(__atomic_load_n(&st->buckets[i], __ATOMIC_ACQUIRE), &cs);
+    }
+    int rehashing = st->old_buckets != NULL;
+    epoch_exit();
+
+    return buffer_printf(out,
+                         "table_entries %llu\n"
+                         "table_buckets %u\n"
+                         "table_used_buckets %llu\n"
+                         "table_longest_chain %llu\n"
+                         "table_rehashing %d\n"
+                         "key_bytes %llu\n"
+                         "value_bytes %llu\n",
+                         cs.entries, buckets, cs.used, cs.longest, rehashing, cs.key_bytes, cs.value_bytes);
+}
+
+// up to n entries from random buckets, read like a lookup; returns how many were found
+int chained_sample(Buffer *keys, Sample *samples, int n)
+{
+    int found = 0;
+
+    epoch_enter();
+    TableState *st = table_state(&table);
+    for (int probe = 0; probe < n * 16 && found < n; probe++)
+    {
+        KeyValue *node = __atomic_load_n(find_bucket(st, eviction_next_random()), __ATOMIC_ACQUIRE);
+        for (; node != NULL && found < n; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))
+        {
+            if (sample_add(keys, &samples[found], node->key, node->key_len, __atomic_load_n(&node->access, __ATOMIC_RELAXED)) < 0)
+            {
+                epoch_exit();
+                return found;
+            }
+            found++;
+        }
+    }
+    epoch_exit();
+    return found;
+}
+
+// link a value from a snapshot mapping in place; the key is known to be absent
+int chained_restore(const Key *key, Value *value, unsigned expires)
+{
+    KeyValue *node = slab_alloc(sizeof(KeyValue) + key->len);
+    if (node == NULL)
+    {
+        return STATUS_OUT_OF_MEMORY;
+    }
+    node->hash = key->hash;
+    node->key_len = key->len;
+    memcpy(node->key, key->data, key->len);
+    node->access = access_new();
+    node->expires = expires;
+    node->value = value;
+
+    pthread_mutex_t *lock = write_lock(&table, key);
+    if (!add_timer(&table, key, expires) || index_add(key) < 0)
+    {
+        pthread_mutex_unlock(lock);
+        slab_free(node, node_size(node));
+        return STATUS_OUT_OF_MEMORY;
+    }
+    memory_charge(slab_capacity(node_size(node)) + value_memory(value));
+    node->version = next_version(&table, key);
+    KeyValue **bucket = find_bucket(table.state, key->hash);
+    node->next = *bucket;
+    __atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&table.count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(lock);
+
+    maybe_resize(&table);
+    return STATUS_OK;
+}
+
+// handle up to budget due timers of one stripe, removing the entries that really expired;
+// returns how many timers were handled
+int chained_expire(int stripe, unsigned now, int budget)
+{
+    int handled = 0;
+    int expired = 0;
+
+    if (wheel_idle(&table.stripes[stripe].wheel, now))
+    {
+        return 0;
+    }
+    pthread_mutex_t *lock = &table.stripes[stripe].lock;
+    stats_lock(lock);
+    for (Timer *timer; handled < budget && (timer = wheel_pop(table.stripes[stripe].wheel, now)) != NULL; handled++)
+    {
+        Key key = timer_key(timer);
+        KeyValue *current = search(&table, &key);
+        if (current != NULL && current->expires == timer->expires)
+        {
+            delete(&table, &key);
+            expired++;
+        }
+        wheel_free_timer(timer);
+    }
+    pthread_mutex_unlock(lock);
+
+    if (expired > 0)
+    {
+        stats_thread_record()->expired += expired;
+        maybe_resize(&table);
+    }
+    return handled;
+}
+
+void chained_lock_writes(void)
+{
+    lock_all_stripes(&table);
+}
+
+void chained_unlock_writes(void)
+{
+    unlock_all_stripes(&table);
+}
+
+// open addressing engine: the key space is split into NUM_STRIPES segments, each a
+// Robin Hood hash table. Keys and short values are stored inline in the slot, so a hit
+// usually touches a single cache line. Writers serialize on the segment lock; readers
+// take no lock and instead retry if the segment's sequence count changed under them.
+
+#define OPEN_INITIAL_CAPACITY 64
+#define INLINE_KEY_SIZE 24
+#define INLINE_VALUE_SIZE 16
+
+// 64 bytes; longer keys and values live out of line and are immutable like values
+typedef struct Slot
+{
+    unsigned hash;
+    unsigned expires; // wall-clock second the entry expires, 0 for never
+    unsigned value_len;
+    unsigned short key_len;
+    unsigned short dist; // 1 + distance from the home slot, 0 if the slot is empty
+    unsigned short access;
+    unsigned version; // from the segment's count, as in the chained engine's stripes
+    union
+    {
+        char inline_key[INLINE_KEY_SIZE];
+        char *key;
+    };
+    union
+    {
+        char inline_value[INLINE_VALUE_SIZE];
+        Value *value;
+    };
+} Slot;
+
+// the capacity travels with the slots so a reader never pairs an array with the wrong size
+typedef struct SlotArray
+{
+    unsigned capacity;
+    Slot slots[];
+} SlotArray;
+
+typedef struct Segment
+{
+    pthread_mutex_t lock;
+    unsigned seq; // odd while a writer is moving slots around
+    SlotArray *array;
+    unsigned count;
+    Wheel *wheel; // expiry timers of the segment's keys
+    unsigned version;
+} __attribute__((aligned(64))) Segment;
+
+Segment segments[NUM_STRIPES];
+
+SlotArray *slot_array_create(unsigned capacity)
+{
+    SlotArray *array = calloc(1, sizeof(SlotArray) + capacity * sizeof(Slot));
+
+    if (array != NULL)
+    {
+        array->capacity = capacity;
+    }
+    return array;
+}
+
+void open_init(void)
+{
+    for (int i = 0; i < NUM_STRIPES; i++)
+    {
+        pthread_mutex_init(&segments[i].lock, NULL);
+        segments[i].version = hash_mix(hash_seed, i);
+        segments[i].array = slot_array_create(OPEN_INITIAL_CAPACITY);
+        if (segments[i].array == NULL)
+        {
+            error("ERROR allocating hash table");
+        }
+    }
+}
+
+// the low hash bits pick the segment, the rest the home slot inside it
+Segment *open_segment(unsigned h)
+{
+    return &segments[h & (NUM_STRIPES - 1)];
+}
+
+// bracket every change to a segment's slots; caller holds the segment lock
+void segment_write_begin(Segment *seg)
+{
+    __atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void segment_write_end(Segment *seg)
+{
+    __atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline const char *slot_key_data(const Slot *slot)
+{
+    return slot->key_len <= INLINE_KEY_SIZE ? slot->inline_key : slot->key;
+}
+
+static inline Key slot_key(const Slot *slot)
+{
+    Key key = {slot_key_data(slot), slot->key_len, slot->hash};
+    return key;
+}
+
+// give an entry being built its key; returns -1 if it cannot be allocated
+int slot_set_key(Slot *slot, const Key *key)
+{
+    slot->hash = key->hash;
+    slot->key_len = key->len;
+    if (key->len <= INLINE_KEY_SIZE)
+    {
+        memcpy(slot->inline_key, key->data, key->len);
+        return 0;
+    }
+    slot->key = slab_alloc(key->len);
+    if (slot->key == NULL)
+    {
+        return -1;
+    }
+    memcpy(slot->key, key->data, key->len);
+    memory_charge(slab_capacity(key->len));
+    return 0;
+}
+
+void slot_retire_key(Slot *slot)
+{
+    if (slot->key_len > INLINE_KEY_SIZE)
+    {
+        memory_charge(-(long long)slab_capacity(slot->key_len));
+        epoch_retire(slot->key, slot->key_len);
+    }
+}
+
+void slot_retire_value(Slot *slot)
+{
+    if (slot->value_len > INLINE_VALUE_SIZE)
+    {
+        memory_charge(-(long long)value_memory(slot->value));
+        value_retire(slot->value);
+    }
+}
+
+// store a value in the slot, inline if it fits; out-of-line values are immutable, so a
+// new one is published and the old one retired. Returns -1 if it cannot be allocated
+int slot_set_value(Slot *slot, const char *value, int value_len)
+{
+    if (value_len <= INLINE_VALUE_SIZE)
+    {
+        slot_retire_value(slot);
+        memcpy(slot->inline_value, value, value_len);
+        slot->value_len = value_len;
+        return 0;
+    }
+
+    Value *copy = value_create(value, value_len);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+    slot_retire_value(slot);
+    slot->value = copy;
+    slot->value_len = value_len;
+    memory_charge(value_memory(copy));
+    return 0;
+}
+
+// returns the slot holding the key, or NULL; the probe is bounded by the capacity so a
+// lock-free reader looking at a half-updated segment still terminates. Such a reader passes
+// its segment and the sequence count it started from: a slot it sees may be torn between two
+// entries, so an out-of-line key pointer is only followed once the count shows no writer has
+// been at the segment since. Otherwise the probe gives up and the reader's own check retries
+Slot *open_find(SlotArray *array, const Key *key, const Segment *seg, unsigned seq)
+{
+    unsigned mask = array->capacity - 1;
+    unsigned i = (key->hash / NUM_STRIPES) & mask;
+
+    for (unsigned dist = 1; dist <= array->capacity; dist++, i = (i + 1) & mask)
+    {
+        Slot *slot = &array->slots[i];
+
+        // an empty slot, or one closer to its home than we are to ours, ends the probe
+        if (slot->dist < dist)
+        {
+            return NULL;
+        }
+        if (slot->hash != key->hash || slot->key_len != key->len)
+        {
+            continue;
+        }
+        const char *data = slot->inline_key;
+        if (key->len > INLINE_KEY_SIZE)
+        {
+            data = slot->key;
+            if (seg != NULL)
+            {
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) != seq)
+                {
+                    return NULL;
+                }
+            }
+        }
+        if (memcmp(data, key->data, key->len) == 0)
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// Robin Hood insertion: displace entries that are closer to their home slot than the one
+// being placed; the caller made sure there is a free slot
+void open_place(SlotArray *array, Slot entry)
+{
+    unsigned mask = array->capacity - 1;
+    unsigned i = (entry.hash / NUM_STRIPES) & mask;
+
+    for (entry.dist = 1;; entry.dist++, i = (i + 1) & mask)
+    {
+        Slot *slot = &array->slots[i];
+
+        if (slot->dist == 0)
+        {
+            *slot = entry;
+            return;
+        }
+        if (slot->dist < entry.dist)
+        {
+            Slot displaced = *slot;
+            *slot = entry;
+            entry = displaced;
+        }
+    }
+}
+
+// double the segment once it is 7/8 full; the new array is filled privately and swapped in
+// caller holds the segment lock
+int open_grow(Segment *seg)
+{
+    SlotArray *old = seg->array;
+
+    if ((seg->count + 1) * 8 <= old->capacity * 7)
+    {
+        return 0;
+    }
+
+    SlotArray *array = slot_array_create(old->capacity * 2);
+    if (array == NULL)
+    {
+        return -1;
+    }
+    for (unsigned i = 0; i < old->capacity; i++)
+    {
+        if (old->slots[i].dist != 0)
+        {
+            open_place(array, old->slots[i]);
+        }
+    }
+
+    __atomic_store_n(&seg->array, array, __ATOMIC_RELEASE);
+    epoch_retire(old, 0);
+    return 0;
+}
+
+// the helpers below expect the caller to hold the segment lock, log the change before it is
+// released and return a protocol status
+
+// add a key known to be absent
+int open_insert(Segment *seg, const Key *key, const char *value, int value_len, unsigned expires)
+{
+    if (open_grow(seg) < 0 || (expires != 0 && wheel_add(&seg->wheel, key, expires) < 0) || index_add(key) < 0)
+    {
+        return STATUS_OUT_OF_MEMORY;
+    }
+
+    Slot entry = {0};
+    entry.expires = expires;
+    entry.access = access_new();
+    entry.version = ++seg->version;
+    if (slot_set_key(&entry, key) < 0)
+    {
+        index_remove(key);
+        return STATUS_OUT_OF_MEMORY;
+    }
+    if (slot_set_value(&entry, value, value_len) < 0)
+    {
+        // never published, so it can go straight back
+        if (key->len > INLINE_KEY_SIZE)
+        {
+            memory_charge(-(long long)slab_capacity(key->len));
+            slab_free(entry.key, key->len);
+        }
+        index_remove(key);
+        return STATUS_OUT_OF_MEMORY;
+    }
+    segment_write_begin(seg);
+    open_place(seg->array, entry);
+    segment_write_end(seg);
+    seg->count++;
+    memory_charge(sizeof(Slot));
+    wal_append(OP_CREATE, key, value, value_len, expires);
+    return STATUS_OK;
+}
+
+// an update replaces the expiry time along with the value
+int open_assign(Segment *seg, Slot *slot, const Key *key, const char *value, int value_len, unsigned expires)
+{
+    int status = STATUS_OK;
+
+    if (expires != 0 && expires != slot->expires && wheel_add(&seg->wheel, key, expires) < 0)
+    {
+        return STATUS_OUT_OF_MEMORY;
+    }
+    segment_write_begin(seg);
+    if (slot_set_value(slot, value, value_len) < 0)
+    {
+        status = STATUS_OUT_OF_MEMORY;
+    }
+    else
+    {
+        slot->expires = expires;
+        slot->version = ++seg->version;
+    }
+    segment_write_end(seg);
+    if (status == STATUS_OK)
+    {
+        if (track_access)
+        {
+            access_touch(&slot->access);
+        }
+        wal_append(OP_UPDATE, key, value, value_len, expires);
+    }
+    return status;
+}
+
+// store what modify_apply made of the entry in slot
+int open_change(Segment *seg, Slot *slot, const Key *key, Modify *op)
+{
+    unsigned expires = keeps_expiry(op->opcode) ? slot->expires : op->expires;
+    unsigned len = slot->value_len;
+    Value *old = len > INLINE_VALUE_SIZE ? slot->value : NULL;
+    const char *data = old != NULL ? old->data : slot->inline_value;
+    unsigned new_len = modify_length(op, len);
+
+    if (expires != 0 && expires != slot->expires && wheel_add(&seg->wheel, key, expires) < 0)
+    {
+        return STATUS_OUT_OF_MEMORY;
+    }
+    if (new_len <= INLINE_VALUE_SIZE)
+    {
+        char value[INLINE_VALUE_SIZE];
+        modify_join(value, op, data, len);
+        segment_write_begin(seg);
+        slot_set_value(slot, value, new_len);
+    }
+    else
+    {
+        size_t old_memory = old != NULL ? value_memory(old) : 0;
+        Value *value = value_modify(old, data, len, op);
+        if (value == NULL)
+        {
+            return STATUS_OUT_OF_MEMORY;
+        }
+        segment_write_begin(seg);
+        if (value != old)
+        {
+            slot_retire_value(slot);
+            slot->value = value;
+            old_memory = 0;
+        }
+        slot->value_len = new_len;
+        memory_charge((long long)value_memory(value) - (long long)old_memory);
+    }
+    slot->expires = expires;
+    slot->version = op->version = ++seg->version;
+    segment_write_end(seg);
+
+    if (track_access)
+    {
+        access_touch(&slot->access);
+    }
+    modify_log(key, op, new_len <= INLINE_VALUE_SIZE ? slot->inline_value : slot->value->data, new_len, expires);
+    return STATUS_OK;
+}
+
+// backward shift deletion: pull the following entries one slot closer to home
+void open_remove(Segment *seg, Slot *slot)
+{
+    SlotArray *array = seg->array;
+    unsigned mask = array->capacity - 1;
+    unsigned i = slot - array->slots;
+
+    // logged first, while the key is still in the slot
+    Key key = slot_key(slot);
+    wal_append(OP_DELETE, &key, NULL, 0, 0);
+    index_remove(&key);
+    segment_write_begin(seg);
+    slot_retire_key(slot);
+    slot_retire_value(slot);
+    while (1)
+    {
+        Slot *next = &array->slots[(i + 1) & mask];
+        if (next->dist <= 1)
+        {
+            array->slots[i].dist = 0;
+            break;
+        }
+        array->slots[i] = *next;
+        array->slots[i].dist--;
+        i = (i + 1) & mask;
+    }
+    segment_write_end(seg);
+    seg->count--;
+    memory_charge(-(long long)sizeof(Slot));
+}
+
+// open_find for writers: an expired entry is removed on the way and reported missing
+Slot *open_find_live(Segment *seg, const Key *key)
+{
+    Slot *slot = open_find(seg->array, key, NULL, 0);
+
+    if (slot != NULL && entry_expired(slot->expires))
+    {
+        open_remove(seg, slot);
+        return NULL;
+    }
+    return slot;
+}
+
+int open_create(const Key *key, const char *value, int value_len, unsigned expires)
+{
+    Segment *seg = open_segment(key->hash);
+    int status = STATUS_KEY_EXISTS;
+
+    stats_lock(&seg->lock);
+    if (open_find_live(seg, key) == NULL)
+    {
+        status = open_insert(seg, key, value, value_len, expires);
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return status;
+}
+
+// lock-free: copy the slot out, then check that no writer touched the segment meanwhile
+int open_read(const Key *key, Buffer *out, unsigned *version)
+{
+    Segment *seg = open_segment(key->hash);
+    int status = STATUS_OK;
+    Slot found;
+    Slot *slot = NULL;
+    unsigned seq;
+    int hit;
+
+    epoch_enter();
+    do
+    {
+        seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            hit = 0;
+            continue;
+        }
+        slot = open_find(__atomic_load_n(&seg->array, __ATOMIC_ACQUIRE), key, seg, seq);
+        hit = slot != NULL;
+        if (hit)
+        {
+            found = *slot;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&seg->seq, __ATOMIC_RELAXED) != seq);
+
+    if (!hit || entry_expired(found.expires))
+    {
+        status = STATUS_NOT_FOUND;
+    }
+    else
+    {
+        if (version != NULL)
+        {
+            *version = found.version;
+        }
+        // an out-of-line value only ever grows past the length seen, and the epoch keeps it
+        // alive while we copy or pin it
+        int rc = found.value_len <= INLINE_VALUE_SIZE ? buffer_append(out, found.inline_value, found.value_len)
+                                                      : buffer_append_value(out, found.value);
+        if (rc < 0)
+        {
+            status = STATUS_OUT_OF_MEMORY;
+        }
+        // the array stays allocated for this epoch; if the entry moved since, some other
+        // entry gets the credit, which sampling tolerates
+        if (track_access)
+        {
+            access_touch(&slot->access);
+        }
+    }
+    epoch_exit();
+    return status;
+}
+
+int open_update(const Key *key, const char *value, int value_len, unsigned expires)
+{
+    Segment *seg = open_segment(key->hash);
+    int status = STATUS_OK;
+
+    stats_lock(&seg->lock);
+    Slot *slot = open_find_live(seg, key);
+    if (slot == NULL)
+    {
+        status = STATUS_NOT_FOUND;
+    }
+    else
+    {
+        status = open_assign(seg, slot, key, value, value_len, expires);
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return status;
+}
+
+int open_modify(const Key *key, Modify *op)
+{
+    Segment *seg = open_segment(key->hash);
+    int status;
+
+    stats_lock(&seg->lock);
+    Slot *slot = open_find_live(seg, key);
+    if (slot == NULL)
+    {
+        // only incr and decr create the key
+        status = modify_apply(op, 0, NULL, NULL, 0, 0);
+        if (status == STATUS_OK && (status = open_insert(seg, key, op->head, op->head_len, 0)) == STATUS_OK)
+        {
+            op->version = seg->version;
+        }
+    }
+    else
+    {
+        int out_of_line = slot->value_len > INLINE_VALUE_SIZE;
+        status = modify_apply(op, 1, out_of_line ? slot->value : NULL, out_of_line ? slot->value->data : slot->inline_value,
+                              slot->value_len, slot->version);
+        if (status == STATUS_OK)
+        {
+            status = open_change(seg, slot, key, op);
+        }
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return status;
+}
+
+int open_delete(const Key *key)
+{
+    Segment *seg = open_segment(key->hash);
+    int status = STATUS_OK;
+
+    stats_lock(&seg->lock);
+    Slot *slot = open_find_live(seg, key);
+    if (slot == NULL)
+    {
+        status = STATUS_NOT_FOUND;
+    }
+    else
+    {
+        open_remove(seg, slot);
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return status;
+}
+
+// apply mset or mdelete to items sorted by segment, locking each segment once
+void open_multi_write(BatchItem *items, int n, int opcode)
+{
+    for (int i = 0; i < n;)
+    {
+        Segment *seg = &segments[items[i].stripe];
+
+        stats_lock(&seg->lock);
+        for (int stripe = items[i].stripe; i < n && items[i].stripe == stripe; i++)
+        {
+            BatchItem *item = &items[i];
+            Slot *slot = open_find_live(seg, &item->key);
+
+            if (opcode == OP_MDELETE)
+            {
+                item->status = STATUS_NOT_FOUND;
+                if (slot != NULL)
+                {
+                    open_remove(seg, slot);
+                    item->status = STATUS_OK;
+                }
+            }
+            else if (slot != NULL)
+            {
+                item->status = open_assign(seg, slot, &item->key, item->value, item->value_len, item->expires);
+            }
+            else
+            {
+                item->status = open_insert(seg, &item->key, item->value, item->value_len, item->expires);
+            }
+        }
+        pthread_mutex_unlock(&seg->lock);
+    }
+}
+
+void open_walk(EntryVisitor visit, void *arg)
+{
+    for (int i = 0; i < NUM_STRIPES; i++)
+    {
+        SlotArray *array = segments[i].array;
+
+        for (unsigned j = 0; j < array->capacity; j++)
+        {
+            Slot *slot = &array->slots[j];
+            if (slot->dist != 0 && !entry_expired(slot->expires))
+            {
+                Key key = slot_key(slot);
+                visit(&key, slot->value_len <= INLINE_VALUE_SIZE ? slot->inline_value : slot->value->data, slot->value_len,
+                      slot->expires, arg);
+            }
+        }
+    }
+}
+
+// slot occupancy and probe lengths; like a read it takes no lock, so the figures of a
+// segment being written to may be slightly off
+int open_stats(Buffer *out)
+{
+    unsigned long long slots = 0, used = 0, longest = 0, key_bytes = 0, value_bytes = 0, inline_values = 0;
+
+    epoch_enter();
+    for (int i = 0; i < NUM_STRIPES; i++)
+    {
+        SlotArray *array = __atomic_load_n(&segments[i].array, __ATOMIC_ACQUIRE);
+
+        slots += array->capacity;
+        for (unsigned j = 0; j < array->capacity; j++)
+        {
+            Slot *slot = &array->slots[j];
+            if (slot->dist != 0)
+            {
+                used++;
+                key_bytes += slot->key_len;
+                value_bytes += slot->value_len;
+                inline_values += slot->value_len <= INLINE_VALUE_SIZE;
+                if (slot->dist > longest)
+                {
+                    longest = slot->dist;
+                }
+            }
+        }
+    }
+    epoch_exit();
+
+    return buffer_printf(out,
+                         "table_entries %llu\n"
+                         "table_slots %llu\n"
+                         "table_used_slots %llu\n"
+                         "table_longest_probe %llu\n"
+                         "table_inline_values %llu\n"
+                         "key_bytes %llu\n"
+                         "value_bytes %llu\n",
+                         used, slots, used, longest, inline_values, key_bytes, value_bytes);
+}
+
+// up to n entries from random slots; a slot is copied out under the seqlock like a read,
+// since a torn copy could pair a key length with the wrong key pointer
+int open_sample(Buffer *keys, Sample *samples, int n)
+{
+    int found = 0;
+
+    epoch_enter();
+    for (int probe = 0; probe < n * 16 && found < n; probe++)
+    {
+        unsigned r = eviction_next_random();
+        Segment *seg = &segments[r % NUM_STRIPES];
+        unsigned seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            continue;
+        }
+        SlotArray *array = __atomic_load_n(&seg->array, __ATOMIC_ACQUIRE);
+        Slot copy = array->slots[(r / NUM_STRIPES) & (array->capacity - 1)];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (copy.dist == 0 || __atomic_load_n(&seg->seq, __ATOMIC_RELAXED) != seq)
+        {
+            continue;
+        }
+        if (sample_add(keys, &samples[found], slot_key_data(&copy), copy.key_len, copy.access) < 0)
+        {
+            break;
+        }
+        found++;
+    }
+    epoch_exit();
+    return found;
+}
+
+// values that fit are copied inline, longer ones are used in place
+int open_restore(const Key *key, Value *value, unsigned expires)
+{
+    Segment *seg = open_segment(key->hash);
+    int status = STATUS_OK;
+    Slot entry = {0};
+
+    pthread_mutex_lock(&seg->lock);
+    if (open_grow(seg) < 0 || (expires != 0 && wheel_add(&seg->wheel, key, expires) < 0) || index_add(key) < 0)
+    {
+        status = STATUS_OUT_OF_MEMORY;
+    }
+    else if (slot_set_key(&entry, key) < 0)
+    {
+        index_remove(key);
+        status = STATUS_OUT_OF_MEMORY;
+    }
+    else
+    {
+        entry.expires = expires;
+        entry.access = access_new();
+        entry.version = ++seg->version;
+        entry.value_len = value->len;
+        if (value->len <= INLINE_VALUE_SIZE)
+        {
+            memcpy(entry.inline_value, value->data, value->len);
+        }
+        else
+        {
+            entry.value = value;
+            memory_charge(value_memory(value));
+        }
+        memory_charge(sizeof(Slot));
+        segment_write_begin(seg);
+        open_place(seg->array, entry);
+        segment_write_end(seg);
+        seg->count++;
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return status;
+}
+
+// open engine counterpart of chained_expire
+int open_expire(int stripe, unsigned now, int budget)
+{
+    Segment *seg = &segments[stripe];
+    int handled = 0;
+    int expired = 0;
+
+    if (wheel_idle(&seg->wheel, now))
+    {
+        return 0;
+    }
+    stats_lock(&seg->lock);
+    for (Timer *timer; handled < budget && (timer = wheel_pop(seg->wheel, now)) != NULL; handled++)
+    {
+        Key key = timer_key(timer);
+        Slot *slot = open_find(seg->array, &key, NULL, 0);
+        if (slot != NULL && slot->expires == timer->expires)
+        {
+            open_remove(seg, slot);
+            expired++;
+        }
+        wheel_free_timer(timer);
+    }
+    pthread_mutex_unlock(&seg->lock);
+
+    if (expired > 0)
+    {
+        stats_thread_record()->expired += expired;
+    }
+    return handled;
+}
+
+void open_lock_writes(void)
+{
+    for (int i = 0; i < NUM_STRIPES; i++)
+    {
+        pthread_mutex_lock(&segments[i].lock);
+    }
+}
+
+void open_unlock_writes(void)
+{
+    for (int i = 0; i < NUM_STRIPES; i++)
+    {
+        pthread_mutex_unlock(&segments[i].lock);
+    }
+}
+
+// storage engines sit behind the same create/read/update/delete interface, picked at startup
+typedef struct Engine
+{
+    const char *name;
+    void (*init)(void);
+    int (*create)(const Key *key, const char *value, int value_len, unsigned expires); // expires 0 = never
+    int (*read)(const Key *key, Buffer *out, unsigned *version); // appends the value to out
+    int (*update)(const Key *key, const char *value, int value_len, unsigned expires);
+    int (*delete)(const Key *key);
+    int (*modify)(const Key *key, Modify *op); // incr, append, cas and the like, atomically
+    void (*multi_write)(BatchItem *items, int n, int opcode); // items sorted by stripe
+    void (*walk)(EntryVisitor visit, void *arg);              // only with writes locked out
+    int (*restore)(const Key *key, Value *value, unsigned expires); // keeps the value, no copy
+    void (*lock_writes)(void);
+    void (*unlock_writes)(void);
+    int (*stats)(Buffer *out);                                // occupancy figures for the stats command
+    int (*sample)(Buffer *keys, Sample *samples, int n);      // random entries, for eviction
+    int (*expire)(int stripe, unsigned now, int budget);      // drop due entries, see chained_expire
+} Engine;
+
+Engine engines[] = {
+    {"chained", chained_init, chained_create, chained_read, chained_update, chained_delete, chained_modify, chained_multi_write,
+     chained_walk, chained_restore, chained_lock_writes, chained_unlock_writes,
+     chained_stats, chained_sample, chained_expire},
+    {"open", open_init, open_create, open_read, open_update, open_delete, open_modify, open_multi_write,
+     open_walk, open_restore, open_lock_writes, open_unlock_writes,
+     open_stats, open_sample, open_expire},
+};
+
+#define NUM_ENGINES (int)(sizeof(engines) / sizeof(engines[0]))
+
+Engine *engine = &engines[0];
+
+// called before a write that may add data: evict sampled entries until the table is back
+// under maxmemory; returns a protocol status
+int memory_reserve(void)
+{
+    if (maxmemory == 0 || __atomic_load_n(&memory_used, __ATOMIC_RELAXED) <= maxmemory)
+    {
+        return STATUS_OK;
+    }
+    if (eviction_policy == EVICT_NONE)
+    {
+        return STATUS_OUT_OF_MEMORY;
+    }
+
+    static __thread Buffer keys;
+    for (int round = 0; round < EVICTION_ROUNDS && __atomic_load_n(&memory_used, __ATOMIC_RELAXED) > maxmemory; round++)
+    {
+        Sample samples[EVICTION_SAMPLES];
+        keys.start = keys.len = 0;
+        int n = engine->sample(&keys, samples, EVICTION_SAMPLES);
+        if (n == 0)
+        {
+            break;
+        }
+
+        int victim = 0;
+        for (int i = 1; i < n; i++)
+        {
+            if (access_score(samples[i].access) > access_score(samples[victim].access))
+            {
+                victim = i;
+            }
+        }
+        // a concurrent writer may have deleted it already; then just sample again
+        Key key = key_make(keys.data + samples[victim].key_at, samples[victim].key_len);
+        if (engine->delete(&key) == STATUS_OK)
+        {
+            stats_thread_record()->evictions++;
+        }
+    }
+    return __atomic_load_n(&memory_used, __ATOMIC_RELAXED) <= maxmemory ? STATUS_OK : STATUS_OUT_OF_MEMORY;
+}
+
+// expiry thread: go round the stripes taking at most EXPIRY_SLICE due timers from each, and
+// only rest once a whole round found less than a full slice anywhere, so a backlog is
+// worked off in short lock holds interleaved with the requests
+void *expiry_thread(void *arg)
+{
+    (void)arg;
+    struct timespec pause = {0, EXPIRY_INTERVAL_MS * 1000000L};
+
+    while (1)
+    {
+        unsigned now = wall_seconds();
+        int backlog = 0;
+
+        for (int stripe = 0; stripe < NUM_STRIPES; stripe++)
+        {
+            if (engine->expire(stripe, now, EXPIRY_SLICE) == EXPIRY_SLICE)
+            {
+                backlog = 1;
+            }
+        }
+        if (!backlog)
+        {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// empty the log and start it at base
+void wal_reset(int fd, unsigned long long base)
+{
+    unsigned char header[WAL_HEADER_SIZE];
+
+    wal_pack_header(header, base);
+    struct iovec iov = {header, WAL_HEADER_SIZE};
+    if (ftruncate(fd, 0) < 0 || writev_full(fd, &iov, 1) < 0 || fdatasync(fd) < 0)
+    {
+        error("ERROR initializing the write-ahead log");
+    }
+}
+
+// rebuild the table from the write-ahead log records after position (the part a loaded
+// snapshot does not cover), cut off a torn tail and start logging
+void wal_open(const char *path, unsigned long long position)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        error("ERROR opening the write-ahead log");
+    }
+
+    crc32_init();
+    unsigned char header[WAL_HEADER_SIZE];
+    unsigned long long base = position;
+    long long size = lseek(fd, 0, SEEK_END);
+
+    if (size == 0)
+    {
+        wal_reset(fd, position);
+        if (sync_directory(path) < 0)
+        {
+            error("ERROR initializing the write-ahead log");
+        }
+        size = WAL_HEADER_SIZE;
+    }
+    else if (pread(fd, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE || memcmp(header, WAL_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "ERROR %s is not a write-ahead log\n", path);
+        exit(1);
+    }
+    else
+    {
+        base = (unsigned long long)proto_unpack_u32(header + 8) << 32 | proto_unpack_u32(header + 12);
+    }
+
+    if (position < base)
+    {
+        // the records in between are gone: starting anyway would silently lose writes
+        fprintf(stderr, "ERROR the write-ahead log %s starts at position %llu but the snapshot only covers %llu\n",
+                path, base, position);
+        exit(1);
+    }
+    long long good = WAL_HEADER_SIZE + (position > base ? position - base : 0);
+    if (good > size)
+    {
+        // the log lost records that the snapshot already has: start it over where it ends
+        wal_reset(fd, position);
+        base = position;
+        good = size = WAL_HEADER_SIZE;
+    }
+
+    FILE *log = fdopen(dup(fd), "r");
+    if (log == NULL || fseek(log, good, SEEK_SET) < 0)
+    {
+        error("ERROR opening the write-ahead log");
+    }
+    char *value = NULL;
+    uint32_t value_cap = 0;
+    long records = 0;
+
+    while (fread(header, 1, WAL_RECORD_HEADER_SIZE, log) == WAL_RECORD_HEADER_SIZE)
+    {
+        int opcode = header[4] & ~(WAL_FLAG_EXPIRES | WAL_FLAG_KEY);
+        uint32_t key_field = proto_unpack_u32(header + 5);
+        uint32_t value_len = proto_unpack_u32(header + 9);
+        int expiring = (header[4] & WAL_FLAG_EXPIRES) != 0;
+        // what precedes the value: the expiry time and the key bytes
+        uint32_t skip = (expiring ? 4 : 0) + (header[4] & WAL_FLAG_KEY ? key_field : 0);
+
+        if (value_len > PROTO_MAX_VALUE_SIZE + 4 + PROTO_MAX_KEY_SIZE ||
+            ((opcode < OP_CREATE || opcode > OP_DELETE) && opcode != OP_APPEND && opcode != OP_PREPEND) ||
+            ((header[4] & WAL_FLAG_KEY) && key_field > PROTO_MAX_KEY_SIZE) || value_len < skip)
+        {
+            break;
+        }
+        if (value_len > value_cap)
+        {
+            char *grown = realloc(value, value_len);
+            if (grown == NULL)
+            {
+                error("ERROR replaying the write-ahead log");
+            }
+            value = grown;
+            value_cap = value_len;
+        }
+        if (fread(value, 1, value_len, log) != value_len ||
+            crc32_update(crc32_update(0, header + 4, WAL_RECORD_HEADER_SIZE - 4), value, value_len) != proto_unpack_u32(header))
+        {
+            break;
+        }
+
+        // an entry that has expired since is dropped by the expiry thread once it starts
+        unsigned expires = expiring ? proto_unpack_u32((unsigned char *)value) : 0;
+        char key_text[INT_KEY_TEXT_SIZE];
+        Key key = header[4] & WAL_FLAG_KEY ? key_make(value + (expiring ? 4 : 0), key_field)
+                                           : int_key((int32_t)key_field, key_text);
+        if (opcode == OP_CREATE)
+        {
+            engine->create(&key, value + skip, value_len - skip, expires);
+        }
+        else if (opcode == OP_UPDATE)
+        {
+            engine->update(&key, value + skip, value_len - skip, expires);
+        }
+        else if (opcode == OP_DELETE)
+        {
+            engine->delete(&key);
+        }
+        else
+        {
+            Modify op = {.opcode = opcode, .arg = value + skip, .arg_len = value_len - skip};
+            engine->modify(&key, &op);
+        }
+        good += WAL_RECORD_HEADER_SIZE + value_len;
+        records++;
+    }
+    free(value);
+    fclose(log);
+
+    // a crash in the middle of a write leaves a partial record behind
+    if (size > good)
+    {
+        log_message(LOG_WARN, "Discarding %lld bytes of torn write-ahead log tail", size - good);
+        if (ftruncate(fd, good) < 0)
+        {
+            error("ERROR truncating the write-ahead log");
+        }
+    }
+    log_message(LOG_INFO, "Replayed %ld write-ahead log records from %s", records, path);
+
+    wal.fd = fd;
+    wal.path = path;
+    wal.base = base;
+    wal.appended = wal.durable = base + (good - WAL_HEADER_SIZE);
+    wal.enabled = 1;
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, wal_writer, NULL) != 0)
+    {
+        error("ERROR creating write-ahead log thread");
+    }
+    pthread_detach(writer);
+}
+
+// snapshots: a forked child writes the table as it was at fork time while the server keeps
+// running on its copy-on-write pages. The file is a header and one entry per key, in host
+// byte order so values can be used straight from the mapping:
+//
+// header: | magic (8) | version (4) | crc32 of the entries (4) | keys (8) | log position (8) | entries size (8) | reserved |
+// entry:  | key length (4) | expires (4) | key | padding | value length (4) | value | padding |
+//
+// Both paddings round up to a multiple of 8. The value length and bytes are laid out like a
+// Value, so at startup the table links to them in the mapping and only copies a value once
+// it is replaced. Older files still load: version 2 entries are
+// | key (4) | expires (4) | value length (4) | value | padding | with an integer key, and
+// version 1 entries lack the expiry time.
+#define SNAPSHOT_MAGIC "DECSSNAP"
+#define SNAPSHOT_VERSION 3
+
+typedef struct SnapshotHeader
+{
+    char magic[8];
+    unsigned version;
+    unsigned crc;
+    unsigned long long count;
+    unsigned long long wal_position; // the write-ahead log records before this are included
+    unsigned long long size;
+    char reserved[24];
+} SnapshotHeader;
+
+typedef struct SnapshotWriter
+{
+    FILE *file;
+    unsigned crc;
+    unsigned long long count;
+    unsigned long long size;
+} SnapshotWriter;
+
+const char *snapshot_path;
+int snapshot_running;
+unsigned long long snapshots_written;
+
+#define PAD8(n) ((8 - (n) % 8) % 8)
+
+void snapshot_write_bytes(SnapshotWriter *writer, const void *data, size_t len)
+{
+    fwrite(data, 1, len, writer->file);
+    writer->crc = crc32_update(writer->crc, data, len);
+    writer->size += len;
+}
+
+void snapshot_write_entry(const Key *key, const char *value, unsigned value_len, unsigned expires, void *arg)
+{
+    static const char padding[8];
+    SnapshotWriter *writer = arg;
+
+    snapshot_write_bytes(writer, &key->len, 4);
+    snapshot_write_bytes(writer, &expires, 4);
+    snapshot_write_bytes(writer, key->data, key->len);
+    snapshot_write_bytes(writer, padding, PAD8(key->len));
+    snapshot_write_bytes(writer, &value_len, 4);
+    snapshot_write_bytes(writer, value, value_len);
+    snapshot_write_bytes(writer, padding, PAD8(4 + value_len));
+    writer->count++;
+}
+
+// runs in the snapshot child: write a temporary file and rename it over the old snapshot.
+// Success means the rename itself is durable, since the log is compacted against it
+int snapshot_write(const char *path, unsigned long long wal_position)
+{
+    char tmp_path[4096];
+    SnapshotHeader header = {0};
+    SnapshotWriter writer = {0};
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    writer.file = fopen(tmp_path, "w");
+    if (writer.file == NULL)
+    {
+        return -1;
+    }
+    crc32_init();
+    fwrite(&header, sizeof(header), 1, writer.file);
+    engine->walk(snapshot_write_entry, &writer);
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.crc = writer.crc;
+    header.count = writer.count;
+    header.wal_position = wal_position;
+    header.size = writer.size;
+    if (fseek(writer.file, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, writer.file) != 1 ||
+        fflush(writer.file) != 0 || fsync(fileno(writer.file)) < 0)
+    {
+        fclose(writer.file);
+        unlink(tmp_path);
+        return -1;
+    }
+    fclose(writer.file);
+    if (rename(tmp_path, path) < 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    return sync_directory(path);
+}
+
+typedef struct SnapshotChild
+{
+    pid_t pid;
+    unsigned long long wal_position;
+} SnapshotChild;
+
+// reap the child; once its snapshot is on disk the log before it is no longer needed
+void *snapshot_wait(void *arg)
+{
+    SnapshotChild *child = arg;
+    int status;
+
+    while (waitpid(child->pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        log_message(LOG_INFO, "Snapshot written to %s", snapshot_path);
+        __atomic_add_fetch(&snapshots_written, 1, __ATOMIC_RELAXED);
+        if (wal.enabled)
+        {
+            wal_compact(child->wal_position);
+        }
+    }
+    else
+    {
+        log_message(LOG_ERROR, "writing snapshot %s failed", snapshot_path);
+    }
+
+    free(child);
+    __atomic_store_n(&snapshot_running, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// start a background snapshot; returns a protocol status
+int snapshot_start(void)
+{
+    if (snapshot_path == NULL)
+    {
+        return STATUS_BAD_REQUEST;
+    }
+    if (__atomic_exchange_n(&snapshot_running, 1, __ATOMIC_ACQ_REL))
+    {
+        return STATUS_BUSY;
+    }
+
+    SnapshotChild *child = malloc(sizeof(SnapshotChild));
+    if (child == NULL)
+    {
+        __atomic_store_n(&snapshot_running, 0, __ATOMIC_RELEASE);
+        return STATUS_OUT_OF_MEMORY;
+    }
+
+    // writers are held off only for the fork itself, so the child sees no half-done
+    // change and the log position matches its table exactly
+    engine->lock_writes();
+    child->wal_position = __atomic_load_n(&wal.appended, __ATOMIC_RELAXED);
+    child->pid = fork();
+    if (child->pid == 0)
+    {
+        _exit(snapshot_write(snapshot_path, child->wal_position) < 0 ? 1 : 0);
+    }
+    engine->unlock_writes();
+
+    pthread_t waiter;
+    if (child->pid < 0 || pthread_create(&waiter, NULL, snapshot_wait, child) != 0)
+    {
+        log_message(LOG_ERROR, "starting snapshot: %m");
+        if (child->pid > 0)
+        {
+            waitpid(child->pid, NULL, 0);
+        }
+        free(child);
+        __atomic_store_n(&snapshot_running, 0, __ATOMIC_RELEASE);
+        return STATUS_OUT_OF_MEMORY;
+    }
+    pthread_detach(waiter);
+    return STATUS_OK;
+}
+
+// map a snapshot and link its entries into the table; returns the log position it covers
+unsigned long long snapshot_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return 0;
+        }
+        error("ERROR opening snapshot");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        error("ERROR opening snapshot");
+    }
+    const char *map = NULL;
+    if ((size_t)st.st_size >= sizeof(SnapshotHeader))
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            error("ERROR mapping snapshot");
+        }
+    }
+    close(fd);
+
+    const SnapshotHeader *header = (const SnapshotHeader *)map;
+    crc32_init();
+    if (map == NULL || memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 ||
+        header->version < 1 || header->version > SNAPSHOT_VERSION ||
+        header->size != st.st_size - sizeof(SnapshotHeader) ||
+        crc32_update(0, map + sizeof(SnapshotHeader), header->size) != header->crc)
+    {
+        fprintf(stderr, "ERROR %s is not a valid snapshot\n", path);
+        exit(1);
+    }
+
+    snapshot_map = map;
+    snapshot_map_size = st.st_size;
+
+    const char *p = map + sizeof(SnapshotHeader);
+    const char *end = p + header->size;
+    for (unsigned long long i = 0; i < header->count; i++)
+    {
+        unsigned key_len = 0;
+        unsigned expires = 0;
+        char key_text[INT_KEY_TEXT_SIZE];
+        Key key;
+
+        // what comes before the Value: the key and, from version 2 on, the expiry time
+        size_t prefix = header->version == 1 ? 4 : 8;
+        if ((size_t)(end - p) >= 8)
+        {
+            memcpy(&key_len, p, 4);
+            memcpy(&expires, p + 4, 4);
+        }
+        if (header->version == 3)
+        {
+            prefix += key_len + PAD8(key_len);
+        }
+        if ((size_t)(end - p) < prefix + 4 || (header->version == 3 && key_len > PROTO_MAX_KEY_SIZE) ||
+            (size_t)(end - p) - prefix - 4 < ((Value *)(p + prefix))->len)
+        {
+            fprintf(stderr, "ERROR %s is not a valid snapshot\n", path);
+            exit(1);
+        }
+        Value *value = (Value *)(p + prefix);
+        if (header->version == 3)
+        {
+            key = key_make(p + 8, key_len);
+        }
+        else
+        {
+            key = int_key((int)key_len, key_text);
+            expires = header->version == 1 ? 0 : expires;
+        }
+        if (engine->restore(&key, value, expires) != STATUS_OK)
+        {
+            error("ERROR loading snapshot");
+        }
+        p += prefix + 4 + value->len + PAD8(4 + value->len);
+    }
+
+    log_message(LOG_INFO, "Loaded %llu keys from snapshot %s", header->count, path);
+    return header->wal_position;
+}
+
+int snapshot_stats(Buffer *out)
+{
+    if (snapshot_path == NULL)
+    {
+        return 0;
+    }
+    return buffer_printf(out, "snapshot_running %d\nsnapshots_written %llu\nsnapshot_mapped_bytes %zu\n",
+                         __atomic_load_n(&snapshot_running, __ATOMIC_RELAXED),
+                         __atomic_load_n(&snapshots_written, __ATOMIC_RELAXED), snapshot_map_size);
+}
+
+// one decoded request; value points into the connection's input buffer
+typedef struct Request
+{
+    int legacy;
+    int version; // of a binary frame; the response goes back in the same version
+    int opcode;
+    Key key;
+    int count; // keys of a multi-key request, which has no key of its own
+    const char *value;
+    int value_len;
+    unsigned ttl; // seconds, 0 if the key does not expire
+    char key_text[INT_KEY_TEXT_SIZE]; // the key of a version 1 or text request
+} Request;
+
+// the commands on a single key, with no effect on any other
+static inline int single_key_opcode(int opcode)
+{
+    return (opcode >= OP_CREATE && opcode <= OP_DELETE) || (opcode >= OP_INCR && opcode <= OP_GETSET);
+}
+
+typedef struct Connection
+{
+    int fd;
+    struct sockaddr_in addr;
+    Buffer in;
+    Buffer out;
+    uint32_t events; // epoll interest, in epoll mode
+    size_t need;     // size of the request being received, once its header is in
+    unsigned long long deadline; // for the rest of a request begun, 0 if none is; threaded and pool modes
+
+    // per-core mode: the requests out on other cores and the ones run here after them, to
+    // be answered in request order. The input is not read until all are back, so forwarded
+    // requests can point into it
+    struct Message *queue; // oldest first
+    struct Message *queue_tail;
+    struct Message *spare; // answered, kept for reuse with their reply buffers
+    int queued;
+    int dropped; // closed while requests were out; freed once they are back
+
+    struct UringIo *uring; // io_uring mode
+
+    // pool mode
+    int armed; // waiting in epoll, not queued or with a worker
+    struct Connection *prev_pooled;
+    struct Connection *next_pooled;
+} Connection;
+
+// decode the request at the front of buf, in either framing
+// returns its total size, 0 if more bytes are needed, -1 if it is malformed. When more are
+// needed for a binary frame whose header is in, *need says how many the frame takes
+long parse_request(const char *buf, size_t len, Request *req, size_t *need)
+{
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    // a binary frame starts with the version byte, anything else is a legacy text command
+    if ((unsigned char)buf[0] == PROTO_VERSION || (unsigned char)buf[0] == PROTO_VERSION_INT_KEYS)
+    {
+        RequestHeader header;
+
+        if (len < PROTO_REQUEST_HEADER_SIZE)
+        {
+            return 0;
+        }
+        proto_unpack_request((const unsigned char *)buf, &header);
+        int opcode = header.opcode & ~PROTO_FLAG_TTL;
+        int multi = opcode == OP_MGET || opcode == OP_MSET || opcode == OP_MDELETE;
+        uint32_t key_len = header.version == PROTO_VERSION && !multi ? header.key_len : 0;
+        if (header.value_len > PROTO_MAX_VALUE_SIZE || key_len > PROTO_MAX_KEY_SIZE)
+        {
+            return -1;
+        }
+        if (len < PROTO_REQUEST_HEADER_SIZE + key_len + header.value_len)
+        {
+            *need = PROTO_REQUEST_HEADER_SIZE + key_len + header.value_len;
+            return 0;
+        }
+
+        req->legacy = 0;
+        req->version = header.version;
+        req->opcode = header.opcode;
+        req->count = 0;
+        if (multi)
+        {
+            req->count = (int32_t)header.key_len;
+        }
+        else if (header.version == PROTO_VERSION)
+        {
+            req->key = key_make(buf + PROTO_REQUEST_HEADER_SIZE, key_len);
+        }
+        else
+        {
+            req->key = int_key((int32_t)header.key_len, req->key_text);
+        }
+        req->value = buf + PROTO_REQUEST_HEADER_SIZE + key_len;
+        req->value_len = header.value_len;
+        req->ttl = 0;
+        if (req->opcode & PROTO_FLAG_TTL)
+        {
+            // only the commands that set the expiry time can carry a ttl; anything else is
+            // answered as unknown
+            req->opcode &= ~PROTO_FLAG_TTL;
+            if ((req->opcode != OP_CREATE && req->opcode != OP_UPDATE && req->opcode != OP_CAS && req->opcode != OP_GETSET) ||
+                req->value_len < 4)
+            {
+                req->opcode = 0;
+            }
+            else
+            {
+                req->ttl = proto_unpack_u32((const unsigned char *)req->value);
+                req->value += 4;
+                req->value_len -= 4;
+            }
+        }
+        return PROTO_REQUEST_HEADER_SIZE + key_len + header.value_len;
+    }
+
+    // legacy text framing: every field is its own 255-byte message
+    char field[MAX_BUFFER_SIZE];
+
+    if (len < 2 * LEGACY_MESSAGE_SIZE)
+    {
+        return 0;
+    }
+    memcpy(field, buf, LEGACY_MESSAGE_SIZE);
+    field[LEGACY_MESSAGE_SIZE] = '\0';
+    char *command = strtok(field, " ");
+    req->opcode = command != NULL ? proto_opcode_from_name(command) : 0;
+    if (req->opcode == 0 || req->opcode > OP_DELETE)
+    {
+        return -1;
+    }
+
+    memcpy(field, buf + LEGACY_MESSAGE_SIZE, LEGACY_MESSAGE_SIZE);
+    field[LEGACY_MESSAGE_SIZE] = '\0';
+    req->legacy = 1;
+    req->key = int_key(atoi(field), req->key_text);
+    req->value = NULL;
+    req->value_len = 0;
+    req->ttl = 0;
+
+    if (req->opcode != OP_CREATE && req->opcode != OP_UPDATE)
+    {
+        return 2 * LEGACY_MESSAGE_SIZE;
+    }
+
+    if (len < 3 * LEGACY_MESSAGE_SIZE)
+    {
+        return 0;
+    }
+    memcpy(field, buf + 2 * LEGACY_MESSAGE_SIZE, LEGACY_MESSAGE_SIZE);
+    field[LEGACY_MESSAGE_SIZE] = '\0';
+    req->value_len = atoi(field);
+    if (req->value_len < 0 || req->value_len > PROTO_MAX_VALUE_SIZE)
+    {
+        return -1;
+    }
+    if (len < 3 * LEGACY_MESSAGE_SIZE + (size_t)req->value_len)
+    {
+        return 0;
+    }
+    req->value = buf + 3 * LEGACY_MESSAGE_SIZE;
+    return 3 * LEGACY_MESSAGE_SIZE + req->value_len;
+}
+
+int memory_stats(Buffer *out)
+{
+    if (maxmemory == 0)
+    {
+        return 0;
+    }
+    return buffer_printf(out, "maxmemory %llu\nused_memory %llu\neviction_policy %s\n", maxmemory,
+                         __atomic_load_n(&memory_used, __ATOMIC_RELAXED), eviction_names[eviction_policy]);
+}
+
+// server statistics as "name value" lines
+int append_stats(Buffer *out)
+{
+    if (buffer_printf(out, "engine %s\nlog_level %s\nlog_dropped %llu\n", engine->name, log_level_names[log_level],
+                      __atomic_load_n(&log_dropped, __ATOMIC_RELAXED)) < 0 ||
+        request_stats(out) < 0 || memory_stats(out) < 0 || pin_stats(out) < 0 || expiry_stats(out) < 0 ||
+        index_stats(out) < 0 || engine->stats(out) < 0 || slab_stats(out) < 0 || wal_stats(out) < 0 || snapshot_stats(out) < 0)
+    {
+        return STATUS_OUT_OF_MEMORY;
+    }
+    return STATUS_OK;
+}
+
+// with --stats-interval, the stats are logged every so many seconds, one line per figure
+int stats_interval;
+
+void *stats_dumper(void *arg)
+{
+    (void)arg;
+    Buffer out = {0};
+    struct timespec pause = {stats_interval, 0};
+
+    while (1)
+    {
+        nanosleep(&pause, NULL);
+        if (append_stats(&out) == STATUS_OK)
+        {
+            char *line = out.data + out.start;
+            char *end = out.data + out.len;
+            while (line < end)
+            {
+                char *eol = memchr(line, '\n', end - line);
+                int len = eol != NULL ? eol - line : end - line;
+                log_message(LOG_INFO, "stats %.*s", len, line);
+                line += len + 1;
+            }
+        }
+        out.start = out.len = 0;
+    }
+    return NULL;
+}
+
+int response_header_size(const Request *req)
+{
+    return req->legacy ? LEGACY_MESSAGE_SIZE : PROTO_RESPONSE_HEADER_SIZE;
+}
+
+// fill in a response header in the framing the request arrived in
+void write_response_header(char *dst, const Request *req, int status, int payload_len)
+{
+    if (!req->legacy)
+    {
+        proto_pack_response((unsigned char *)dst, req->version, status, payload_len);
+        return;
+    }
+
+    char message[MAX_BUFFER_SIZE];
+    bzero(message, MAX_BUFFER_SIZE);
+    if (req->opcode == OP_READ && status == STATUS_OK)
+    {
+        snprintf(message, MAX_BUFFER_SIZE, "OK %d", payload_len);
+    }
+    else if (req->opcode == OP_READ)
+    {
+        snprintf(message, MAX_BUFFER_SIZE, "ERROR %s", proto_status_message(req->opcode, status));
+    }
+    else
+    {
+        strcpy(message, proto_status_message(req->opcode, status));
+    }
+    memcpy(dst, message, LEGACY_MESSAGE_SIZE);
+}
+
+// append a response without payload
+int append_response(Buffer *out, const Request *req, int status)
+{
+    int header_size = response_header_size(req);
+
+    if (buffer_reserve(out, header_size) < 0)
+    {
+        return -1;
+    }
+    write_response_header(out->data + out->len, req, status, 0);
+    out->len += header_size;
+    return 0;
+}
+
+// items of one stripe stay in request order, so a key repeated in a batch is applied in sequence
+int compare_batch_items(const void *a, const void *b)
+{
+    const BatchItem *x = a, *y = b;
+
+    if (x->stripe != y->stripe)
+    {
+        return x->stripe - y->stripe;
+    }
+    return x->index - y->index;
+}
+
+// the next key of a multi-key request value, moving *p past it; text holds the key of a
+// version 1 request. Returns -1 if the key does not fit before end
+int decode_key(const Request *req, const unsigned char **p, const unsigned char *end, Key *key, char *text)
+{
+    if (end - *p < 4)
+    {
+        return -1;
+    }
+    uint32_t field = proto_unpack_u32(*p);
+    *p += 4;
+    if (req->version == PROTO_VERSION_INT_KEYS)
+    {
+        *key = int_key((int32_t)field, text);
+        return 0;
+    }
+    if (field > PROTO_MAX_KEY_SIZE || (uint32_t)(end - *p) < field)
+    {
+        return -1;
+    }
+    *key = key_make((const char *)*p, field);
+    *p += field;
+    return 0;
+}
+
+// mget: reads take no locks, so the keys are simply looked up in request order. A batch
+// whose values add up to more than a frame can carry is refused as a whole
+int execute_multi_get(const Request *req, Buffer *out)
+{
+    const unsigned char *p = (const unsigned char *)req->value;
+    const unsigned char *end = p + req->value_len;
+    int n = req->count;
+
+    // every key takes at least 4 bytes
+    if (n <= 0 || (size_t)n > (size_t)req->value_len / 4)
+    {
+        return append_response(out, req, STATUS_BAD_REQUEST);
+    }
+
+    if (buffer_reserve(out, PROTO_RESPONSE_HEADER_SIZE) < 0)
+    {
+        return -1;
+    }
+    size_t header_at = buffer_offset(out);
+    size_t values_at = out->value_bytes; // large values are queued by reference, not in the bytes
+    out->len += PROTO_RESPONSE_HEADER_SIZE;
+
+    for (int i = 0; i < n; i++)
+    {
+        Key key;
+        char key_text[INT_KEY_TEXT_SIZE];
+        if (decode_key(req, &p, end, &key, key_text) < 0 || (i == n - 1 && p != end))
+        {
+            // drop what was answered so far
+            buffer_truncate(out, header_at);
+            return append_response(out, req, STATUS_BAD_REQUEST);
+        }
+        if (buffer_reserve(out, 5) < 0)
+        {
+            return -1;
+        }
+        size_t item_at = buffer_offset(out);
+        size_t item_values_at = out->value_bytes;
+        out->len += 5;
+
+        int status = engine->read(&key, out, NULL);
+        stats_count_read(status);
+        if (status != STATUS_OK)
+        {
+            out->len = out->start + item_at + 5;
+        }
+        if (buffer_offset(out) - header_at - PROTO_RESPONSE_HEADER_SIZE + out->value_bytes - values_at > PROTO_MAX_VALUE_SIZE)
+        {
+            buffer_truncate(out, header_at);
+            return append_response(out, req, STATUS_BAD_REQUEST);
+        }
+        unsigned char *item = (unsigned char *)out->data + out->start + item_at;
+        item[0] = status;
+        proto_pack_u32(item + 1, buffer_offset(out) - item_at - 5 + out->value_bytes - item_values_at);
+    }
+
+    write_response_header(out->data + out->start + header_at, req, STATUS_OK,
+                          buffer_offset(out) - header_at - PROTO_RESPONSE_HEADER_SIZE + out->value_bytes - values_at);
+    return 0;
+}
+
+// split an mset or mdelete value into items; returns -1 if it does not hold exactly n keys.
+// texts has room for the keys of a version 1 request, which must not move with the items
+int decode_batch(const Request *req, BatchItem *items, int n, char *texts)
+{
+    const unsigned char *p = (const unsigned char *)req->value;
+    const unsigned char *end = p + req->value_len;
+
+    for (int i = 0; i < n; i++)
+    {
+        BatchItem *item = &items[i];
+
+        if (decode_key(req, &p, end, &item->key, texts + i * INT_KEY_TEXT_SIZE) < 0)
+        {
+            return -1;
+        }
+        item->stripe = item->key.hash & (NUM_STRIPES - 1);
+        item->index = i;
+        item->value = NULL;
+        item->value_len = 0;
+        item->expires = 0;
+
+        if (req->opcode == OP_MSET)
+        {
+            if (end - p < 4)
+            {
+                return -1;
+            }
+            uint32_t len = proto_unpack_u32(p);
+            p += 4;
+            if ((uint32_t)(end - p) < len)
+            {
+                return -1;
+            }
+            item->value = (const char *)p;
+            item->value_len = len;
+            p += len;
+        }
+    }
+    return p == end ? 0 : -1;
+}
+
+// mset / mdelete: sort the keys by stripe so the engine takes each lock once, then answer
+// with one status byte per key in request order
+int execute_multi_write(const Request *req, Buffer *out)
+{
+    int n = req->count;
+
+    // every key takes at least 4 bytes, which also bounds the allocation below
+    if (n <= 0 || (size_t)n > (size_t)req->value_len / 4)
+    {
+        return append_response(out, req, STATUS_BAD_REQUEST);
+    }
+
+    size_t text_size = req->version == PROTO_VERSION_INT_KEYS ? INT_KEY_TEXT_SIZE : 0;
+    BatchItem *items = malloc(n * (sizeof(BatchItem) + text_size));
+    if (items == NULL)
+    {
+        return append_response(out, req, STATUS_OUT_OF_MEMORY);
+    }
+    if (decode_batch(req, items, n, (char *)(items + n)) < 0)
+    {
+        free(items);
+        return append_response(out, req, STATUS_BAD_REQUEST);
+    }
+
+    qsort(items, n, sizeof(BatchItem), compare_batch_items);
+    engine->multi_write(items, n, req->opcode);
+
+    if (buffer_reserve(out, PROTO_RESPONSE_HEADER_SIZE + n) < 0)
+    {
+        free(items);
+        return -1;
+    }
+    unsigned char *dst = (unsigned char *)out->data + out->len;
+    write_response_header((char *)dst, req, STATUS_OK, n);
+    for (int i = 0; i < n; i++)
+    {
+        dst[PROTO_RESPONSE_HEADER_SIZE + items[i].index] = items[i].status;
+    }
+    out->len += PROTO_RESPONSE_HEADER_SIZE + n;
+
+    free(items);
+    return 0;
+}
+
+// scan: the keys come from the ordered index in one pass inside an epoch section, and each is
+// then read like a get, so a key deleted in between is left out. Neither the index nor the
+// table is locked, so a scan holds up no writer however long it runs. The entries stop early
+// where the next one would not fit in a frame; one too large to fit even alone is left out
+int execute_scan(const Request *req, Buffer *out)
+{
+    static __thread Buffer keys;
+
+    if (!ordered_index || req->value_len < 4)
+    {
+        return append_response(out, req, STATUS_BAD_REQUEST);
+    }
+    unsigned limit = proto_unpack_u32((const unsigned char *)req->value);
+    const char *end = req->value + 4;
+    unsigned end_len = req->value_len - 4;
+    if (limit == 0 || limit > PROTO_SCAN_MAX_LIMIT)
+    {
+        limit = limit == 0 ? PROTO_SCAN_DEFAULT_LIMIT : PROTO_SCAN_MAX_LIMIT;
+    }
+
+    // up to limit keys and the one after them, each as | key length (4) | key |
+    unsigned n = 0;
+    keys.start = keys.len = 0;
+    epoch_enter();
+    for (const IndexNode *node = index_seek(req->key.data, req->key.len); node != NULL && n <= limit; node = index_next(node))
+    {
+        if (end_len > 0 && key_compare(index_key(node), node->key_len, end, end_len) >= 0)
+        {
+            break;
+        }
+        if (buffer_reserve(&keys, 4 + node->key_len) < 0)
+        {
+            epoch_exit();
+            return append_response(out, req, STATUS_OUT_OF_MEMORY);
+        }
+        proto_pack_u32((unsigned char *)keys.data + keys.len, node->key_len);
+        memcpy(keys.data + keys.len + 4, index_key(node), node->key_len);
+        keys.len += 4 + node->key_len;
+        n++;
+    }
+    epoch_exit();
+
+    // more and an empty next key for now: where the scan carries on is only known at the end
+    if (buffer_reserve(out, PROTO_RESPONSE_HEADER_SIZE + 5) < 0)
+    {
+        return -1;
+    }
+    size_t header_at = buffer_offset(out);
+    size_t values_at = out->value_bytes;
+    size_t next_at = header_at + PROTO_RESPONSE_HEADER_SIZE + 1;
+    memset(out->data + out->len, 0, PROTO_RESPONSE_HEADER_SIZE + 5);
+    out->len += PROTO_RESPONSE_HEADER_SIZE + 5;
+
+    // resume is the key after the last entry, which the payload always keeps room for
+    const char *p = keys.data;
+    const char *resume = keys.data;
+    unsigned entries = 0;
+    int more = n > limit;
+    for (unsigned i = 0; i < n && i < limit; i++)
+    {
+        unsigned key_len = proto_unpack_u32((const unsigned char *)p);
+        Key key = key_make(p + 4, key_len);
+        size_t item_at = buffer_offset(out);
+        size_t item_values_at = out->value_bytes;
+        if (buffer_append(out, p, 4 + key_len) < 0 || buffer_reserve(out, 4) < 0)
+        {
+            return -1;
+        }
+        p += 4 + key_len;
+        size_t value_at = buffer_offset(out);
+        out->len += 4;
+
+        int found = engine->read(&key, out, NULL) == STATUS_OK;
+        if (found)
+        {
+            proto_pack_u32((unsigned char *)out->data + out->start + value_at, buffer_offset(out) - value_at - 4 + out->value_bytes - item_values_at);
+        }
+        else
+        {
+            buffer_truncate(out, item_at);
+        }
+
+        unsigned after_len = i + 1 < n ? proto_unpack_u32((const unsigned char *)p) : 0;
+        if (buffer_offset(out) - header_at - PROTO_RESPONSE_HEADER_SIZE + out->value_bytes - values_at + after_len > PROTO_MAX_VALUE_SIZE)
+        {
+            buffer_truncate(out, item_at);
+            if (entries > 0)
+            {
+                more = 1;
+                break;
+            }
+        }
+        else if (found)
+        {
+            entries++;
+        }
+        resume = p;
+    }
+
+    if (more)
+    {
+        out->data[out->start + next_at - 1] = 1;
+        if (buffer_splice(out, next_at, 4, resume, 4 + proto_unpack_u32((const unsigned char *)resume)) < 0)
+        {
+            return -1;
+        }
+    }
+    write_response_header(out->data + out->start + header_at, req, STATUS_OK,
+                          buffer_offset(out) - header_at - PROTO_RESPONSE_HEADER_SIZE + out->value_bytes - values_at);
+    return 0;
+}
+
+// incr, decr, append, prepend, cas and getset: the engine applies them under the key's lock
+// and their payload goes after a header left room for, as for a read. The epoch keeps the
+// old value getset answers with alive after the engine has replaced it
+int execute_modify(const Request *req, Buffer *out, unsigned expires)
+{
+    int header_size = response_header_size(req);
+    if (buffer_reserve(out, header_size) < 0)
+    {
+        return -1;
+    }
+    size_t header_at = buffer_offset(out);
+    size_t values_at = out->value_bytes;
+    out->len += header_size;
+
+    Modify op = {.opcode = req->opcode, .arg = req->value, .arg_len = req->value_len, .expires = expires};
+    int status = STATUS_BAD_REQUEST;
+    if (req->opcode == OP_CAS && req->value_len >= 4)
+    {
+        op.version = proto_unpack_u32((const unsigned char *)req->value);
+        op.arg += 4;
+        op.arg_len -= 4;
+    }
+    int rc = 0;
+    epoch_enter();
+    if (req->opcode != OP_CAS || req->value_len >= 4)
+    {
+        status = engine->modify(&req->key, &op);
+    }
+    if (status == STATUS_OK && (req->opcode == OP_INCR || req->opcode == OP_DECR))
+    {
+        rc = buffer_append(out, op.bytes, op.head_len);
+    }
+    else if ((status == STATUS_OK || status == STATUS_VERSION_MISMATCH) && req->opcode == OP_CAS)
+    {
+        unsigned char version[4];
+        proto_pack_u32(version, op.version);
+        rc = buffer_append(out, version, 4);
+    }
+    else if (status == STATUS_OK && req->opcode == OP_GETSET)
+    {
+        rc = op.old != NULL ? buffer_append_value(out, op.old) : buffer_append(out, op.bytes, op.old_len);
+    }
+    epoch_exit();
+
+    // the command has taken effect, so a response that does not fit is the connection's loss
+    if (rc < 0)
+    {
+        return -1;
+    }
+    write_response_header(out->data + out->start + header_at, req, status,
+                          buffer_offset(out) - header_at - header_size + out->value_bytes - values_at);
+    return 0;
+}
+
+// copy at most LOG_VALUE_PREVIEW bytes of data with anything unprintable replaced; returns
+// the length of the preview
+int log_preview(char *preview, const char *data, unsigned len)
+{
+    int n = len < LOG_VALUE_PREVIEW ? len : LOG_VALUE_PREVIEW;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned char c = data[i];
+        preview[i] = c >= 0x20 && c < 0x7f ? c : '.';
+    }
+    return n;
+}
+
+// one debug line per request, for one in log_sample of them; keys and values are cut to a
+// short, printable preview so a large or binary one costs no more than a small one
+void log_command(const Request *req)
+{
+    static __thread unsigned long seen;
+
+    if (log_sample > 1 && seen++ % log_sample != 0)
+    {
+        return;
+    }
+
+    const char *name = proto_opcode_name(req->opcode);
+    char key[LOG_VALUE_PREVIEW];
+    int key_len = 0;
+    const char *more = "";
+    if (single_key_opcode(req->opcode))
+    {
+        key_len = log_preview(key, req->key.data, req->key.len);
+        more = req->key.len > (unsigned)key_len ? "..." : "";
+    }
+    if (single_key_opcode(req->opcode) && req->opcode != OP_READ && req->opcode != OP_DELETE && req->opcode != OP_GETS)
+    {
+        char preview[LOG_VALUE_PREVIEW];
+        int len = log_preview(preview, req->value, req->value_len);
+        if ((int)req->value_len > len)
+        {
+            log_write(LOG_DEBUG, "Command : %s (Key: %.*s%s, Value: %.*s... %u bytes)", name, key_len, key, more, len, preview, req->value_len);
+        }
+        else
+        {
+            log_write(LOG_DEBUG, "Command : %s (Key: %.*s%s, Value: %.*s)", name, key_len, key, more, len, preview);
+        }
+    }
+    else if (single_key_opcode(req->opcode))
+    {
+        log_write(LOG_DEBUG, "Command : %s (Key: %.*s%s)", name, key_len, key, more);
+    }
+    else if (req->opcode == OP_MGET || req->opcode == OP_MSET || req->opcode == OP_MDELETE)
+    {
+        log_write(LOG_DEBUG, "Command : %s (Keys: %d)", name, req->count);
+    }
+    else
+    {
+        log_write(LOG_DEBUG, "Command : %s", name);
+    }
+}
+
+// run one request against the table and append its response to out
+int execute_request(const Request *req, Buffer *out)
+{
+    int status;
+
+    if (log_enabled(LOG_DEBUG))
+    {
+        log_command(req);
+    }
+    stats_thread_record()->commands[req->opcode < NUM_OPCODES ? req->opcode : 0]++;
+    unsigned long long start = now_ns();
+
+    // writes that may grow the table make room first
+    if ((req->opcode == OP_CREATE || req->opcode == OP_UPDATE || req->opcode == OP_MSET || modify_opcode(req->opcode)) &&
+        (status = memory_reserve()) != STATUS_OK)
+    {
+        return append_response(out, req, status);
+    }
+
+    // a ttl far enough out to wrap the clock means never
+    unsigned expires = req->ttl != 0 ? wall_seconds() + req->ttl : 0;
+    if (expires != 0 && expires < req->ttl)
+    {
+        expires = 0;
+    }
+
+    if (req->opcode == OP_CREATE)
+    {
+        status = engine->create(&req->key, req->value, req->value_len, expires);
+        stats_record(LATENCY_TABLE, now_ns() - start);
+    }
+    else if (req->opcode == OP_READ || req->opcode == OP_GETS || req->opcode == OP_STATS)
+    {
+        // leave room for the header and let the payload be copied in right after it
+        int header_size = response_header_size(req);
+        if (buffer_reserve(out, header_size) < 0)
+        {
+            return -1;
+        }
+        size_t header_at = buffer_offset(out);
+        size_t values_at = out->value_bytes;
+        out->len += header_size;
+
+        if (req->opcode == OP_READ || req->opcode == OP_GETS)
+        {
+            // gets puts the version in front of the value
+            unsigned version = 0;
+            size_t version_at = buffer_offset(out);
+            if (req->opcode == OP_GETS && buffer_append(out, "\0\0\0\0", 4) < 0)
+            {
+                return -1;
+            }
+            status = engine->read(&req->key, out, req->opcode == OP_GETS ? &version : NULL);
+            stats_record(LATENCY_TABLE, now_ns() - start);
+            stats_count_read(status);
+            if (req->opcode == OP_GETS)
+            {
+                proto_pack_u32((unsigned char *)out->data + out->start + version_at, version);
+            }
+        }
+        else
+        {
+            status = append_stats(out);
+        }
+        if (status != STATUS_OK)
+        {
+            out->len = out->start + header_at + header_size;
+        }
+        write_response_header(out->data + out->start + header_at, req, status,
+                              buffer_offset(out) - header_at - header_size + out->value_bytes - values_at);
+        return 0;
+    }
+    else if (req->opcode == OP_MGET || req->opcode == OP_MSET || req->opcode == OP_MDELETE)
+    {
+        int rc = req->opcode == OP_MGET ? execute_multi_get(req, out) : execute_multi_write(req, out);
+        stats_record(LATENCY_TABLE, now_ns() - start);
+        return rc;
+    }
+    else if (req->opcode == OP_SCAN)
+    {
+        int rc = execute_scan(req, out);
+        stats_record(LATENCY_TABLE, now_ns() - start);
+        return rc;
+    }
+    else if (req->opcode == OP_SNAPSHOT)
+    {
+        status = snapshot_start();
+    }
+    else if (req->opcode == OP_UPDATE)
+    {
+        status = engine->update(&req->key, req->value, req->value_len, expires);
+        stats_record(LATENCY_TABLE, now_ns() - start);
+    }
+    else if (req->opcode == OP_DELETE)
+    {
+        status = engine->delete(&req->key);
+        stats_record(LATENCY_TABLE, now_ns() - start);
+    }
+    else if (modify_opcode(req->opcode))
+    {
+        int rc = execute_modify(req, out, expires);
+        stats_record(LATENCY_TABLE, now_ns() - start);
+        return rc;
+    }
+    else
+    {
+        status = STATUS_BAD_REQUEST;
+    }
+
+    return append_response(out, req, status);
+}
+
+// per-core mode: one pinned event loop per core, each with its own SO_REUSEPORT listener.
+// Every core owns the keys of a share of the lock stripes and runs their single-key
+// requests, so those stripe locks and buckets mostly stay in its cache. They are not the
+// owner's alone: multi-key requests, scans and stats run on the core that received them,
+// eviction deletes from whichever core ran short of memory, and the expiry thread sweeps
+// every stripe, all under the stripe locks as in the other modes. A single-key request
+// arriving on another core is handed to the owner as a message, and the message comes back
+// with the response. Message lists are lock-free stacks taken whole by their core, and a
+// push onto an empty one wakes the core through its eventfd.
+typedef struct Core
+{
+    int index;
+    int listenfd;
+    int wakefd;
+    struct Message *requests; // forwarded to this core, newest first
+    struct Message *replies;  // answered for this core's connections, newest first
+} __attribute__((aligned(64))) Core;
+
+typedef struct Message
+{
+    struct Message *next; // in the connection's queue, oldest first
+    struct Message *next_post;
+    Connection *conn;
+    Core *home; // the core serving the connection
+    Request req;
+    Buffer reply;
+    int rc;
+    int done;
+} Message;
+
+Core *cores;
+int num_cores;
+__thread Core *current_core; // the core the thread serves, NULL outside per-core mode
+
+static inline Core *key_core(const Key *key)
+{
+    return &cores[(key->hash & (NUM_STRIPES - 1)) % num_cores];
+}
+
+void core_post(Message **list, Core *core, Message *msg)
+{
+    Message *head = __atomic_load_n(list, __ATOMIC_RELAXED);
+
+    do
+    {
+        msg->next_post = head;
+    } while (!__atomic_compare_exchange_n(list, &head, msg, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // the core empties a list before it sleeps, so only the first push needs to wake it
+    if (head == NULL)
+    {
+        uint64_t one = 1;
+        if (write(core->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            log_message(LOG_ERROR, "waking core %d: %m", core->index);
+        }
+    }
+}
+
+// everything posted to a list, oldest first
+Message *core_take(Message **list)
+{
+    Message *msg = __atomic_exchange_n(list, NULL, __ATOMIC_ACQUIRE);
+    Message *oldest = NULL;
+
+    while (msg != NULL)
+    {
+        Message *next = msg->next_post;
+        msg->next_post = oldest;
+        oldest = msg;
+        msg = next;
+    }
+    return oldest;
+}
+
+// a message at the end of the connection's queue, reusing an answered one if there is one
+Message *queue_message(Connection *conn, const Request *req)
+{
+    Message *msg = conn->spare;
+    if (msg != NULL)
+    {
+        conn->spare = msg->next;
+    }
+    else if ((msg = calloc(1, sizeof(Message))) == NULL)
+    {
+        return NULL;
+    }
+    msg->next = NULL;
+    msg->conn = conn;
+    msg->home = current_core;
+    msg->req = *req;
+    if (req->key.data == req->key_text)
+    {
+        msg->req.key.data = msg->req.key_text;
+    }
+    msg->done = 0;
+
+    if (conn->queue == NULL)
+    {
+        conn->queue = msg;
+    }
+    else
+    {
+        conn->queue_tail->next = msg;
+    }
+    conn->queue_tail = msg;
+    conn->queued++;
+    return msg;
+}
+
+// move the answers at the front of the queue to the output, in request order
+int drain_queue(Connection *conn)
+{
+    Message *msg;
+
+    while ((msg = conn->queue) != NULL && msg->done)
+    {
+        // a dropped connection only waits for its messages to come back
+        if (!conn->dropped &&
+            (msg->rc < 0 || buffer_append(&conn->out, msg->reply.data + msg->reply.start, msg->reply.len - msg->reply.start) < 0))
+        {
+            return -1;
+        }
+        conn->queue = msg->next;
+        conn->queued--;
+        msg->reply.start = msg->reply.len = 0;
+        if (msg->reply.cap > BUFFER_KEEP_SIZE)
+        {
+            buffer_free(&msg->reply);
+        }
+        msg->next = conn->spare;
+        conn->spare = msg;
+    }
+    return 0;
+}
+
+// in per-core mode, run a request or queue it behind the ones still out on other cores:
+// a single-key request of another core's key goes to that core, one of ours runs at once
+// (it cannot touch a key of the requests out), and any other waits until the queue drains
+// returns 1 if it was handled, 0 if it is to run now, -1 when out of memory
+int dispatch_request(Connection *conn, const Request *req)
+{
+    // process_input holds back the others while anything is queued
+    if (!single_key_opcode(req->opcode))
+    {
+        return 0;
+    }
+    Core *owner = key_core(&req->key);
+    if (owner == current_core && conn->queued == 0)
+    {
+        return 0;
+    }
+    Message *msg = queue_message(conn, req);
+    if (msg == NULL)
+    {
+        return -1;
+    }
+    if (owner == current_core)
+    {
+        msg->rc = execute_request(&msg->req, &msg->reply);
+        msg->done = 1;
+        return 1;
+    }
+    stats_thread_record()->forwarded++;
+    core_post(&owner->requests, owner, msg);
+    return 1;
+}
+
+// stop reading from a connection while this much output is still unsent
+#define OUTPUT_HIGH_WATER (1024 * 1024)
+
+// execute every complete request buffered on the connection
+// returns 0, or -1 if the connection should be dropped
+int process_input(Connection *conn)
+{
+    Request req;
+    long size;
+    unsigned long long start = now_ns();
+
+    conn->need = 0;
+    while ((size = parse_request(conn->in.data + conn->in.start, conn->in.len - conn->in.start, &req, &conn->need)) > 0)
+    {
+        // io_uring receives ahead of time, so the rest waits for the responses to drain
+        if (conn->uring != NULL && buffer_pending(&conn->out) >= OUTPUT_HIGH_WATER)
+        {
+            break;
+        }
+        stats_record(LATENCY_PARSE, now_ns() - start);
+        int handled = 0;
+        if (current_core != NULL)
+        {
+            // a request that has to run after the queued ones stays in the input until they are back
+            if (conn->queued > 0 && !single_key_opcode(req.opcode))
+            {
+                break;
+            }
+            handled = dispatch_request(conn, &req);
+        }
+        if (handled < 0 || (!handled && execute_request(&req, &conn->out) < 0))
+        {
+            return -1;
+        }
+        conn->in.start += size;
+        conn->deadline = 0;
+        start = now_ns();
+    }
+    if (size < 0)
+    {
+        log_message(LOG_ERROR, "malformed request from %s:%d", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+        return -1;
+    }
+    // a connection that received a huge request should not keep its buffer
+    if (conn->queued == 0 && conn->in.start == conn->in.len && conn->in.cap > BUFFER_KEEP_SIZE)
+    {
+        buffer_free(&conn->in);
+    }
+
+    // the responses only go out once the writes they acknowledge are durable
+    wal_wait();
+    return 0;
+}
+
+
+// read whatever the socket has into the input buffer; flags are passed to recv (MSG_DONTWAIT polls)
+// returns bytes read, 0 on EOF, -1 on error (errno EAGAIN when a non-blocking socket is drained)
+ssize_t fill_input(Connection *conn, int flags)
+{
+    // make room for all of a large request at once, so it comes in with as few reads as
+    // the socket allows instead of one per chunk
+    size_t want = READ_CHUNK_SIZE;
+    if (conn->need > buffer_offset(&conn->in) + want)
+    {
+        want = conn->need - buffer_offset(&conn->in);
+    }
+    if (buffer_reserve(&conn->in, want) < 0)
+    {
+        return -1;
+    }
+
+    ssize_t n;
+    do
+    {
+        n = recv(conn->fd, conn->in.data + conn->in.len, conn->in.cap - conn->in.len, flags);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+    {
+        conn->in.len += n;
+    }
+    return n;
+}
+
+// write out as much of the output buffer as the socket takes, large values straight from
+// the table alongside the buffered bytes
+// returns 0 once it is empty, 1 if the socket would block, -1 on error
+int flush_output(Connection *conn)
+{
+    if (conn->out.start == conn->out.len && conn->out.value_count == 0)
+    {
+        conn->out.start = conn->out.len = 0;
+        return 0;
+    }
+
+    unsigned long long start = now_ns();
+    while (conn->out.start < conn->out.len || conn->out.value_count > 0)
+    {
+        struct iovec iov[FLUSH_IOV];
+        ssize_t n = writev(conn->fd, iov, buffer_iov(&conn->out, iov, FLUSH_IOV));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                stats_record(LATENCY_WRITE, now_ns() - start);
+                return 1;
+            }
+            return -1;
+        }
+        buffer_consume(&conn->out, n);
+    }
+    conn->out.start = conn->out.len = 0;
+    if (conn->out.cap > BUFFER_KEEP_SIZE)
+    {
+        buffer_free(&conn->out);
+    }
+    stats_record(LATENCY_WRITE, now_ns() - start);
+    return 0;
+}
+
+Connection *new_connection(int fd)
+{
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->out.zero_copy = 1;
+    socklen_t addrlen = sizeof(conn->addr);
+    getpeername(fd, (struct sockaddr *)&conn->addr, &addrlen);
+    stats_thread_record()->connections_opened++;
+
+    log_message(LOG_INFO, "Client %s:%d connected", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+    return conn;
+}
+
+void close_connection(Connection *conn)
+{
+    log_message(LOG_INFO, "Client %s:%d disconnected", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+    stats_thread_record()->connections_closed++;
+    close(conn->fd);
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    while (conn->spare != NULL)
+    {
+        Message *msg = conn->spare;
+        conn->spare = msg->next;
+        buffer_free(&msg->reply);
+        free(msg);
+    }
+    free(conn);
+}
+
+// a connection may take this many ms to send a request from its first byte, or stall this
+// long on a response, before it is dropped, in the threaded and pool modes; 0 waits forever
+int read_timeout = 30000;
+
+// start the clock once a request has begun to arrive, and leave it running however its
+// bytes trickle in; process_input stops it when the request is complete
+void track_deadline(Connection *conn)
+{
+    if (conn->in.start == conn->in.len || read_timeout == 0)
+    {
+        conn->deadline = 0;
+    }
+    else if (conn->deadline == 0)
+    {
+        conn->deadline = now_ns() + read_timeout * 1000000ULL;
+    }
+}
+
+// threaded mode: one blocking thread per connection
+void *client_handler(void *arg)
+{
+    int newsockfd = *((int *)arg);
+    free(arg);
+    request_thread = 1;
+
+    Connection *conn = new_connection(newsockfd);
+    if (conn == NULL)
+    {
+        close(newsockfd);
+        pthread_exit(NULL);
+    }
+
+    // a client that stops reading its responses gives its thread back too
+    if (read_timeout > 0)
+    {
+        struct timeval timeout = {read_timeout / 1000, read_timeout % 1000 * 1000};
+        setsockopt(newsockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    int done = 0;
+    while (!done)
+    {
+        // an idle connection may wait as long as it likes, one partway through a request
+        // only until its deadline
+        if (conn->deadline != 0)
+        {
+            unsigned long long now = now_ns();
+            struct pollfd pfd = {newsockfd, POLLIN, 0};
+            int rc = now >= conn->deadline ? 0 : poll(&pfd, 1, (conn->deadline - now + 999999) / 1000000);
+            if (rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (rc == 0)
+            {
+                log_message(LOG_WARN, "read timeout from %s:%d", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+                stats_thread_record()->timeouts++;
+                break;
+            }
+        }
+
+        ssize_t n = fill_input(conn, 0);
+        if (n < 0)
+        {
+            log_message(LOG_ERROR, "reading from socket: %m");
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+
+        if (process_input(conn) < 0)
+        {
+            break;
+        }
+
+        // a pipelining client has usually sent more by now: answer everything
+        // already queued on the socket before paying for a write
+        while (buffer_pending(&conn->out) < OUTPUT_HIGH_WATER && (n = fill_input(conn, MSG_DONTWAIT)) > 0)
+        {
+            if (process_input(conn) < 0)
+            {
+                done = 1;
+                break;
+            }
+        }
+        if (n == 0)
+        {
+            done = 1;
+        }
+        track_deadline(conn);
+
+        int rc = flush_output(conn);
+        if (rc > 0)
+        {
+            log_message(LOG_WARN, "write timeout to %s:%d", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+            stats_thread_record()->timeouts++;
+            break;
+        }
+        if (rc < 0)
+        {
+            log_message(LOG_ERROR, "writing to socket: %m");
+            break;
+        }
+    }
+
+    close_connection(conn);
+    pthread_exit(NULL);
+}
+
+// pool mode: one thread accepts connections and waits for their input, and a fixed pool
+// of workers runs it. A connection with input (or room for its pending output) goes on a
+// bounded queue, and a worker arms it again with EPOLLONESHOT once done, so one thread
+// handles it at a time and a worker never blocks on a socket. When the queue is full, the
+// requests at hand are answered "server busy" straight away rather than waiting behind it,
+// and a connection that has not sent all of a request --read-timeout after it began is
+// dropped.
+#define POOL_SWEEP_MS 100
+
+typedef struct ConnectionQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Connection **items; // ring of cap
+    int head;
+    int count;
+    int cap;
+} ConnectionQueue;
+
+ConnectionQueue pool_queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 1024};
+int pool_epfd;
+
+// every connection, for the deadline sweep; the lock also orders arming against it
+Connection *pooled;
+pthread_mutex_t pooled_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// returns 0 if the queue is full
+int pool_push(Connection *conn)
+{
+    pthread_mutex_lock(&pool_queue.lock);
+    if (pool_queue.count == pool_queue.cap)
+    {
+        pthread_mutex_unlock(&pool_queue.lock);
+        return 0;
+    }
+    pool_queue.items[(pool_queue.head + pool_queue.count) % pool_queue.cap] = conn;
+    pool_queue.count++;
+    pthread_cond_signal(&pool_queue.ready);
+    pthread_mutex_unlock(&pool_queue.lock);
+    return 1;
+}
+
+Connection *pool_pop(void)
+{
+    pthread_mutex_lock(&pool_queue.lock);
+    while (pool_queue.count == 0)
+    {
+        pthread_cond_wait(&pool_queue.ready, &pool_queue.lock);
+    }
+    Connection *conn = pool_queue.items[pool_queue.head];
+    pool_queue.head = (pool_queue.head + 1) % pool_queue.cap;
+    pool_queue.count--;
+    pthread_mutex_unlock(&pool_queue.lock);
+    return conn;
+}
+
+// hand the connection back to epoll, for input or, with responses still unsent, for room
+int pool_arm(Connection *conn)
+{
+    track_deadline(conn);
+
+    struct epoll_event ev;
+    ev.events = conn->events = (buffer_pending(&conn->out) > 0 ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    pthread_mutex_lock(&pooled_lock);
+    conn->armed = 1;
+    int rc = epoll_ctl(pool_epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+    if (rc < 0)
+    {
+        conn->armed = 0;
+    }
+    pthread_mutex_unlock(&pooled_lock);
+    return rc;
+}
+
+void pool_close(Connection *conn)
+{
+    pthread_mutex_lock(&pooled_lock);
+    if (conn->prev_pooled != NULL)
+    {
+        conn->prev_pooled->next_pooled = conn->next_pooled;
+    }
+    else
+    {
+        pooled = conn->next_pooled;
+    }
+    if (conn->next_pooled != NULL)
+    {
+        conn->next_pooled->prev_pooled = conn->prev_pooled;
+    }
+    pthread_mutex_unlock(&pooled_lock);
+    close_connection(conn);
+}
+
+// like an epoll event: write out what is pending, then read and run requests until the
+// socket is drained or the responses back up
+// returns -1 if the connection should be dropped
+int pool_serve(Connection *conn)
+{
+    if (conn->events & EPOLLOUT)
+    {
+        int rc = flush_output(conn);
+        if (rc != 0)
+        {
+            return rc;
+        }
+        if (process_input(conn) < 0)
+        {
+            return -1;
+        }
+    }
+
+    while (buffer_pending(&conn->out) < OUTPUT_HIGH_WATER)
+    {
+        ssize_t n = fill_input(conn, MSG_DONTWAIT);
+        if (n == 0)
+        {
+            return -1;
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            log_message(LOG_ERROR, "reading from socket: %m");
+            return -1;
+        }
+        if (process_input(conn) < 0)
+        {
+            return -1;
+        }
+    }
+    return flush_output(conn) < 0 ? -1 : 0;
+}
+
+void *pool_worker(void *arg)
+{
+    (void)arg;
+    request_thread = 1;
+
+    while (1)
+    {
+        Connection *conn = pool_pop();
+        if (pool_serve(conn) < 0 || pool_arm(conn) < 0)
+        {
+            pool_close(conn);
+        }
+    }
+    return NULL;
+}
+
+// the queue is full: answer the requests already sent with "server busy", unrun. Whatever
+// does not fit in the socket right now is kept for the next time
+// returns -1 if the connection should be dropped
+int pool_reject(Connection *conn)
+{
+    if (conn->events & EPOLLIN)
+    {
+        ssize_t n = fill_input(conn, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            return -1;
+        }
+    }
+
+    Request req;
+    long size = 0;
+    while (buffer_pending(&conn->out) < OUTPUT_HIGH_WATER &&
+           (size = parse_request(conn->in.data + conn->in.start, conn->in.len - conn->in.start, &req, &conn->need)) > 0)
+    {
+        if (append_response(&conn->out, &req, STATUS_BUSY) < 0)
+        {
+            return -1;
+        }
+        stats_thread_record()->busy++;
+        conn->in.start += size;
+        conn->deadline = 0;
+    }
+    if (size < 0)
+    {
+        return -1;
+    }
+    return flush_output(conn) < 0 ? -1 : 0;
+}
+
+// drop the connections stalled partway through a request past their deadline; only armed
+// ones are looked at, the others are with a worker or queued for one
+void pool_sweep(void)
+{
+    unsigned long long now = now_ns();
+
+    pthread_mutex_lock(&pooled_lock);
+    for (Connection *conn = pooled, *next; conn != NULL; conn = next)
+    {
+        next = conn->next_pooled;
+        if (!conn->armed || conn->deadline == 0 || conn->deadline > now)
+        {
+            continue;
+        }
+        log_message(LOG_WARN, "read timeout from %s:%d", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+        stats_thread_record()->timeouts++;
+        epoll_ctl(pool_epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        if (conn->prev_pooled != NULL)
+        {
+            conn->prev_pooled->next_pooled = next;
+        }
+        else
+        {
+            pooled = next;
+        }
+        if (next != NULL)
+        {
+            next->prev_pooled = conn->prev_pooled;
+        }
+        close_connection(conn);
+    }
+    pthread_mutex_unlock(&pooled_lock);
+}
+
+void pool_accept(int listenfd)
+{
+    while (1)
+    {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                log_message(LOG_ERROR, "accept: %m");
+            }
+            return;
+        }
+
+        Connection *conn = new_connection(fd);
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_mutex_lock(&pooled_lock);
+        conn->next_pooled = pooled;
+        if (pooled != NULL)
+        {
+            pooled->prev_pooled = conn;
+        }
+        pooled = conn;
+        conn->armed = 1;
+        struct epoll_event ev;
+        ev.events = conn->events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        int rc = epoll_ctl(pool_epfd, EPOLL_CTL_ADD, fd, &ev);
+        pthread_mutex_unlock(&pooled_lock);
+        if (rc < 0)
+        {
+            log_message(LOG_ERROR, "adding connection to epoll: %m");
+            pool_close(conn);
+        }
+    }
+}
+
+// runs on the main thread: accept, and queue every connection that becomes ready
+void pool_dispatch(int listenfd, int nworkers)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    pool_queue.items = malloc(pool_queue.cap * sizeof(Connection *));
+    pool_epfd = epoll_create1(0);
+    if (pool_queue.items == NULL || pool_epfd < 0)
+    {
+        error("ERROR setting up the worker pool");
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(pool_epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    {
+        error("ERROR adding listener to epoll");
+    }
+    for (int i = 0; i < nworkers; i++)
+    {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, pool_worker, NULL) != 0)
+        {
+            error("ERROR creating worker thread");
+        }
+        pthread_detach(worker);
+    }
+
+    unsigned long long next_sweep = now_ns();
+    while (1)
+    {
+        int n = epoll_wait(pool_epfd, events, MAX_EVENTS, POOL_SWEEP_MS);
+        if (n < 0 && errno != EINTR)
+        {
+            error("ERROR waiting for events");
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            Connection *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                pool_accept(listenfd);
+                continue;
+            }
+            pthread_mutex_lock(&pooled_lock);
+            conn->armed = 0;
+            pthread_mutex_unlock(&pooled_lock);
+            if (pool_push(conn))
+            {
+                continue;
+            }
+            if (pool_reject(conn) < 0 || pool_arm(conn) < 0)
+            {
+                pool_close(conn);
+            }
+        }
+
+        if (read_timeout > 0 && now_ns() >= next_sweep)
+        {
+            pool_sweep();
+            next_sweep = now_ns() + POOL_SWEEP_MS * 1000000ULL;
+        }
+    }
+}
+
+// epoll mode: after handling input, wait for either more input or for the socket to drain
+// returns -1 if the connection should be dropped
+int update_interest(int epfd, Connection *conn)
+{
+    int rc = flush_output(conn);
+    if (rc < 0)
+    {
+        return -1;
+    }
+
+    uint32_t wanted = rc == 1 ? EPOLLOUT : EPOLLIN;
+    if (wanted == conn->events)
+    {
+        return 0;
+    }
+
+    struct epoll_event ev;
+    ev.events = wanted;
+    ev.data.ptr = conn;
+    conn->events = wanted;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+void accept_connections(int epfd, int listenfd)
+{
+    while (1)
+    {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                log_message(LOG_ERROR, "accept: %m");
+            }
+            return;
+        }
+
+        Connection *conn = new_connection(fd);
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = conn->events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            log_message(LOG_ERROR, "adding connection to epoll: %m");
+            close_connection(conn);
+        }
+    }
+}
+
+// per-connection state machine: read and execute requests while the socket is readable,
+// switch to waiting for writability when responses back up, and back again once drained
+int handle_event(int epfd, Connection *conn, uint32_t events)
+{
+    // the input buffer must stay put while other cores work on requests in it; until the
+    // answers are back the connection is left alone
+    if (conn->queued > 0)
+    {
+        if (conn->events != 0)
+        {
+            struct epoll_event ev;
+            ev.events = conn->events = 0;
+            ev.data.ptr = conn;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        }
+        return 0;
+    }
+
+    if (events & EPOLLERR)
+    {
+        return -1;
+    }
+
+    if (events & EPOLLOUT)
+    {
+        int rc = flush_output(conn);
+        if (rc != 0)
+        {
+            return rc < 0 ? -1 : 0;
+        }
+        // requests may still be waiting in the input buffer from before the socket backed up
+        if (process_input(conn) < 0)
+        {
+            return -1;
+        }
+        return update_interest(epfd, conn);
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP))
+    {
+        while (conn->queued == 0 && buffer_pending(&conn->out) < OUTPUT_HIGH_WATER)
+        {
+            ssize_t n = fill_input(conn, 0);
+            if (n == 0)
+            {
+                return -1;
+            }
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                log_message(LOG_ERROR, "reading from socket: %m");
+                return -1;
+            }
+            if (process_input(conn) < 0)
+            {
+                return -1;
+            }
+        }
+        return update_interest(epfd, conn);
+    }
+
+    return 0;
+}
+
+// close a connection, or once the requests it has out on other cores are back
+void drop_connection(int epfd, Connection *conn)
+{
+    if (!conn->dropped)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->dropped = 1;
+    }
+    if (conn->queued == 0)
+    {
+        close_connection(conn);
+    }
+}
+
+// per-core mode: an answer is back from another core; pass on what is now in order and,
+// once nothing is out any more, carry on with the input
+void finish_message(int epfd, Message *msg)
+{
+    Connection *conn = msg->conn;
+
+    msg->done = 1;
+    if (drain_queue(conn) < 0)
+    {
+        drop_connection(epfd, conn);
+        return;
+    }
+    if (conn->queued > 0)
+    {
+        return;
+    }
+    if (conn->dropped || process_input(conn) < 0 || update_interest(epfd, conn) < 0)
+    {
+        drop_connection(epfd, conn);
+    }
+}
+
+// per-core mode: run the requests other cores handed over, then take the answers to ours
+void run_messages(int epfd, Core *core)
+{
+    Message *list = core_take(&core->requests);
+    if (list != NULL)
+    {
+        for (Message *msg = list; msg != NULL; msg = msg->next_post)
+        {
+            msg->rc = execute_request(&msg->req, &msg->reply);
+        }
+        // as for a connection of our own, the answers go out once the writes are durable
+        wal_wait();
+        while (list != NULL)
+        {
+            Message *next = list->next_post;
+            core_post(&list->home->replies, list->home, list);
+            list = next;
+        }
+    }
+
+    // one at a time: the last answer of a connection may close it
+    for (Message *msg = core_take(&core->replies), *next; msg != NULL; msg = next)
+    {
+        next = msg->next_post;
+        finish_message(epfd, msg);
+    }
+}
+
+// pin the calling thread to one CPU; a failure only costs locality
+void pin_thread(int index)
+{
+    cpu_set_t set;
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    CPU_SET(index % (ncpus > 0 ? ncpus : 1), &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0)
+    {
+        log_message(LOG_WARN, "pinning core %d: %s", index, strerror(rc));
+    }
+}
+
+void *event_loop(void *arg)
+{
+    Core *core = arg;
+    struct epoll_event events[MAX_EVENTS];
+    request_thread = 1;
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+    {
+        error("ERROR creating epoll instance");
+    }
+
+    // every loop watches the listening socket, shared or its own; EPOLLEXCLUSIVE wakes
+    // only one of them per connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, core->listenfd, &ev) < 0)
+    {
+        error("ERROR adding listener to epoll");
+    }
+    if (core->wakefd >= 0)
+    {
+        pin_thread(core->index);
+        current_core = core;
+        ev.events = EPOLLIN;
+        ev.data.ptr = core;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, core->wakefd, &ev) < 0)
+        {
+            error("ERROR adding eventfd to epoll");
+        }
+    }
+
+    while (1)
+    {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("ERROR waiting for events");
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            Connection *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                accept_connections(epfd, core->listenfd);
+            }
+            else if (events[i].data.ptr == core)
+            {
+                uint64_t count;
+                if (read(core->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                {
+                    log_message(LOG_ERROR, "reading eventfd: %m");
+                }
+            }
+            else if (handle_event(epfd, conn, events[i].events) < 0)
+            {
+                drop_connection(epfd, conn);
+            }
+        }
+        if (current_core != NULL)
+        {
+            run_messages(epfd, core);
+        }
+    }
+    return NULL;
+}
+
+// io_uring mode: every loop owns a ring. One multishot accept on the shared listener and
+// one multishot recv per connection stay armed, the recvs filling buffers from a ring of
+// them registered with the kernel, and responses go out with sendmsg. All the submissions
+// made while handling a batch of completions go in with the one io_uring_enter that also
+// waits for the next batch. Requests run through process_input as in the other modes.
+#define URING_ENTRIES 1024
+#define URING_RECV_BUFFERS 256 // a power of two
+#define URING_RECV_BUFFER_SIZE 16384
+#define URING_RECV_GROUP 0
+
+// the operation is kept in the low bits of a completion's user_data, the connection in the rest
+enum
+{
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL
+};
+
+typedef struct Uring
+{
+    int fd;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned unsubmitted;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buffers;
+    char *buffer_memory;
+    unsigned short buffer_tail;
+    struct Connection *touched; // by the completions at hand, to be updated after them
+} Uring;
+
+// the per-connection side: a response batch is sent from its own buffer while the next
+// one collects in the connection's output, which may move as it grows
+typedef struct UringIo
+{
+    Buffer sending;
+    struct iovec iov[FLUSH_IOV];
+    struct msghdr msg;
+    unsigned long long send_start;
+    int ops; // submitted and not yet completed for good
+    int recv_armed;
+    int cancelling;
+    int closing;
+    int shut;
+    int touched;
+    Connection *next_touched;
+} UringIo;
+
+// release whatever uring_setup got to, so it also undoes a half-finished setup
+void uring_free(Uring *ring)
+{
+    if (ring->rings != NULL && ring->rings != MAP_FAILED)
+    {
+        munmap(ring->rings, ring->rings_size);
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->buffers != NULL && ring->buffers != MAP_FAILED)
+    {
+        munmap(ring->buffers, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    free(ring->buffer_memory);
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = -1;
+}
+
+int uring_setup(Uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+    // only the loop thread submits, and it only looks at completions when it waits for
+    // them, so the kernel can leave their work until then (6.1 on; older kernels go without)
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        uring_free(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->entries = params.sq_entries;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    size_t buffers_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buffers = mmap(NULL, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffer_memory = malloc((size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED || ring->buffer_memory == NULL)
+    {
+        uring_free(ring);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    char *sq = ring->rings;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned *)(sq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(sq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(sq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(sq + params.cq_off.cqes);
+
+    // the recv buffers, handed to the kernel as a ring it takes them from
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buffers;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_RECV_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int saved = errno;
+        uring_free(ring);
+        errno = saved;
+        return -1;
+    }
+    for (int i = 0; i < URING_RECV_BUFFERS; i++)
+    {
+        struct io_uring_buf *buf = &ring->buffers->bufs[ring->buffer_tail++ & (URING_RECV_BUFFERS - 1)];
+        buf->addr = (uintptr_t)(ring->buffer_memory + (size_t)i * URING_RECV_BUFFER_SIZE);
+        buf->len = URING_RECV_BUFFER_SIZE;
+        buf->bid = i;
+    }
+    __atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// submit what is queued and, with wait, block until a completion is in; returns -1 on error
+int uring_submit(Uring *ring, int wait)
+{
+    int rc;
+
+    do
+    {
+        rc = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0)
+    {
+        return -1;
+    }
+    ring->unsubmitted -= rc;
+    return 0;
+}
+
+// a cleared submission entry for conn's op, submitting the queued ones first if the ring is full
+struct io_uring_sqe *uring_sqe(Uring *ring, int opcode, Connection *conn, int op)
+{
+    unsigned tail = *ring->sq_tail;
+
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries)
+    {
+        if (uring_submit(ring, 0) < 0)
+        {
+            error("ERROR submitting to io_uring");
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = (uintptr_t)conn | op;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    if (conn != NULL)
+    {
+        conn->uring->ops++;
+    }
+    return sqe;
+}
+
+void uring_accept(Uring *ring, int listenfd)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_ACCEPT, NULL, URING_ACCEPT);
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uring_recv(Uring *ring, Connection *conn)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_RECV, conn, URING_RECV);
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_GROUP;
+    conn->uring->recv_armed = 1;
+}
+
+void uring_send(Uring *ring, Connection *conn)
+{
+    UringIo *io = conn->uring;
+
+    memset(&io->msg, 0, sizeof(io->msg));
+    io->msg.msg_iov = io->iov;
+    io->msg.msg_iovlen = buffer_iov(&io->sending, io->iov, FLUSH_IOV);
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_SENDMSG, conn, URING_SEND);
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)&io->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    io->send_start = now_ns();
+}
+
+void uring_cancel_recv(Uring *ring, Connection *conn)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_ASYNC_CANCEL, conn, URING_CANCEL);
+    sqe->addr = (uintptr_t)conn | URING_RECV;
+    conn->uring->cancelling = 1;
+}
+
+// decide what a connection waits for next: a send of whatever is queued, a recv unless
+// responses back up, or once it is closing and nothing is in flight, the close
+void uring_update(Uring *ring, Connection *conn)
+{
+    UringIo *io = conn->uring;
+
+    if (io->closing)
+    {
+        // a shut down socket ends the recv and any send still waiting for room
+        if (!io->shut)
+        {
+            shutdown(conn->fd, SHUT_RDWR);
+            io->shut = 1;
+        }
+        if (io->ops == 0)
+        {
+            buffer_free(&io->sending);
+            free(io);
+            close_connection(conn);
+        }
+        return;
+    }
+
+    // requests received while the responses were backed up run once they drain
+    int backed_up = buffer_pending(&io->sending) + buffer_pending(&conn->out) >= OUTPUT_HIGH_WATER;
+    if (!backed_up && conn->in.start < conn->in.len && process_input(conn) < 0)
+    {
+        io->closing = 1;
+        uring_update(ring, conn);
+        return;
+    }
+
+    int sending = buffer_pending(&io->sending) > 0;
+    if (!sending && buffer_pending(&conn->out) > 0)
+    {
+        Buffer batch = io->sending;
+        io->sending = conn->out;
+        conn->out = batch;
+        uring_send(ring, conn);
+        sending = 1;
+    }
+
+    backed_up = buffer_pending(&io->sending) + buffer_pending(&conn->out) >= OUTPUT_HIGH_WATER;
+    if (!backed_up && !io->recv_armed)
+    {
+        uring_recv(ring, conn);
+    }
+    else if (backed_up && io->recv_armed && !io->cancelling)
+    {
+        uring_cancel_recv(ring, conn);
+    }
+}
+
+void uring_complete(Uring *ring, int listenfd, const struct io_uring_cqe *cqe)
+{
+    Connection *conn = (Connection *)(uintptr_t)(cqe->user_data & ~3ULL);
+    int op = cqe->user_data & 3;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (op == URING_ACCEPT)
+    {
+        if (cqe->res >= 0)
+        {
+            conn = new_connection(cqe->res);
+            if (conn == NULL)
+            {
+                close(cqe->res);
+            }
+            else if ((conn->uring = calloc(1, sizeof(UringIo))) == NULL)
+            {
+                close_connection(conn);
+            }
+            else
+            {
+                conn->uring->sending.zero_copy = 1;
+                uring_recv(ring, conn);
+            }
+        }
+        else if (cqe->res != -EAGAIN && cqe->res != -EINTR)
+        {
+            log_message(LOG_ERROR, "accept: %s", strerror(-cqe->res));
+        }
+        if (!more)
+        {
+            uring_accept(ring, listenfd);
+        }
+        return;
+    }
+
+    UringIo *io = conn->uring;
+    if (!more)
+    {
+        io->ops--;
+    }
+
+    if (op == URING_RECV)
+    {
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0 && !io->closing &&
+                buffer_append(&conn->in, ring->buffer_memory + (size_t)bid * URING_RECV_BUFFER_SIZE, cqe->res) < 0)
+            {
+                io->closing = 1;
+            }
+            // the buffer goes straight back to the kernel
+            struct io_uring_buf *buf = &ring->buffers->bufs[ring->buffer_tail++ & (URING_RECV_BUFFERS - 1)];
+            buf->addr = (uintptr_t)(ring->buffer_memory + (size_t)bid * URING_RECV_BUFFER_SIZE);
+            buf->len = URING_RECV_BUFFER_SIZE;
+            buf->bid = bid;
+            __atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+        }
+        if (!more)
+        {
+            io->recv_armed = 0;
+            io->cancelling = 0;
+        }
+        // end of stream, or an error other than running out of buffers or being cancelled
+        if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
+        {
+            if (cqe->res < 0 && cqe->res != -ECONNRESET)
+            {
+                log_message(LOG_ERROR, "reading from socket: %s", strerror(-cqe->res));
+            }
+            io->closing = 1;
+        }
+    }
+    else if (op == URING_SEND)
+    {
+        if (cqe->res < 0)
+        {
+            if (cqe->res != -EPIPE && cqe->res != -ECONNRESET)
+            {
+                log_message(LOG_ERROR, "writing to socket: %s", strerror(-cqe->res));
+            }
+            io->closing = 1;
+        }
+        else
+        {
+            stats_record(LATENCY_WRITE, now_ns() - io->send_start);
+            buffer_consume(&io->sending, cqe->res);
+            if (buffer_pending(&io->sending) == 0)
+            {
+                io->sending.start = io->sending.len = 0;
+                if (io->sending.cap > BUFFER_KEEP_SIZE)
+                {
+                    buffer_free(&io->sending);
+                }
+            }
+            else if (!io->closing)
+            {
+                uring_send(ring, conn);
+            }
+        }
+    }
+
+    // every request received in the batch runs before the responses go out together
+    if (!io->touched)
+    {
+        io->touched = 1;
+        io->next_touched = ring->touched;
+        ring->touched = conn;
+    }
+}
+
+// probe for what the io_uring loops need, multishot recv into registered buffers being
+// the newest of it; returns 0 if the kernel has it all
+int uring_supported(void)
+{
+    Uring ring;
+    int fds[2];
+
+    if (uring_setup(&ring, 8) < 0)
+    {
+        log_message(LOG_WARN, "io_uring unavailable: %m");
+        return 0;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        uring_free(&ring);
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(&ring, IORING_OP_RECV, NULL, URING_RECV);
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_GROUP;
+    int rc = write(fds[1], "x", 1) == 1 && uring_submit(&ring, 1) == 0 ? 0 : -1;
+    if (rc == 0)
+    {
+        const struct io_uring_cqe *cqe = &ring.cqes[*ring.cq_head & ring.cq_mask];
+        if (cqe->res != 1 || !(cqe->flags & IORING_CQE_F_MORE))
+        {
+            log_message(LOG_WARN, "io_uring lacks multishot recv: %s", cqe->res < 0 ? strerror(-cqe->res) : "no more flag");
+            rc = -1;
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    uring_free(&ring);
+    return rc == 0;
+}
+
+void *uring_loop(void *arg)
+{
+    Core *core = arg;
+    Uring ring;
+    request_thread = 1;
+
+    if (uring_setup(&ring, URING_ENTRIES) < 0)
+    {
+        error("ERROR setting up io_uring");
+    }
+    uring_accept(&ring, core->listenfd);
+
+    while (1)
+    {
+        if (uring_submit(&ring, 1) < 0)
+        {
+            error("ERROR waiting for io_uring completions");
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            uring_complete(&ring, core->listenfd, &ring.cqes[head & ring.cq_mask]);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        while (ring.touched != NULL)
+        {
+            Connection *conn = ring.touched;
+            ring.touched = conn->uring->next_touched;
+            conn->uring->touched = 0;
+            uring_update(&ring, conn);
+        }
+    }
+    return NULL;
+}
+
+// table contention benchmark: N threads hammer the table directly, no sockets involved
+#define BENCH_KEYS 100000
+#define BENCH_SECONDS 1
+#define BENCH_WRITE_PERCENT 5
+
+typedef struct BenchWorker
+{
+    pthread_t thread;
+    unsigned long long seed;
+    unsigned long long ops;
+    int global_mutex; // serialize every operation on one mutex, like the old table
+} BenchWorker;
+
+pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+volatile int bench_running;
+
+unsigned long long bench_next(unsigned long long *state)
+{
+    // xorshift64
+    unsigned long long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+void *bench_worker(void *arg)
+{
+    BenchWorker *worker = arg;
+    Buffer out = {0};
+    char value[32];
+    char key_text[INT_KEY_TEXT_SIZE];
+
+    while (bench_running)
+    {
+        unsigned long long r = bench_next(&worker->seed);
+        Key key = int_key((int)((r >> 8) % BENCH_KEYS), key_text);
+
+        if (worker->global_mutex)
+        {
+            pthread_mutex_lock(&bench_mutex);
+        }
+        if (r % 100 < BENCH_WRITE_PERCENT)
+        {
+            int len = snprintf(value, sizeof(value), "value-%llu", r);
+            engine->update(&key, value, len, 0);
+        }
+        else
+        {
+            out.len = 0;
+            engine->read(&key, &out, NULL);
+        }
+        if (worker->global_mutex)
+        {
+            pthread_mutex_unlock(&bench_mutex);
+        }
+        worker->ops++;
+    }
 
-void error(char *msg)
-{
-    perror(msg);
-    exit(1);
+    buffer_free(&out);
+    return NULL;
 }
 
-typedef struct KeyValue
+double bench_run(int nthreads, int global_mutex)
 {
-    int key;
-    char *value;
-    struct KeyValue *next;
-} KeyValue;
+    BenchWorker *workers = calloc(nthreads, sizeof(BenchWorker));
 
-KeyValue *table[TABLE_SIZE] = {NULL};
+    bench_running = 1;
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        workers[i].global_mutex = global_mutex;
+        pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]);
+    }
+    sleep(BENCH_SECONDS);
+    bench_running = 0;
 
-int hash(int key)
-{
-    return key % TABLE_SIZE;
+    unsigned long long total = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].ops;
+    }
+    free(workers);
+    return (double)total / BENCH_SECONDS;
 }
 
-KeyValue *createNode(int key, char *value)
+void run_table_benchmark(int max_threads)
 {
-    KeyValue *newNode = (KeyValue *)malloc(sizeof(KeyValue));
+    char value[32];
+    char key_text[INT_KEY_TEXT_SIZE];
 
-    if (newNode == NULL)
+    for (int i = 0; i < BENCH_KEYS; i++)
     {
-        return NULL;
+        Key key = int_key(i, key_text);
+        int len = snprintf(value, sizeof(value), "value-%d", i);
+        engine->create(&key, value, len, 0);
     }
 
-    newNode->key = key;
-    // strdup allocates memory and copies the string
-    newNode->value = strdup(value);
+    printf("table benchmark: %s engine, %d keys, %d%% updates, %ds per run\n", engine->name, BENCH_KEYS, BENCH_WRITE_PERCENT, BENCH_SECONDS);
+    printf("%8s %16s %16s %10s\n", "threads", "table ops/s", "global ops/s", "scaling");
 
-    // if strdup fails
-    if (newNode->value == NULL)
+    double single = 0;
+    // 1, 2, 4, ... threads, always ending with max_threads
+    for (int n = 1;; n *= 2)
     {
-        free(newNode);
-        return NULL;
+        if (n > max_threads)
+        {
+            n = max_threads;
+        }
+        double striped = bench_run(n, 0);
+        double global = bench_run(n, 1);
+        if (n == 1)
+        {
+            single = striped;
+        }
+        printf("%8d %16.0f %16.0f %9.2fx\n", n, striped, global, striped / single);
+        if (n == max_threads)
+        {
+            break;
+        }
     }
-
-    newNode->next = NULL;
-
-    return newNode;
 }
 
-void insert(KeyValue **table, int key, char *value)
+// single-threaded microbenchmark of every engine's operations
+#define MICRO_KEYS 1000000
+
+double elapsed_ns(struct timespec *start)
 {
-    int index = hash(key);
+    struct timespec now;
 
-    KeyValue *newNode = createNode(key, value);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
 
-    newNode->next = table[index];
-    table[index] = newNode;
+// the key of a micro benchmark operation: the number's 8 bytes, so that little more than
+// hashing the key is timed
+static inline Key micro_key(int i, char *text)
+{
+    unsigned long long n = i;
+    memcpy(text, &n, 8);
+    return key_make(text, 8);
 }
 
-char *search(KeyValue **table, int key)
+void run_engine_benchmark(void)
 {
-    int index = hash(key);
+    Buffer out = {0};
+    char value[32];
+    char text[8];
+    struct timespec start;
 
-    KeyValue *current = table[index];
+    printf("engine benchmark: %d 8-byte keys, ~13-byte values, ns per operation\n", MICRO_KEYS);
+    printf("%10s %10s %10s %10s %10s %10s\n", "engine", "insert", "read hit", "read miss", "update", "delete");
 
-    while (current != NULL)
+    for (int e = 0; e < NUM_ENGINES; e++)
     {
-        if (key == current->key)
+        Engine *eng = &engines[e];
+        unsigned long long seed = 0x9E3779B97F4A7C15ULL;
+        double ns[5];
+
+        eng->init();
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < MICRO_KEYS; i++)
         {
-            return current->value;
+            int len = snprintf(value, sizeof(value), "value-%07d", i);
+            Key key = micro_key(i, text);
+            eng->create(&key, value, len, 0);
         }
-        current = current->next;
-    }
+        ns[0] = elapsed_ns(&start);
 
-    return NULL;
-}
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < MICRO_KEYS; i++)
+        {
+            out.len = 0;
+            Key key = micro_key((int)(bench_next(&seed) % MICRO_KEYS), text);
+            eng->read(&key, &out, NULL);
+        }
+        ns[1] = elapsed_ns(&start);
 
-int update(KeyValue **table, int key, char *newValue)
-{
-    int index = hash(key);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < MICRO_KEYS; i++)
+        {
+            out.len = 0;
+            Key key = micro_key(MICRO_KEYS + (int)(bench_next(&seed) % MICRO_KEYS), text);
+            eng->read(&key, &out, NULL);
+        }
+        ns[2] = elapsed_ns(&start);
 
-    KeyValue *current = table[index];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < MICRO_KEYS; i++)
+        {
+            int len = snprintf(value, sizeof(value), "update-%06d", i % 1000000);
+            Key key = micro_key((int)(bench_next(&seed) % MICRO_KEYS), text);
+            eng->update(&key, value, len, 0);
+        }
+        ns[3] = elapsed_ns(&start);
 
-    while (current != NULL)
-    {
-        if (key == current->key)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < MICRO_KEYS; i++)
         {
-            free(current->value);
-            current->value = strdup(newValue);
-            return 1;
+            Key key = micro_key(i, text);
+            eng->delete(&key);
         }
+        ns[4] = elapsed_ns(&start);
 
-        current = current->next;
+        printf("%10s", eng->name);
+        for (int i = 0; i < 5; i++)
+        {
+            printf(" %10.1f", ns[i] / MICRO_KEYS);
+        }
+        printf("\n");
     }
-    // update failed, key not found
-    return 0;
+
+    buffer_free(&out);
 }
 
-int delete(KeyValue **table, int key)
+// a byte count with an optional k, m or g suffix; 0 if it is not one
+unsigned long long parse_size(const char *text)
 {
-    int index = hash(key);
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
 
-    KeyValue *current = table[index];
-    KeyValue *prev = NULL;
-
-    while (current != NULL)
+    if (*end == 'k' || *end == 'K')
     {
-        if (key == current->key)
-        {
-            if (prev == NULL)
-            {
-                // deleting head node
-                table[index] = current->next;
-            }
-            else
-            {
-                prev->next = current->next;
-            }
+        size <<= 10;
+        end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        size <<= 20;
+        end++;
+    }
+    else if (*end == 'g' || *end == 'G')
+    {
+        size <<= 30;
+        end++;
+    }
+    return end == text || *end != '\0' ? 0 : size;
+}
 
-            free(current->value);
-            free(current);
-            return 1;
-        }
+int listen_backlog = SOMAXCONN; // the kernel caps it at net.core.somaxconn
 
-        prev = current;
-        current = current->next;
+// a TCP socket listening on addr; with reuse_port several can share the address, the
+// kernel spreading connections over them
+int open_listener(const struct sockaddr_in *addr, int reuse_port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        error("ERROR opening socket");
     }
-    // deletion failed, key not found
-    return 0;
+    int on = 1;
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        error("ERROR setting SO_REUSEPORT");
+    }
+
+    // binding the socket to the address and port number specified in addr
+    if (bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0)
+    {
+        error("ERROR on binding");
+    }
+
+    // listen for incoming connection requests
+    listen(fd, listen_backlog);
+    return fd;
 }
 
-void *client_handler(void *arg){
-    int newsockfd = *((int *)arg);
-    free(arg);
-    char buffer[MAX_BUFFER_SIZE];
-    struct sockaddr_in cli_addr;
-    socklen_t clilen = sizeof(cli_addr);
-    getpeername(newsockfd, (struct sockaddr *)&cli_addr, &clilen);
+void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s <IP address> <Port number> [--mode threaded|epoll|percore|uring|pool] [--threads N] [--engine chained|open]\n", prog);
+    fprintf(stderr, "       [--queue-depth N] [--read-timeout <ms>] [--backlog N]\n");
+    fprintf(stderr, "       [--wal <file> [--wal-sync always|interval|os] [--wal-interval <ms>]] [--snapshot <file>]\n");
+    fprintf(stderr, "       [--log-level off|error|warn|info|debug] [--log-sample N] [--stats-interval <seconds>]\n");
+    fprintf(stderr, "       [--maxmemory <bytes>[k|m|g]] [--eviction lru|lfu|none] [--ordered-index]\n");
+    fprintf(stderr, "       %s [--engine chained|open] --bench-table <max threads>\n", prog);
+    fprintf(stderr, "       %s --bench-engines\n", prog);
+    exit(1);
+}
 
-    printf("> Client %s:%d connected\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
+int main(int argc, char *argv[])
+{
+    int sockfd, portno;
+    socklen_t clilen;
+    struct sockaddr_in serv_addr, cli_addr;
+    int use_epoll = 0;
+    int per_core = 0;
+    int use_uring = 0;
+    int use_pool = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int bench_threads = 0;
+    int bench_engines = 0;
+    const char *wal_path = NULL;
+    unsigned long long snapshot_position = 0;
 
-    while (1)
+    static struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 't'},
+        {"engine", required_argument, NULL, 'e'},
+        {"bench-table", required_argument, NULL, 'b'},
+        {"bench-engines", no_argument, NULL, 'B'},
+        {"wal", required_argument, NULL, 'w'},
+        {"wal-sync", required_argument, NULL, 's'},
+        {"wal-interval", required_argument, NULL, 'i'},
+        {"snapshot", required_argument, NULL, 'p'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"log-sample", required_argument, NULL, 'L'},
+        {"stats-interval", required_argument, NULL, 'S'},
+        {"maxmemory", required_argument, NULL, 'M'},
+        {"eviction", required_argument, NULL, 'E'},
+        {"ordered-index", no_argument, NULL, 'o'},
+        {"queue-depth", required_argument, NULL, 'Q'},
+        {"read-timeout", required_argument, NULL, 'R'},
+        {"backlog", required_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:t:", long_options, NULL)) != -1)
     {
-        bzero(buffer, MAX_BUFFER_SIZE);
-        int n = read(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-        if (n < 0)
+        if (opt == 'm' && strcmp(optarg, "epoll") == 0)
         {
-            error("ERROR reading from socket");
+            use_epoll = 1;
+            per_core = use_uring = use_pool = 0;
         }
-        else if (n == 0)
+        else if (opt == 'm' && strcmp(optarg, "percore") == 0)
         {
-            printf("> Client with IP address %s and port %d disconnected.\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
-            close(newsockfd);
-            break;
+            use_epoll = per_core = 1;
+            use_uring = use_pool = 0;
         }
-        buffer[n] = '\0';
-
-        char *command = strtok(buffer, " ");
-        printf("Command : %s", command);
-
-        if (strcmp(command, "create") == 0)
+        else if (opt == 'm' && strcmp(optarg, "uring") == 0)
         {
-            int key, value_size;
-            n = read(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-            if (n < 0)
-            {
-                error("ERROR reading from socket");
-            }
-            buffer[n] = '\0';
-            key = atoi(buffer);
-
-            n = read(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-            if (n < 0)
-            {
-                error("ERROR reading from socket");
-            }
-            value_size = atoi(buffer);
-
-            int received_bytes = 0;
-            char *value = (char *)malloc(value_size + 1);
-
-            while (received_bytes < value_size)
+            use_epoll = use_uring = 1;
+            per_core = use_pool = 0;
+        }
+        else if (opt == 'm' && strcmp(optarg, "pool") == 0)
+        {
+            use_pool = 1;
+            use_epoll = per_core = use_uring = 0;
+        }
+        else if (opt == 'm' && strcmp(optarg, "threaded") == 0)
+        {
+            use_epoll = per_core = use_uring = use_pool = 0;
+        }
+        else if (opt == 't' && atoi(optarg) > 0)
+        {
+            nthreads = atoi(optarg);
+        }
+        else if (opt == 'e')
+        {
+            engine = NULL;
+            for (int i = 0; i < NUM_ENGINES; i++)
             {
-                int len_to_recieve;
-                if (value_size - received_bytes > MAX_BUFFER_SIZE - 1)
-                {
-                    len_to_recieve = MAX_BUFFER_SIZE - 1;
-                }
-                else
+                if (strcmp(optarg, engines[i].name) == 0)
                 {
-                    len_to_recieve = value_size - received_bytes;
+                    engine = &engines[i];
                 }
-
-                n = read(newsockfd, value + received_bytes, len_to_recieve);
-                if (n < 0)
-                {
-                    error("ERROR reading from socket");
-                }
-                received_bytes += n;
-            }
-
-            value[value_size] = '\0';
-
-            pthread_mutex_lock(&lock);
-            char *response;
-            if (search(table, key) != NULL)
-            {
-                response = "Error: Key already exists";
             }
-            else
+            if (engine == NULL)
             {
-                insert(table, key, value);
-                response = "Key-Value pair created successfully";
+                usage(argv[0]);
             }
-            pthread_mutex_unlock(&lock);
-
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, response);
-            n = write(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-            if (n < 0){
-                error("ERROR writing to socket");
-            }
-
-            printf(" (Key: %d, Value: %s)\n", key, value);
-            free(value);
         }
-
-        else if(strcmp(command, "read") == 0)
+        else if (opt == 'b' && atoi(optarg) > 0)
         {
-            n = read(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-            if (n < 0)
-            {
-                error("ERROR reading from socket");
-            }
-            buffer[n] = '\0';
-            int key = atoi(buffer);
-
-            printf(" (Key: %d)\n", key);
-
-            pthread_mutex_lock(&lock);
-            char *value = search(table, key);
-            pthread_mutex_unlock(&lock);
-
-            if (value == NULL){
-                char *response = "ERROR Error: Key not found";
-                bzero(buffer, MAX_BUFFER_SIZE);
-                strcpy(buffer, response);
-
-                n = write(newsockfd, buffer, MAX_BUFFER_SIZE-1);
-                if(n < 0){
-                    error("ERROR writing to socket");
-                }
-            }
-            else{
-                int value_size = strlen(value);
-                bzero(buffer, MAX_BUFFER_SIZE);
-                snprintf(buffer, MAX_BUFFER_SIZE, "OK %d", value_size);
-
-                n = write(newsockfd, buffer, MAX_BUFFER_SIZE-1);
-                if(n < 0){
-                    error("ERROR writing to socket");
-                }
-
-                int sent_bytes = 0;
-
-                while(sent_bytes < value_size){
-                    int len_to_send;
-                    if(value_size - sent_bytes > MAX_BUFFER_SIZE - 1){
-                        len_to_send = MAX_BUFFER_SIZE - 1;
-                    }
-                    else{
-                        len_to_send = value_size - sent_bytes;
-                    }
-
-                    n = write(newsockfd, value + sent_bytes, len_to_send);
-                    if(n < 0){
-                        error("ERROR writing to socket");
-                    }
-                    sent_bytes += n;
-                }
-            }
+            bench_threads = atoi(optarg);
         }
-
-        else if(strcmp(command, "update") == 0)
+        else if (opt == 'B')
         {
-            int key, value_size;
-            n = read(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-            if (n < 0)
-            {
-                error("ERROR reading from socket");
-            }
-            buffer[n] = '\0';
-            key = atoi(buffer);
-
-            n = read(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-            if (n < 0)
-            {
-                error("ERROR reading from socket");
-            }
-            buffer[n] = '\0';
-            value_size = atoi(buffer);
-
-            int received_bytes = 0;
-            char *newValue = (char *)malloc(value_size + 1);
-
-            while (received_bytes < value_size)
+            bench_engines = 1;
+        }
+        else if (opt == 'w')
+        {
+            wal_path = optarg;
+        }
+        else if (opt == 's')
+        {
+            wal.policy = -1;
+            for (int i = 0; i < (int)(sizeof(wal_sync_names) / sizeof(wal_sync_names[0])); i++)
             {
-                int len_to_recieve;
-                if (value_size - received_bytes > MAX_BUFFER_SIZE - 1)
+                if (strcmp(optarg, wal_sync_names[i]) == 0)
                 {
-                    len_to_recieve = MAX_BUFFER_SIZE - 1;
+                    wal.policy = i;
                 }
-                else
-                {
-                    len_to_recieve = value_size - received_bytes;
-                }
-
-                n = read(newsockfd, newValue + received_bytes, len_to_recieve);
-                if (n < 0)
-                {
-                    error("ERROR reading from socket");
-                }
-                received_bytes += n;
-            }
-
-            newValue[value_size] = '\0';
-
-            pthread_mutex_lock(&lock);
-            char *response;
-            if (update(table, key, newValue))
-            {
-                response = "Key-Value pair updated successfully";
-            }
-            else
-            {
-                response = "Error: Key not found";
             }
-            pthread_mutex_unlock(&lock);
-
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, response);
-            n = write(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-            if (n < 0)
+            if (wal.policy < 0)
             {
-                error("ERROR writing to socket");
+                usage(argv[0]);
             }
-
-            printf(" (Key: %d, New Value: %s)\n", key, newValue);
-            free(newValue);
         }
-
-        else if (strcmp(command, "delete") == 0)
+        else if (opt == 'i' && atoi(optarg) > 0)
         {
-            n = read(newsockfd, buffer, MAX_BUFFER_SIZE - 1);
-            if (n < 0)
+            wal.interval_ms = atoi(optarg);
+        }
+        else if (opt == 'p')
+        {
+            snapshot_path = optarg;
+        }
+        else if (opt == 'l')
+        {
+            log_level = -1;
+            for (int i = 0; i < (int)(sizeof(log_level_names) / sizeof(log_level_names[0])); i++)
             {
-                error("ERROR reading from socket");
+                if (strcmp(optarg, log_level_names[i]) == 0)
+                {
+                    log_level = i;
+                }
             }
-            buffer[n] = '\0';
-            int key = atoi(buffer);
-            
-            pthread_mutex_lock(&lock);
-            char *response;
-            if (delete(table, key))
+            if (log_level < 0)
             {
-                response = "Key-Value pair deleted successfully";
+                usage(argv[0]);
             }
-            else
+        }
+        else if (opt == 'L' && atoi(optarg) > 0)
+        {
+            log_sample = atoi(optarg);
+        }
+        else if (opt == 'S' && atoi(optarg) > 0)
+        {
+            stats_interval = atoi(optarg);
+        }
+        else if (opt == 'M' && parse_size(optarg) > 0)
+        {
+            maxmemory = parse_size(optarg);
+        }
+        else if (opt == 'E')
+        {
+            eviction_policy = -1;
+            for (int i = 0; i < (int)(sizeof(eviction_names) / sizeof(eviction_names[0])); i++)
             {
-                response = "Error: Key not found";
+                if (strcmp(optarg, eviction_names[i]) == 0)
+                {
+                    eviction_policy = i;
+                }
             }
-            pthread_mutex_unlock(&lock);
-            
-            bzero(buffer, MAX_BUFFER_SIZE);
-            strcpy(buffer, response);
-            n = write(newsockfd, buffer, MAX_BUFFER_SIZE - 1 );
-            if (n < 0)
+            if (eviction_policy < 0)
             {
-                error("ERROR writing to socket");
+                usage(argv[0]);
             }
-
-            printf(" (Key: %d)\n", key);
+        }
+        else if (opt == 'o')
+        {
+            ordered_index = 1;
+        }
+        else if (opt == 'Q' && atoi(optarg) > 0)
+        {
+            pool_queue.cap = atoi(optarg);
+        }
+        else if (opt == 'R' && optarg[0] >= '0' && optarg[0] <= '9')
+        {
+            read_timeout = atoi(optarg);
+        }
+        else if (opt == 'K' && atoi(optarg) > 0)
+        {
+            listen_backlog = atoi(optarg);
+        }
+        else
+        {
+            usage(argv[0]);
         }
     }
-    pthread_exit(NULL);
-}
 
-int main(int argc, char *argv[])
-{
-    int sockfd, portno;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
+    slab_init();
+    epoch_init();
+    stats_init();
+    hash_init();
+    if (ordered_index)
+    {
+        index_init();
+    }
+    track_access = maxmemory > 0 && eviction_policy != EVICT_NONE;
 
-    if (argc != 3)
+    if (bench_engines)
     {
-        fprintf(stderr, "Usage: %s <IP address> <Port number>\n", argv[0]);
-        exit(1);
+        run_engine_benchmark();
+        return 0;
+    }
+    if (argc - optind != 2 && bench_threads == 0)
+    {
+        usage(argv[0]);
+    }
+    if (nthreads < 1)
+    {
+        nthreads = 1;
     }
 
-    pthread_mutex_init(&lock, NULL);
+    engine->init();
 
-    // creating a TCP internet socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    if (bench_threads > 0)
     {
-        error("ERROR opening socket");
+        run_table_benchmark(bench_threads);
+        return 0;
+    }
+    log_init();
+    if (stats_interval > 0 && log_enabled(LOG_INFO))
+    {
+        pthread_t dumper;
+        if (pthread_create(&dumper, NULL, stats_dumper, NULL) != 0)
+        {
+            error("ERROR starting the stats thread");
+        }
+        pthread_detach(dumper);
+    }
+    expiry_suspended = 1;
+    if (snapshot_path != NULL)
+    {
+        snapshot_position = snapshot_load(snapshot_path);
+    }
+    if (wal_path != NULL)
+    {
+        wal_open(wal_path, snapshot_position);
+    }
+    expiry_suspended = 0;
+
+    pthread_t expirer;
+    if (pthread_create(&expirer, NULL, expiry_thread, NULL) != 0)
+    {
+        error("ERROR starting the expiry thread");
     }
+    pthread_detach(expirer);
 
     bzero((char *)&serv_addr, sizeof(serv_addr));
-    portno = atoi(argv[2]);
+    portno = atoi(argv[optind + 1]);
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(portno);
 
     // convert IPv4 addresses from text to binary form
-    if (inet_pton(AF_INET, argv[1], &serv_addr.sin_addr) <= 0)
+    if (inet_pton(AF_INET, argv[optind], &serv_addr.sin_addr) <= 0)
     {
-        struct hostent *server = gethostbyname(argv[1]);
+        struct hostent *server = gethostbyname(argv[optind]);
 
         if (server == NULL)
         {
@@ -439,24 +7728,75 @@ int main(int argc, char *argv[])
         bcopy((char *)server->h_addr_list[0], (char *)&serv_addr.sin_addr.s_addr, server->h_length);
     }
 
-    // binding the socket to the address and port number specified in serv_addr structure
-    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    if (use_uring && !uring_supported())
     {
-        error("ERROR on binding");
+        log_message(LOG_WARN, "io_uring mode unavailable, falling back to epoll");
+        use_uring = 0;
     }
 
-    // listen for incoming connection requests
-    listen(sockfd, 5);
+    // in per-core mode every core listens on a socket of its own
+    sockfd = per_core ? -1 : open_listener(&serv_addr, 0);
+
+    if (use_epoll)
+    {
+        // a fixed set of event loops share the non-blocking listening socket, or each
+        // has its own and a share of the keys
+        if (per_core && nthreads > NUM_STRIPES)
+        {
+            nthreads = NUM_STRIPES;
+        }
+        cores = aligned_alloc(64, nthreads * sizeof(Core));
+        if (cores == NULL)
+        {
+            error("ERROR allocating event loops");
+        }
+        num_cores = nthreads;
+        for (int i = 0; i < nthreads; i++)
+        {
+            memset(&cores[i], 0, sizeof(Core));
+            cores[i].index = i;
+            cores[i].listenfd = per_core ? open_listener(&serv_addr, 1) : sockfd;
+            cores[i].wakefd = per_core ? eventfd(0, EFD_NONBLOCK) : -1;
+            if (per_core && cores[i].wakefd < 0)
+            {
+                error("ERROR creating eventfd");
+            }
+            fcntl(cores[i].listenfd, F_SETFL, fcntl(cores[i].listenfd, F_GETFL) | O_NONBLOCK);
+        }
+        log_message(LOG_INFO, "Serving with %d %s thread(s)", nthreads,
+                    per_core ? "pinned per-core event loop" : use_uring ? "io_uring loop" : "epoll event loop");
+
+        pthread_t *loops = malloc(nthreads * sizeof(pthread_t));
+        for (int i = 0; i < nthreads; i++)
+        {
+            if (pthread_create(&loops[i], NULL, use_uring ? uring_loop : event_loop, &cores[i]) != 0)
+            {
+                error("ERROR creating event loop thread");
+            }
+        }
+        for (int i = 0; i < nthreads; i++)
+        {
+            pthread_join(loops[i], NULL);
+        }
+        free(loops);
+    }
+    else if (use_pool)
+    {
+        // a bounded set of workers runs the requests of every connection, whatever their number
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+        log_message(LOG_INFO, "Serving with %d pool worker thread(s), queue depth %d", nthreads, pool_queue.cap);
+        pool_dispatch(sockfd, nthreads);
+    }
 
     // accept a new request, create a newsockfd
-    while (1)
+    while (!use_epoll && !use_pool)
     {
         clilen = sizeof(cli_addr);
         int *newsockfd = malloc(sizeof(int));
         *newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-        if (newsockfd < 0)
+        if (*newsockfd < 0)
         {
-            perror("ERROR on accept");
+            log_message(LOG_ERROR, "accept: %m");
             free(newsockfd);
             continue;
         }
@@ -466,8 +7806,6 @@ int main(int argc, char *argv[])
         pthread_detach(thread_id);
     }
 
-    pthread_mutex_destroy(&lock);
     close(sockfd);
     return 0;
 }
-